@@ -14,11 +14,17 @@
 #include "constraints.h"  // Constraints
 #include "seqpair.h"      // SeqPair, SeqPairList, Envelope
 #include "eval.h"         // EvaluatedMachine, Tokenizer
+#include "jsonstream.h"   // MachineStreamLoader, SeqPairStreamLoader
+#include "binary.h"       // MachineBinary, MappedFile
+#include "cache.h"        // MachineCache
+#include "npy.h"          // NpyWriter
 
 // --- Algorithms ---
 #include "forward.h"      // ForwardMatrix, RollingOutputForwardMatrix
+#include "batchforward.h" // BatchForwardMatrix
 #include "backward.h"     // BackwardMatrix
 #include "viterbi.h"      // ViterbiMatrix
+#include "posterior.h"    // PosteriorWriter
 #include "counts.h"       // MachineCounts, MachineObjective
 #include "fitter.h"       // MachineFitter
 #include "beam.h"         // BeamSearchMatrix
@@ -31,7 +37,8 @@
 #include "csv.h"          // CSVProfile
 #include "jphmm.h"        // JPHMM
 #include "parsers.h"      // RegexParser, parseWeightExpr
-#include "fastseq.h"      // FastSeq, readFastSeqs
+#include "fastseq.h"      // FastSeq, FastSeqReader, readFastSeqs
+#include "seqstream.h"    // NamedSeqSource, SeqPairProduct, BoundedQueue
 
 // --- Convenience API ---
 #include "api.h"          // High-level free functions
@@ -5,11 +5,15 @@
 #include "beam.h"
 #include "ctc.h"
 #include "fitter.h"
+#include "jsonstream.h"
+#include "binary.h"
 
 using namespace MachineBoss;
 
 Machine MachineBoss::loadMachine (const string& filename) {
-  return JsonReader<Machine>::fromFile (filename);
+  if (MachineBinary::isBinaryFile (filename))
+    return MachineBinary::fromFile (filename);
+  return MachineStreamLoader::fromFile (filename);
 }
 
 Machine MachineBoss::loadMachineJson (const string& jsonString) {
@@ -28,6 +32,19 @@ Machine MachineBoss::mergeEquivalentStates (const Machine& machine) {
   return machine.mergeEquivalentStates();
 }
 
+EvaluatedMachine MachineBoss::evaluateMachine (const Machine& machine, const Params& params) {
+  return EvaluatedMachine (machine, params);
+}
+
+void MachineBoss::updateWeights (EvaluatedMachine& eval, const Params& params) {
+  eval.updateWeights (params);
+}
+
+double MachineBoss::forwardLogLike (const EvaluatedMachine& eval, const SeqPair& seqPair) {
+  const ForwardMatrix fwd (eval, seqPair);
+  return fwd.logLike();
+}
+
 double MachineBoss::forwardLogLike (const Machine& machine, const Params& params, const SeqPair& seqPair) {
   const EvaluatedMachine eval (machine, params);
   const ForwardMatrix fwd (eval, seqPair);
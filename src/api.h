@@ -12,14 +12,19 @@
 namespace MachineBoss {
 
   // Machine I/O
-  Machine loadMachine (const string& filename);
+  Machine loadMachine (const string& filename);  // JSON, or binary (detected by magic number)
   Machine loadMachineJson (const string& jsonString);
   void saveMachine (const Machine&, const string& filename);
   string machineToJson (const Machine&);
 
+  // Evaluated machines, for evaluating many parameter settings against one machine
+  EvaluatedMachine evaluateMachine (const Machine&, const Params&);
+  void updateWeights (EvaluatedMachine&, const Params&);  // keeps topology & indices, recomputes transition weights
+
   // Forward algorithm
   double forwardLogLike (const Machine&, const Params&, const SeqPair&);
   double forwardLogLike (const Machine&, const Params&, const SeqPair&, const Envelope&);
+  double forwardLogLike (const EvaluatedMachine&, const SeqPair&);
 
   // Viterbi
   double viterbiLogLike (const Machine&, const Params&, const SeqPair&);
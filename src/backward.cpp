@@ -86,6 +86,31 @@ void BackwardMatrix::getCounts (const ForwardMatrix& forward, const BackTransVis
   }
 }
 
+void BackwardMatrix::getPostProbs (const ForwardMatrix& forward, const PostProbRowVisitor& visitRow) const {
+  ProgressLog(plogDP,6);
+  plogDP.initProgress ("Calculating posterior state probabilities (%lu cells)", nCellsComputed());
+  CellIndex nCellsDone = 0;
+  const double ll = logLike();
+  const bool possible = ll > -numeric_limits<double>::infinity();
+  vguard<double> row;
+  for (OutputIndex outPos = 0; outPos <= outLen; ++outPos) {
+    const InputIndex inStart = env.inStart[outPos], inEnd = env.inEnd[outPos];
+    row.assign ((inEnd - inStart) * nStates, 0.);
+    if (possible)
+      for (InputIndex inPos = inStart; inPos < inEnd; ++inPos) {
+	plogDP.logProgress (nCellsDone / (double) nCellsComputed(), "visited %lu cells", nCellsDone);
+	nCellsDone += nStates;
+	double* rowCell = row.data() + (inPos - inStart) * nStates;
+	for (StateIndex s = 0; s < nStates; ++s) {
+	  const double logPost = forward.cell(inPos,outPos,s) + cell(inPos,outPos,s) - ll;
+	  if (logPost > -numeric_limits<double>::infinity())
+	    rowCell[s] = exp (logPost);
+	}
+      }
+    visitRow (outPos, inStart, inEnd, row);
+  }
+}
+
 MachinePath BackwardMatrix::traceFrom (const Machine& machine, const ForwardMatrix& forward, InputIndex inPos, OutputIndex outPos, StateIndex state) const {
   return forward.traceBack (machine, inPos, outPos, state).concatenate (traceForward (machine, inPos, outPos, state));
 }
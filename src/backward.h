@@ -33,6 +33,9 @@ public:
     return tv;
   }
 
+  // visitor for a row of posterior state probabilities: (outPos, inStart, inEnd, postProb), where postProb[(inPos-inStart)*nStates + state]
+  typedef function<void(OutputIndex,InputIndex,InputIndex,const vguard<double>&)> PostProbRowVisitor;
+
 private:
   inline void accumulateCounts (double logOddsRatio, const BackTransVisitor& tv, StateIndex src, const EvaluatedMachineState::InOutStateTransMap& inOutStateTransMap, InputToken inTok, OutputToken outTok, InputIndex inPos, OutputIndex outPos) const {
     auto visit = [&] (StateIndex, EvaluatedMachineState::TransIndex ti, double tll) {
@@ -48,6 +51,7 @@ public:
   BackwardMatrix (const EvaluatedMachine&, const SeqPair&, const Envelope&);
   void getCounts (const ForwardMatrix&, const BackTransVisitor&) const;
   void getCounts (const ForwardMatrix&, MachineCounts&) const;
+  void getPostProbs (const ForwardMatrix&, const PostProbRowVisitor&) const;  // one row at a time, in order of increasing outPos
   double logLike() const;
   PostTransQueue postTransQueue (const ForwardMatrix&) const;
   MachinePath traceFrom (const Machine&, const ForwardMatrix&, InputIndex, OutputIndex, StateIndex) const;
@@ -0,0 +1,86 @@
+#include "batchforward.h"
+#include "logsumexp.h"
+#include "logger.h"
+
+using namespace MachineBoss;
+
+BatchForwardMatrix::BatchForwardMatrix (const EvaluatedMachine& machine, const vguard<LogWeight>& logTransWeight, size_t K, const SeqPair& seqPair) :
+  BatchForwardMatrix (machine, logTransWeight, K, seqPair, Envelope (seqPair))
+{ }
+
+BatchForwardMatrix::BatchForwardMatrix (const EvaluatedMachine& machine, const vguard<LogWeight>& logTransWeight, size_t K, const SeqPair& seqPair, const Envelope& env) :
+  machine (machine),
+  K (K),
+  input (machine.inputTokenizer.tokenize (seqPair.input.seq)),
+  output (machine.outputTokenizer.tokenize (seqPair.output.seq)),
+  inLen (input.size()),
+  outLen (output.size()),
+  nStates (machine.nStates()),
+  env (env),
+  logTransWeight (logTransWeight)
+{
+  Assert (logTransWeight.size() == machine.nTransitions * K, "Expected %lu log-weights, got %lu", machine.nTransitions * K, logTransWeight.size());
+  Assert (env.fits (seqPair), "Envelope/sequence mismatch");
+  cellStorage.resize (2 * (inLen + 1) * nStates * K);
+  fill();
+}
+
+vguard<LogWeight> BatchForwardMatrix::logTransWeights (const EvaluatedMachine& machine, const vector<Params>& params) {
+  const size_t K = params.size();
+  vguard<LogWeight> lw (machine.nTransitions * K);
+  for (size_t k = 0; k < K; ++k) {
+    const vguard<LogWeight> lw_k = machine.logTransWeights (params[k]);
+    for (size_t n = 0; n < lw_k.size(); ++n)
+      lw[n*K + k] = lw_k[n];
+  }
+  return lw;
+}
+
+void BatchForwardMatrix::accumulate (double* ll, const EvaluatedMachineState::InOutStateTransMap& incoming, InputToken inTok, OutputToken outTok, InputIndex inPos, OutputIndex outPos) {
+  const auto inIter = incoming.find (inTok);
+  if (inIter != incoming.end()) {
+    const auto outIter = inIter->second.find (outTok);
+    if (outIter != inIter->second.end())
+      for (const auto& st: outIter->second) {
+	const double* src = cell (inPos, outPos, st.first);
+	const LogWeight* lw = logTransWeight.data() + (machine.state[st.first].transOffset + st.second.transIndex) * K;
+	for (size_t k = 0; k < K; ++k)
+	  ll[k] = log_sum_exp (ll[k], src[k] + lw[k]);
+      }
+  }
+}
+
+void BatchForwardMatrix::fill() {
+  ProgressLog(plogDP,6);
+  plogDP.initProgress ("Filling batch Forward matrix (%lu parameterizations)", K);
+  const StateIndex startState = machine.startState();
+  const size_t rowSize = (inLen + 1) * nStates * K;
+  for (OutputIndex outPos = 0; outPos <= outLen; ++outPos) {
+    plogDP.logProgress (outPos / (double) (outLen + 1), "row %ld/%ld", outPos, outLen + 1);
+    double* row = cell (0, outPos, 0);
+    std::fill (row, row + rowSize, -numeric_limits<double>::infinity());
+    const OutputToken outTok = outPos ? output[outPos-1] : OutputTokenizer::emptyToken();
+    for (InputIndex inPos = env.inStart[outPos]; inPos < env.inEnd[outPos]; ++inPos) {
+      const InputToken inTok = inPos ? input[inPos-1] : InputTokenizer::emptyToken();
+      for (StateIndex d = 0; d < nStates; ++d) {
+	const EvaluatedMachineState& state = machine.state[d];
+	double* ll = cell (inPos, outPos, d);
+	if (!inPos && !outPos && d == startState)
+	  std::fill (ll, ll + K, 0.);
+	if (inPos && outPos)
+	  accumulate (ll, state.incoming, inTok, outTok, inPos - 1, outPos - 1);
+	if (inPos)
+	  accumulate (ll, state.incoming, inTok, OutputTokenizer::emptyToken(), inPos - 1, outPos);
+	if (outPos)
+	  accumulate (ll, state.incoming, InputTokenizer::emptyToken(), outTok, inPos, outPos - 1);
+	accumulate (ll, state.incoming, InputTokenizer::emptyToken(), OutputTokenizer::emptyToken(), inPos, outPos);
+      }
+    }
+  }
+  const double* end = cell (inLen, outLen, machine.endState());
+  finalCell = vguard<double> (end, end + K);
+}
+
+vguard<double> BatchForwardMatrix::logLike() const {
+  return finalCell;
+}
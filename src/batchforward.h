@@ -0,0 +1,48 @@
+#ifndef BATCHFORWARD_INCLUDED
+#define BATCHFORWARD_INCLUDED
+
+#include "eval.h"
+#include "seqpair.h"
+
+namespace MachineBoss {
+
+// BatchForwardMatrix runs the Forward algorithm for K parameterizations of the same machine in one sweep.
+// The transition structure of the EvaluatedMachine is traversed once per cell, and each cell holds a K-vector of log-likelihoods.
+// Only two output rows are kept, so only the final log-likelihoods are available.
+class BatchForwardMatrix {
+public:
+  typedef Envelope::InputIndex InputIndex;
+  typedef Envelope::OutputIndex OutputIndex;
+
+  const EvaluatedMachine& machine;
+  const size_t K;  // number of parameterizations
+  const vguard<InputToken> input;
+  const vguard<OutputToken> output;
+  const InputIndex inLen;
+  const OutputIndex outLen;
+  const StateIndex nStates;
+  const Envelope env;
+
+  // logTransWeight[n*K + k] is the log-weight of transition n (indexed by transOffset + TransIndex) in parameterization k
+  BatchForwardMatrix (const EvaluatedMachine&, const vguard<LogWeight>& logTransWeight, size_t K, const SeqPair&);
+  BatchForwardMatrix (const EvaluatedMachine&, const vguard<LogWeight>& logTransWeight, size_t K, const SeqPair&, const Envelope&);
+
+  vguard<double> logLike() const;
+
+  // interleaves the log-weights of each parameterization, as expected by the constructor
+  static vguard<LogWeight> logTransWeights (const EvaluatedMachine&, const vector<Params>&);
+
+private:
+  const vguard<LogWeight>& logTransWeight;
+  vguard<double> cellStorage;  // two rows of (inLen+1) * nStates * K cells
+  vguard<double> finalCell;
+  void fill();
+  inline double* cell (InputIndex inPos, OutputIndex outPos, StateIndex state) {
+    return cellStorage.data() + (((outPos % 2) * (inLen + 1) + inPos) * nStates + state) * K;
+  }
+  void accumulate (double* ll, const EvaluatedMachineState::InOutStateTransMap& incoming, InputToken inTok, OutputToken outTok, InputIndex inPos, OutputIndex outPos);
+};
+
+}  // end namespace
+
+#endif /* BATCHFORWARD_INCLUDED */
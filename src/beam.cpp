@@ -2,91 +2,290 @@
 
 using namespace MachineBoss;
 
-BeamSearchMatrix::SeqNode::SeqNode() :
-  inTok (0),
-  parent (NULL)
-{ }
+const BeamSearchMatrix::NodeIndex BeamSearchMatrix::NoNode;
+const size_t BeamSearchMatrix::HypothesisIndex::EmptySlot;
 
-BeamSearchMatrix::SeqNode::SeqNode (SeqNodePtr p, InputToken t) :
-  inTok (t),
-  parent (p)
-{ }
+void BeamSearchMatrix::HypothesisIndex::clear (size_t expectedSize) {
+  for (size_t slot: usedSlots)
+    slotKey[slot] = EmptySlot;
+  usedSlots.clear();
+  size_t capacity = max ((size_t) 16, mask + 1);
+  while (capacity < 2 * expectedSize)
+    capacity *= 2;
+  if (capacity != mask + 1 || slotKey.empty()) {
+    slotKey.assign (capacity, EmptySlot);
+    slotPos.resize (capacity);
+    mask = capacity - 1;
+  }
+}
+
+size_t BeamSearchMatrix::HypothesisIndex::find (size_t key, size_t newPos) {
+  if (2 * (usedSlots.size() + 1) > mask + 1)
+    grow();
+  size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 16 & mask;
+  while (slotKey[slot] != EmptySlot) {
+    if (slotKey[slot] == key)
+      return slotPos[slot];
+    slot = (slot + 1) & mask;
+  }
+  slotKey[slot] = key;
+  slotPos[slot] = newPos;
+  usedSlots.push_back (slot);
+  return newPos;
+}
 
-BeamSearchMatrix::BeamSearchMatrix (const EvaluatedMachine& machine, const vguard<OutputSymbol>& outSym, size_t bw) :
+void BeamSearchMatrix::HypothesisIndex::grow() {
+  vguard<size_t> oldKey, oldPos;
+  for (size_t slot: usedSlots) {
+    oldKey.push_back (slotKey[slot]);
+    oldPos.push_back (slotPos[slot]);
+  }
+  clear (2 * (mask + 1));
+  for (size_t n = 0; n < oldKey.size(); ++n)
+    find (oldKey[n], oldPos[n]);
+}
+
+BeamSearchMatrix::BeamSearchMatrix (const EvaluatedMachine& machine, const vguard<OutputSymbol>& outSym, size_t bw, size_t nThreads) :
   machine (machine),
   output (machine.outputTokenizer.tokenize (outSym)),
   outLen (output.size()),
   nStates (machine.nStates()),
   inToks (machine.inputTokenizer.tok2sym.size()),
   beamWidth (bw),
-  cellStore (nCells())
+  nThreads (max ((size_t) 1, min (nThreads, (size_t) nStates))),
+  extensions (nStates),
+  threadIndex (this->nThreads)
 {
-  seqNodeStore.push_back (SeqNode());
-  cell(0,0).logWeight[&seqNodeStore.front()] = 0;
+  rowStore[0].resize (nStates);
+  rowStore[1].resize (nStates);
+  seqNodeStore.push_back (SeqNode ({ 0, NoNode, NoNode, NoNode }));
+  cell(0,0).push_back (Hypothesis ({ 0, 0. }));
 
   // for outPos = 0 to outLen
+  //  for dest = 0 to nStates-1 (in parallel)
+  //   for inTok, src in incoming(dest,inTok,outTok) where outTok is output[outPos-1]
+  //    for (seq,prob) in cell(outPos-1,src)
+  //     cell(seq+inTok,outPos,dest) += prob * trans(src,inTok,outTok,dest)
   //  for dest = 0 to nStates-1
-  //   for type in (ins,del,match,null)
-  //    for inTok in inputTokens(type)
-  //     for src in incoming(dest,inTok,outTok)
-  //      for (seq,prob) in src
-  //       cell(seq+inTok,outPos,dest) += prob * trans(src,inTok,outTok,dest)
-  //  keep only top beamWidth elements of cell
+  //   for inTok, src in incoming(dest,inTok,empty) where src <= dest
+  //    for (seq,prob) in cell(outPos,src)
+  //     cell(seq+inTok,outPos,dest) += prob * trans(src,inTok,empty,dest)
+  //   keep only top beamWidth elements of cell
 
+  StateWorkers workers (nStates, threadIndex);
   ProgressLog(plogDP,5);
   plogDP.initProgress ("Performing beam-search (%lu cells)", nCells());
-  for (OutputIndex outPos = 0; outPos <= outLen; ++outPos)
+  for (OutputIndex outPos = 0; outPos <= outLen; ++outPos) {
+    plogDP.logProgress (nStates * outPos / (double) nCells(), "filled %lu cells", nStates * outPos);
+    if (outPos > 0) {
+      for (auto& c: rowStore[outPos & 1])
+	c.clear();  // row outPos-2 is no longer needed; the cells keep their capacity for this row
+      workers.run ([&] (StateIndex dest, HypothesisIndex& index) { gatherFromPreviousRow (outPos, dest, index); });
+      // new trie nodes are created on this thread only, so the parallel stages never modify the trie
+      for (auto& ext: extensions)
+	for (auto& e: ext)
+	  if (e.inTok) {
+	    e.node = extendSeq (e.node, e.inTok);
+	    e.inTok = 0;
+	  }
+      workers.run ([&] (StateIndex dest, HypothesisIndex& index) { mergeFromPreviousRow (outPos, dest, index); });
+    }
     for (StateIndex dest = 0; dest < nStates; ++dest) {
-      plogDP.logProgress ((nStates * outPos + dest) / (double) nCells(), "filled %lu cells", nStates * outPos + dest);
+      followWithinRow (outPos, dest, threadIndex[0]);
       Cell& destCell = cell (outPos, dest);
-      const EvaluatedMachineState::InOutStateTransMap& inOutStateTransMap = machine.state[dest].incoming;
-      for (const auto& tok_ostm: inOutStateTransMap) {
-	const InputToken inTok = tok_ostm.first;
-	if (inTok) {
-	  const EvaluatedMachineState::OutStateTransMap& outStateTransMap = tok_ostm.second;
-	  if (outPos > 0)
-	    accumulate (destCell, outStateTransMap, inTok, output[outPos-1], outPos - 1);
-	  accumulate (destCell, outStateTransMap, inTok, 0, outPos);
-	}
-      }
-      if (inOutStateTransMap.count (0)) {
-	const EvaluatedMachineState::OutStateTransMap& outStateTransMap = inOutStateTransMap.at(0);
-	  if (outPos > 0)
-	    accumulate (destCell, outStateTransMap, 0, output[outPos-1], outPos - 1);
-	  accumulate (destCell, outStateTransMap, 0, 0, outPos);
-      }
-      if (destCell.logWeight.size() > beamWidth) {
-	vguard<SeqNodePtr> seqs = extract_keys (destCell.logWeight);
-	partial_sort (seqs.begin(), seqs.begin() + beamWidth, seqs.end(), destCell);
-	Cell::LogWeightMap lw;
-	for (size_t n = 0; n < beamWidth; ++n) {
-	  const SeqNodePtr node = seqs[n];
-	  lw[node] = destCell.logWeight.at (node);
-	}
-	destCell.logWeight.swap (lw);
-      }
+      prune (destCell);
       if (LoggingThisAt(6)) {
 	vguard<string> seqs;
-	for (const auto& seq_lw: destCell.logWeight)
-	  seqs.push_back (string(join(getSeq(seq_lw.first),"")) + "(" + to_string(seq_lw.second) + ")");
+	for (const auto& hyp: destCell)
+	  seqs.push_back (string(join(getSeq(hyp.node),"")) + "(" + to_string(hyp.logWeight) + ")");
 	clog << "Cell (" << outPos << "," << dest << "): " << to_string_join(seqs) << endl;
       }
     }
+  }
+}
+
+BeamSearchMatrix::StateWorkers::StateWorkers (StateIndex nStates, vguard<HypothesisIndex>& threadIndex) :
+  nStates (nStates),
+  nThreads (threadIndex.size()),
+  threadIndex (threadIndex),
+  visit (NULL),
+  stage (0),
+  nBusy (0),
+  stopping (false),
+  threadError (nThreads)
+{
+  for (size_t t = 1; t < nThreads; ++t) {
+    threads.push_back (thread (&StateWorkers::work, this, t));
+    logger.nameLastThread (threads, "Beam");
+  }
+}
+
+BeamSearchMatrix::StateWorkers::~StateWorkers() {
+  {
+    lock_guard<mutex> lock (mx);
+    stopping = true;
+  }
+  stageStarted.notify_all();
+  for (auto& thr: threads) {
+    logger.eraseThreadName (thr);
+    thr.join();
+  }
+}
+
+void BeamSearchMatrix::StateWorkers::run (const StateVisitor& v) {
+  if (nThreads > 1) {
+    {
+      lock_guard<mutex> lock (mx);
+      visit = &v;
+      nBusy = nThreads - 1;
+      ++stage;
+    }
+    stageStarted.notify_all();
+  } else
+    visit = &v;
+  visitBlock (0);
+  if (nThreads > 1) {
+    unique_lock<mutex> lock (mx);
+    stageFinished.wait (lock, [&] { return nBusy == 0; });
+  }
+  for (const auto& err: threadError)
+    if (err)
+      rethrow_exception (err);
+}
+
+void BeamSearchMatrix::StateWorkers::visitBlock (size_t t) {
+  try {
+    for (StateIndex s = t * nStates / nThreads; s < (t + 1) * nStates / nThreads; ++s)
+      (*visit) (s, threadIndex[t]);
+  } catch (...) {
+    threadError[t] = current_exception();
+  }
+}
+
+void BeamSearchMatrix::StateWorkers::work (size_t t) {
+  size_t lastStage = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock (mx);
+      stageStarted.wait (lock, [&] { return stopping || stage != lastStage; });
+      if (stopping)
+	return;
+      lastStage = stage;
+    }
+    visitBlock (t);
+    {
+      lock_guard<mutex> lock (mx);
+      if (--nBusy == 0)
+	stageFinished.notify_one();
+    }
+  }
+}
+
+void BeamSearchMatrix::gatherFromPreviousRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index) {
+  // merges paths that extend the same hypothesis by the same token, keyed by (node,inTok), before any new trie nodes are created
+  vguard<Extension>& ext = extensions[dest];
+  ext.clear();
+  const OutputToken outTok = output[outPos-1];
+  const EvaluatedMachineState::InOutStateTransMap& inOutStateTransMap = machine.state[dest].incoming;
+  bool indexCleared = false;
+  for (const auto& tok_ostm: inOutStateTransMap) {
+    const InputToken inTok = tok_ostm.first;
+    const auto stmIter = tok_ostm.second.find (outTok);
+    if (stmIter != tok_ostm.second.end())
+      for (const auto& st: stmIter->second) {
+	const Cell& srcCell = cell (outPos - 1, st.first);
+	if (!indexCleared) {
+	  index.clear (beamWidth);
+	  indexCleared = true;
+	}
+	for (const auto& hyp: srcCell) {
+	  const LogWeight lw = hyp.logWeight + st.second.logWeight;
+	  const size_t pos = index.find (hyp.node * inToks + inTok, ext.size());
+	  if (pos == ext.size())
+	    ext.push_back (Extension ({ hyp.node, inTok, lw }));
+	  else
+	    ext[pos].logWeight = log_sum_exp (ext[pos].logWeight, lw);
+	}
+      }
+  }
+}
+
+void BeamSearchMatrix::mergeFromPreviousRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index) {
+  const vguard<Extension>& ext = extensions[dest];
+  Cell& destCell = cell (outPos, dest);
+  index.clear (ext.size());
+  destCell.reserve (ext.size());
+  for (const auto& e: ext)
+    merge (destCell, index, e.node, e.logWeight);
+}
+
+void BeamSearchMatrix::followWithinRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index) {
+  Cell& destCell = cell (outPos, dest);
+  const EvaluatedMachineState::InOutStateTransMap& inOutStateTransMap = machine.state[dest].incoming;
+  bool indexed = false;
+  auto follow = [&] (InputToken inTok, const EvaluatedMachineState::OutStateTransMap& outStateTransMap) {
+    const auto stmIter = outStateTransMap.find (OutputTokenizer::emptyToken());
+    if (stmIter != outStateTransMap.end())
+      for (const auto& st: stmIter->second) {
+	const StateIndex src = st.first;
+	if (src > dest)
+	  continue;  // not yet filled; a machine sorted for decoding has no such transitions
+	if (!indexed) {
+	  index.clear (destCell.size());
+	  for (size_t pos = 0; pos < destCell.size(); ++pos)
+	    index.find (destCell[pos].node, pos);
+	  indexed = true;
+	}
+	const size_t nSrc = cell(outPos,src).size();  // for a self-loop, only the hypotheses already in the cell are extended
+	for (size_t n = 0; n < nSrc; ++n) {
+	  const Hypothesis hyp = cell(outPos,src)[n];
+	  const NodeIndex node = inTok ? extendSeq (hyp.node, inTok) : hyp.node;
+	  merge (destCell, index, node, hyp.logWeight + st.second.logWeight);
+	}
+      }
+  };
+  for (const auto& tok_ostm: inOutStateTransMap)
+    if (tok_ostm.first)
+      follow (tok_ostm.first, tok_ostm.second);
+  if (inOutStateTransMap.count (InputTokenizer::emptyToken()))
+    follow (InputTokenizer::emptyToken(), inOutStateTransMap.at (InputTokenizer::emptyToken()));
+}
+
+void BeamSearchMatrix::prune (Cell& c) const {
+  if (c.size() > beamWidth) {
+    nth_element (c.begin(), c.begin() + beamWidth - 1, c.end(), [] (const Hypothesis& a, const Hypothesis& b) {
+	return a.logWeight > b.logWeight;
+      });
+    c.resize (beamWidth);
+  }
+}
+
+BeamSearchMatrix::NodeIndex BeamSearchMatrix::extendSeq (NodeIndex node, InputToken inTok) {
+  NodeIndex* link = &seqNodeStore[node].firstChild;
+  while (*link != NoNode) {
+    if (seqNodeStore[*link].inTok == inTok)
+      return *link;
+    link = &seqNodeStore[*link].nextSibling;
+  }
+  const NodeIndex child = seqNodeStore.size();
+  *link = child;  // set before push_back, which may move the store
+  seqNodeStore.push_back (SeqNode ({ inTok, node, NoNode, NoNode }));
+  return child;
 }
 
 vguard<InputSymbol> BeamSearchMatrix::bestSeq() {
   const Cell& finalCell = cell (outLen, nStates - 1);
-  pair<SeqNodePtr,LogWeight> best (NULL, -numeric_limits<double>::infinity());
-  for (const auto& seq_lw: finalCell.logWeight)
-    if (seq_lw.second > best.second)
-      best = seq_lw;
-  Assert (best.first, "Beam search failed to find a sequence");
-  return getSeq (best.first);
+  Hypothesis best ({ NoNode, -numeric_limits<double>::infinity() });
+  for (const auto& hyp: finalCell)
+    if (hyp.logWeight > best.logWeight)
+      best = hyp;
+  Assert (best.node != NoNode, "Beam search failed to find a sequence");
+  return getSeq (best.node);
 }
 
-vguard<InputSymbol> BeamSearchMatrix::getSeq (SeqNodePtr node) const {
+vguard<InputSymbol> BeamSearchMatrix::getSeq (NodeIndex node) const {
   list<InputToken> result;
-  for (; node && node->inTok; node = node->parent)
-    result.push_front (node->inTok);
+  for (; node != NoNode && seqNodeStore[node].inTok; node = seqNodeStore[node].parent)
+    result.push_front (seqNodeStore[node].inTok);
   return machine.inputTokenizer.detokenize (vguard<InputToken> (result.begin(), result.end()));
 }
@@ -4,6 +4,9 @@
 #include <list>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "dpmatrix.h"
 #include "logger.h"
@@ -12,32 +15,85 @@
 
 namespace MachineBoss {
 
+// Beam search for the most likely input sequence, given an output sequence.
+// Each (outPos,state) cell holds up to beamWidth hypotheses: (input sequence, log-weight) pairs, summed over paths.
+// Input sequences are nodes of a trie, stored in an arena & referred to by index.
+// Only the current & previous rows of cells are kept, in two row buffers that are used alternately.
+// Within an output row, transitions from the previous row are gathered in parallel across destination states (if nThreads > 1),
+// by a set of worker threads that persists for the whole search;
+// transitions within the row (which do not emit output) are then followed, & the cells pruned, in state order.
+// The result does not depend on nThreads.
 class BeamSearchMatrix {
 public:
   typedef Envelope::InputIndex InputIndex;
   typedef Envelope::OutputIndex OutputIndex;
 
-  BeamSearchMatrix (const EvaluatedMachine& machine, const vguard<OutputSymbol>& outSym, size_t beamWidth = DefaultBeamWidth);
+  BeamSearchMatrix (const EvaluatedMachine& machine, const vguard<OutputSymbol>& outSym, size_t beamWidth = DefaultBeamWidth, size_t nThreads = 1);
 
   vguard<InputSymbol> bestSeq();
 
 private:
+  typedef size_t NodeIndex;
+  static const NodeIndex NoNode = numeric_limits<NodeIndex>::max();
+
+  // a trie node; each node's children form a linked list of siblings, since most nodes have few children
   struct SeqNode {
-    typedef SeqNode* SeqNodePtr;
-    const InputToken inTok;
-    const SeqNodePtr parent;
-    vguard<SeqNodePtr> child;
-    SeqNode();
-    SeqNode (SeqNodePtr p, InputToken t);
+    InputToken inTok;
+    NodeIndex parent, firstChild, nextSibling;
+  };
+
+  struct Hypothesis {
+    NodeIndex node;
+    LogWeight logWeight;
+  };
+  typedef vguard<Hypothesis> Cell;
+
+  // a hypothesis from the previous row, extended by a transition; node is replaced by the extended node once that is looked up
+  struct Extension {
+    NodeIndex node;
+    InputToken inTok;  // 0 once node has been extended
+    LogWeight logWeight;
+  };
+
+  // HypothesisIndex is an open-addressing hash table from keys to positions in a list of hypotheses, used to merge paths to the same sequence.
+  // It is cleared & reused for each cell, so a thread allocates only when a cell is bigger than any before.
+  class HypothesisIndex {
+  public:
+    HypothesisIndex() : mask(0) { }
+    void clear (size_t expectedSize);
+    // returns the position for key; if key is new, inserts it with position newPos
+    size_t find (size_t key, size_t newPos);
+  private:
+    vguard<size_t> slotKey, slotPos, usedSlots;
+    size_t mask;
+    static const size_t EmptySlot = numeric_limits<size_t>::max();
+    void grow();
   };
 
-  typedef SeqNode::SeqNodePtr SeqNodePtr;
-  struct Cell {
-    typedef map<SeqNodePtr,double> LogWeightMap;
-    LogWeightMap logWeight;
-    bool operator() (SeqNodePtr a, SeqNodePtr b) const {
-      return logWeight.at(a) > logWeight.at(b);
-    }
+  typedef function<void(StateIndex,HypothesisIndex&)> StateVisitor;
+
+  // StateWorkers visits the states in parallel, one stage at a time, each thread taking a contiguous block of states.
+  // The threads are started once; the calling thread takes the first block, & each stage ends when all blocks are done.
+  class StateWorkers {
+  public:
+    StateWorkers (StateIndex nStates, vguard<HypothesisIndex>& threadIndex);  // one thread per HypothesisIndex
+    ~StateWorkers();
+    StateWorkers (const StateWorkers&) = delete;
+    StateWorkers& operator= (const StateWorkers&) = delete;
+    void run (const StateVisitor& visit);
+  private:
+    const StateIndex nStates;
+    const size_t nThreads;
+    vguard<HypothesisIndex>& threadIndex;
+    list<thread> threads;
+    mutex mx;
+    condition_variable stageStarted, stageFinished;
+    const StateVisitor* visit;
+    size_t stage, nBusy;
+    bool stopping;
+    vguard<exception_ptr> threadError;
+    void visitBlock (size_t t);
+    void work (size_t t);
   };
 
   const EvaluatedMachine& machine;
@@ -47,51 +103,41 @@ private:
   const InputToken inToks;
   const size_t beamWidth;
 
-  list<SeqNode> seqNodeStore;
-  vguard<Cell> cellStore;
+  const size_t nThreads;
+
+  vguard<SeqNode> seqNodeStore;
+  vguard<Cell> rowStore[2];  // even & odd rows
+  vguard<vguard<Extension> > extensions;  // indexed by destination state; reused for each row
+  vguard<HypothesisIndex> threadIndex;
 
   inline size_t nCells() const {
     return (outLen + 1) * nStates;
   }
 
-  inline size_t cellIndex (OutputIndex outPos, StateIndex state) const {
-    return outPos * nStates + state;
-  }
-
   inline Cell& cell (OutputIndex outPos, StateIndex state) {
-    return cellStore [cellIndex (outPos, state)];
+    return rowStore[outPos & 1][state];
   }
 
   inline const Cell& cell (OutputIndex outPos, StateIndex state) const {
-    return cellStore [cellIndex (outPos, state)];
+    return rowStore[outPos & 1][state];
   }
 
-  inline void accumulate (Cell& destCell, const EvaluatedMachineState::OutStateTransMap& outStateTransMap, InputToken inTok, OutputToken outTok, OutputIndex outPos) {
-    if (outStateTransMap.count (outTok)) {
-      for (const auto& st: outStateTransMap.at (outTok)) {
-	const EvaluatedMachineState::Trans& trans = st.second;
-	const Cell& srcCell = cell (outPos, st.first);
-	for (const auto& seq_lw: srcCell.logWeight) {
-	  const SeqNodePtr prevNode = seq_lw.first;
-	  const SeqNodePtr node = inTok ? extendSeq(prevNode,inTok) : prevNode;
-	  const LogWeight lw = seq_lw.second + trans.logWeight;
-	  destCell.logWeight[node] = destCell.logWeight.count(node) ? log_sum_exp (destCell.logWeight.at(node), lw) : lw;
-	}
-      }
-    }
+  static inline void merge (Cell& destCell, HypothesisIndex& index, NodeIndex node, LogWeight lw) {
+    const size_t pos = index.find (node, destCell.size());
+    if (pos == destCell.size())
+      destCell.push_back (Hypothesis ({ node, lw }));
+    else
+      destCell[pos].logWeight = log_sum_exp (destCell[pos].logWeight, lw);
   }
 
-  inline SeqNodePtr extendSeq (SeqNodePtr node, InputToken inTok) {
-    if (node->child.empty())
-      node->child.insert (node->child.end(), inToks, NULL);
-    if (!node->child[inTok]) {
-      seqNodeStore.push_back (SeqNode (node, inTok));
-      node->child[inTok] = &seqNodeStore.back();
-    }
-    return node->child[inTok];
-  }
+  NodeIndex extendSeq (NodeIndex node, InputToken inTok);
+
+  void gatherFromPreviousRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index);
+  void mergeFromPreviousRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index);
+  void followWithinRow (OutputIndex outPos, StateIndex dest, HypothesisIndex& index);
+  void prune (Cell&) const;
 
-  vguard<InputSymbol> getSeq (SeqNodePtr) const;
+  vguard<InputSymbol> getSeq (NodeIndex) const;
 };
 
 }  // end namespace
@@ -0,0 +1,602 @@
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binary.h"
+#include "logger.h"
+#include "util.h"
+
+#define MachineBinaryHasStateNames 1
+#define MachineBinaryNullWeight 0xffffffff
+
+using namespace MachineBoss;
+
+struct BinaryWriter {
+  ostream& out;
+  BinaryWriter (ostream& out) : out(out) { }
+
+  void u8 (uint8_t x) { out.put ((char) x); }
+  void u32 (uint32_t x) {
+    char buf[4];
+    for (int n = 0; n < 4; ++n)
+      buf[n] = (char) ((x >> (8*n)) & 0xff);
+    out.write (buf, 4);
+  }
+  void u64 (uint64_t x) {
+    char buf[8];
+    for (int n = 0; n < 8; ++n)
+      buf[n] = (char) ((x >> (8*n)) & 0xff);
+    out.write (buf, 8);
+  }
+  void i32 (int32_t x) { u32 ((uint32_t) x); }
+  void f64 (double x) {
+    uint64_t bits;
+    memcpy (&bits, &x, sizeof(bits));
+    u64 (bits);
+  }
+  void strings (const vguard<string>& table) {
+    u64 (table.size());
+    uint64_t offset = 0;
+    u64 (offset);
+    for (const auto& s: table)
+      u64 (offset += s.size());
+    for (const auto& s: table)
+      out.write (s.data(), s.size());
+  }
+  void names (const vguard<string>& names, const map<string,uint32_t>& index) {
+    u64 (names.size());
+    for (const auto& name: names)
+      u32 (index.at (name));
+  }
+};
+
+struct BinaryReader {
+  const unsigned char *p, *end;
+  BinaryReader (const char* data, size_t size) : p((const unsigned char*) data), end((const unsigned char*) data + size) { }
+
+  uint64_t remaining() const { return end - p; }
+  void need (uint64_t n) const {
+    Require (n <= remaining(), "Truncated binary machine file");
+  }
+  // checks that n items of the given width fit in the rest of the file, without overflowing n * width
+  void needArray (uint64_t n, uint64_t width) const {
+    Require (n <= remaining() / width, "Truncated binary machine file");
+  }
+  // reads a count n, then n+1 nondecreasing offsets starting from zero (CSR format)
+  vguard<uint64_t> offsets (const char* error) {
+    const uint64_t n = u64();
+    Require (n < remaining() / 8, "Truncated binary machine file");
+    vguard<uint64_t> offset (n + 1);
+    for (auto& o: offset)
+      o = u64();
+    Require (offset[0] == 0, error);
+    for (uint64_t i = 0; i < n; ++i)
+      Require (offset[i] <= offset[i+1], error);
+    return offset;
+  }
+  uint8_t u8() { need(1); return *p++; }
+  uint32_t u32() {
+    need(4);
+    uint32_t x = 0;
+    for (int n = 0; n < 4; ++n)
+      x |= ((uint32_t) *p++) << (8*n);
+    return x;
+  }
+  uint64_t u64() {
+    need(8);
+    uint64_t x = 0;
+    for (int n = 0; n < 8; ++n)
+      x |= ((uint64_t) *p++) << (8*n);
+    return x;
+  }
+  int32_t i32() { return (int32_t) u32(); }
+  double f64() {
+    const uint64_t bits = u64();
+    double x;
+    memcpy (&x, &bits, sizeof(x));
+    return x;
+  }
+  vguard<string> strings() {
+    const vguard<uint64_t> offset = offsets ("Bad string table in binary machine file");
+    const uint64_t n = offset.size() - 1;
+    need (offset.back());
+    vguard<string> table;
+    table.reserve (n);
+    for (uint64_t i = 0; i < n; ++i)
+      table.push_back (string ((const char*) p + offset[i], offset[i+1] - offset[i]));
+    p += offset.back();
+    return table;
+  }
+  uint32_t index (size_t size) {
+    const uint32_t i = u32();
+    Require (i < size, "Index out of range in binary machine file");
+    return i;
+  }
+  vguard<string> names (const vguard<string>& table) {
+    const uint64_t n = u64();
+    needArray (n, 4);
+    vguard<string> names;
+    names.reserve (n);
+    for (uint64_t i = 0; i < n; ++i)
+      names.push_back (table[index (table.size())]);
+    return names;
+  }
+};
+
+// assigns indices to the nodes of the expression DAG, children first
+struct ExprIndexer {
+  map<WeightExpr,uint32_t> index;
+  vguard<WeightExpr> node;
+  map<string,uint32_t> paramIndex;
+  vguard<string> param;
+
+  void addParam (const string& name) {
+    if (!paramIndex.count (name)) {
+      paramIndex[name] = param.size();
+      param.push_back (name);
+    }
+  }
+
+  void add (WeightExpr w) {
+    if (!w || index.count (w))
+      return;
+    switch (w->type) {
+    case Log:
+    case Exp:
+      add (w->args.arg);
+      break;
+    case Mul:
+    case Add:
+    case Sub:
+    case Div:
+    case Pow:
+      add (w->args.binary.l);
+      add (w->args.binary.r);
+      break;
+    case Param:
+      addParam (*w->args.param);
+      break;
+    default:
+      break;
+    }
+    index[w] = node.size();
+    node.push_back (w);
+  }
+
+  uint32_t operator() (WeightExpr w) const {
+    return w ? index.at(w) : MachineBinaryNullWeight;
+  }
+};
+
+template<class StateVec>
+void writeStateNames (BinaryWriter& writer, const StateVec& state) {
+  vguard<string> names;
+  names.reserve (state.size());
+  for (const auto& ms: state)
+    names.push_back (ms.name.is_null() ? string() : ms.name.dump());
+  writer.strings (names);
+}
+
+// state names are kept as JSON text, and parsed only when rendered
+template<class StateVec>
+void readStateNames (BinaryReader& reader, StateVec& state) {
+  vguard<string> names = reader.strings();
+  Require (names.size() == state.size(), "Wrong number of state names in binary machine file");
+  shared_ptr<StateNameArena> arena = make_shared<StateNameArena> (StateNameArena::Text);
+  arena->text.swap (names);
+  for (size_t s = 0; s < state.size(); ++s)
+    if (!arena->text[s].empty())
+      state[s].name = StateName (arena, s);
+}
+
+static vguard<string> symbolTable (const vguard<string>& alph, map<string,uint32_t>& index) {
+  for (size_t n = 0; n < alph.size(); ++n)
+    index[alph[n]] = n + 1;
+  index[string()] = 0;
+  return alph;
+}
+
+void MachineBinary::writeBinary (const Machine& machine, ostream& out, bool saveStateNames) {
+  BinaryWriter writer (out);
+
+  map<string,uint32_t> inIndex, outIndex;
+  const vguard<string> inAlph = symbolTable (machine.inputAlphabet(), inIndex);
+  const vguard<string> outAlph = symbolTable (machine.outputAlphabet(), outIndex);
+
+  ExprIndexer exprs;
+  for (const auto& def: machine.funcs.defs) {
+    exprs.addParam (def.first);
+    exprs.add (def.second);
+  }
+  for (const auto& p: machine.cons.prob)
+    exprs.addParam (p);
+  for (const auto& r: machine.cons.rate)
+    exprs.addParam (r);
+  for (const auto& norm: machine.cons.norm)
+    for (const auto& n: norm)
+      exprs.addParam (n);
+  for (const auto& ms: machine.state)
+    for (const auto& t: ms.trans)
+      exprs.add (t.weight);
+
+  out.write (MachineBinaryMagic, MachineBinaryMagicLength);
+  writer.u32 (MachineBinaryVersion);
+  writer.u32 (saveStateNames ? MachineBinaryHasStateNames : 0);
+
+  writer.strings (inAlph);
+  writer.strings (outAlph);
+  writer.strings (exprs.param);
+
+  writer.u64 (exprs.node.size());
+  for (const auto& w: exprs.node) {
+    writer.u8 ((uint8_t) w->type);
+    switch (w->type) {
+    case Int:
+      writer.i32 (w->args.intValue);
+      break;
+    case Dbl:
+      writer.f64 (w->args.doubleValue);
+      break;
+    case Param:
+      writer.u32 (exprs.paramIndex.at (*w->args.param));
+      break;
+    case Log:
+    case Exp:
+      writer.u32 (exprs (w->args.arg));
+      break;
+    case Mul:
+    case Add:
+    case Sub:
+    case Div:
+    case Pow:
+      writer.u32 (exprs (w->args.binary.l));
+      writer.u32 (exprs (w->args.binary.r));
+      break;
+    default:
+      Abort ("Unknown expression type");
+      break;
+    }
+  }
+
+  writer.u64 (machine.funcs.defs.size());
+  for (const auto& def: machine.funcs.defs) {
+    writer.u32 (exprs.paramIndex.at (def.first));
+    writer.u32 (exprs (def.second));
+  }
+
+  writer.names (machine.cons.prob, exprs.paramIndex);
+  writer.names (machine.cons.rate, exprs.paramIndex);
+  writer.u64 (machine.cons.norm.size());
+  for (const auto& norm: machine.cons.norm)
+    writer.names (norm, exprs.paramIndex);
+
+  writer.u64 (machine.nStates());
+  uint64_t offset = 0;
+  writer.u64 (offset);
+  for (const auto& ms: machine.state)
+    writer.u64 (offset += ms.trans.size());
+  for (const auto& ms: machine.state)
+    for (const auto& t: ms.trans) {
+      writer.u32 (inIndex.at (t.in));
+      writer.u32 (outIndex.at (t.out));
+      writer.u64 (t.dest);
+      writer.u32 (exprs (t.weight));
+    }
+
+  if (saveStateNames)
+    writeStateNames (writer, machine.state);
+}
+
+void MachineBinary::toFile (const Machine& machine, const string& filename, bool saveStateNames) {
+  ofstream out (filename, ios::binary);
+  if (!out)
+    Fail ("Couldn't open file: %s", filename.c_str());
+  writeBinary (machine, out, saveStateNames);
+}
+
+Machine MachineBinary::fromBuffer (const char* data, size_t size) {
+  Require (isBinary (data, size), "Not a binary machine file");
+  BinaryReader reader (data + MachineBinaryMagicLength, size - MachineBinaryMagicLength);
+  const uint32_t version = reader.u32();
+  Require (version == MachineBinaryVersion, "Binary machine file has version %u; this build reads version %u", version, MachineBinaryVersion);
+  const uint32_t flags = reader.u32();
+
+  const vguard<string> inAlph = reader.strings();
+  const vguard<string> outAlph = reader.strings();
+  const vguard<string> param = reader.strings();
+
+  const uint64_t nNodes = reader.u64();
+  reader.needArray (nNodes, 1);  // every node takes at least one byte
+  vguard<WeightExpr> node;
+  node.reserve (nNodes);
+  for (uint64_t n = 0; n < nNodes; ++n) {
+    const ExprType type = (ExprType) reader.u8();
+    WeightExpr w = NULL;
+    switch (type) {
+    case Int:
+      w = WeightAlgebra::intConstant (reader.i32());
+      break;
+    case Dbl:
+      w = WeightAlgebra::doubleConstant (reader.f64());
+      break;
+    case Param:
+      w = WeightAlgebra::param (param[reader.index (param.size())]);
+      break;
+    case Log:
+    case Exp:
+      w = WeightAlgebra::unaryNode (type, node[reader.index (node.size())]);
+      break;
+    case Mul:
+    case Add:
+    case Sub:
+    case Div:
+    case Pow:
+      {
+	const WeightExpr l = node[reader.index (node.size())];
+	const WeightExpr r = node[reader.index (node.size())];
+	w = WeightAlgebra::binaryNode (type, l, r);
+      }
+      break;
+    default:
+      Fail ("Unknown expression type %d in binary machine file", (int) type);
+      break;
+    }
+    node.push_back (w);
+  }
+  auto weight = [&] () -> WeightExpr {
+    const uint32_t i = reader.u32();
+    if (i == MachineBinaryNullWeight)
+      return NULL;
+    Require (i < node.size(), "Index out of range in binary machine file");
+    return node[i];
+  };
+
+  Machine machine;
+  const uint64_t nDefs = reader.u64();
+  for (uint64_t n = 0; n < nDefs; ++n) {
+    const string& name = param[reader.index (param.size())];
+    machine.funcs.defs[name] = weight();
+  }
+
+  machine.cons.prob = reader.names (param);
+  machine.cons.rate = reader.names (param);
+  const uint64_t nNorms = reader.u64();
+  for (uint64_t n = 0; n < nNorms; ++n)
+    machine.cons.norm.push_back (reader.names (param));
+
+  const vguard<uint64_t> transOffset = reader.offsets ("Bad transition offsets in binary machine file");
+  const uint64_t nStates = transOffset.size() - 1;
+  reader.needArray (transOffset.back(), 20);
+  machine.state.resize (nStates);
+  for (uint64_t s = 0; s < nStates; ++s) {
+    TransList& trans = machine.state[s].trans;
+    for (uint64_t t = transOffset[s]; t < transOffset[s+1]; ++t) {
+      const uint32_t in = reader.index (inAlph.size() + 1);
+      const uint32_t out = reader.index (outAlph.size() + 1);
+      const uint64_t dest = reader.u64();
+      Require (dest < nStates, "State %lu does not exist", dest);
+      trans.push_back (MachineTransition (in ? inAlph[in-1] : string(),
+					  out ? outAlph[out-1] : string(),
+					  dest,
+					  weight()));
+    }
+  }
+
+  if (flags & MachineBinaryHasStateNames)
+    readStateNames (reader, machine.state);
+
+  return machine;
+}
+
+bool MachineBinary::isBinary (const char* data, size_t size) {
+  return size >= MachineBinaryMagicLength && memcmp (data, MachineBinaryMagic, MachineBinaryMagicLength) == 0;
+}
+
+// only regular files are checked, since peeking would consume the start of a pipe
+static bool fileHasMagic (const string& filename, const char* expectedMagic) {
+  struct stat st;
+  if (stat (filename.c_str(), &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+  ifstream in (filename, ios::binary);
+  char magic[MachineBinaryMagicLength];
+  return in.read (magic, MachineBinaryMagicLength) && memcmp (magic, expectedMagic, MachineBinaryMagicLength) == 0;
+}
+
+bool MachineBinary::isBinaryFile (const string& filename) {
+  return fileHasMagic (filename, MachineBinaryMagic);
+}
+
+MappedFile::MappedFile (const string& filename) :
+  mapped (NULL),
+  mappedSize (0)
+{
+  const int fd = open (filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    Fail ("File not found: %s", filename.c_str());
+  struct stat st;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0) {
+    void* addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      mapped = addr;
+      mappedSize = st.st_size;
+      LogThisAt(5,"Memory-mapped " << mappedSize << " bytes from " << filename << endl);
+    }
+  }
+  close (fd);
+  if (!mapped) {
+    ifstream in (filename, ios::binary);
+    contents.assign (istreambuf_iterator<char> (in), istreambuf_iterator<char>());
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (mapped)
+    munmap (mapped, mappedSize);
+}
+
+Machine MachineBinary::fromFile (const string& filename) {
+  const MappedFile file (filename);
+  return fromBuffer (file.data(), file.size());
+}
+
+void EvaluatedMachineBinary::writeBinary (const EvaluatedMachine& eval, ostream& out, bool saveStateNames) {
+  BinaryWriter writer (out);
+
+  out.write (EvaluatedMachineBinaryMagic, MachineBinaryMagicLength);
+  writer.u32 (EvaluatedMachineBinaryVersion);
+  writer.u32 (saveStateNames ? MachineBinaryHasStateNames : 0);
+
+  writer.strings (vguard<string> (eval.inputTokenizer.tok2sym.begin() + 1, eval.inputTokenizer.tok2sym.end()));
+  writer.strings (vguard<string> (eval.outputTokenizer.tok2sym.begin() + 1, eval.outputTokenizer.tok2sym.end()));
+
+  // recover each state's transitions, in TransIndex order, from its outgoing map
+  writer.u64 (eval.nStates());
+  uint64_t offset = 0;
+  writer.u64 (offset);
+  for (const auto& ms: eval.state)
+    writer.u64 (offset += ms.nTransitions);
+  struct Trans {
+    InputToken in;
+    OutputToken out;
+    StateIndex dest;
+  };
+  for (const auto& ms: eval.state) {
+    vguard<Trans> trans (ms.nTransitions);
+    for (const auto& in_ost: ms.outgoing)
+      for (const auto& out_st: in_ost.second)
+	for (const auto& st: out_st.second)
+	  trans[st.second.transIndex] = Trans { in_ost.first, out_st.first, st.first };
+    for (EvaluatedMachineState::TransIndex ti = 0; ti < ms.nTransitions; ++ti) {
+      writer.u32 (trans[ti].in);
+      writer.u32 (trans[ti].out);
+      writer.u64 (trans[ti].dest);
+      writer.f64 (ms.logTransWeight[ti]);
+    }
+  }
+
+  if (saveStateNames)
+    writeStateNames (writer, eval.state);
+}
+
+void EvaluatedMachineBinary::toFile (const EvaluatedMachine& eval, const string& filename, bool saveStateNames) {
+  ofstream out (filename, ios::binary);
+  if (!out)
+    Fail ("Couldn't open file: %s", filename.c_str());
+  writeBinary (eval, out, saveStateNames);
+}
+
+EvaluatedMachine EvaluatedMachineBinary::fromBuffer (const char* data, size_t size) {
+  Require (size >= MachineBinaryMagicLength && memcmp (data, EvaluatedMachineBinaryMagic, MachineBinaryMagicLength) == 0,
+	   "Not a binary evaluated machine file");
+  BinaryReader reader (data + MachineBinaryMagicLength, size - MachineBinaryMagicLength);
+  const uint32_t version = reader.u32();
+  Require (version == EvaluatedMachineBinaryVersion, "Binary evaluated machine file has version %u; this build reads version %u", version, EvaluatedMachineBinaryVersion);
+  const uint32_t flags = reader.u32();
+
+  EvaluatedMachine eval;
+  eval.inputTokenizer = InputTokenizer (reader.strings());
+  eval.outputTokenizer = OutputTokenizer (reader.strings());
+
+  const vguard<uint64_t> transOffset = reader.offsets ("Bad transition offsets in binary evaluated machine file");
+  const uint64_t nStates = transOffset.size() - 1;
+  reader.needArray (transOffset.back(), 24);
+  eval.state.resize (nStates);
+  for (uint64_t s = 0; s < nStates; ++s) {
+    EvaluatedMachineState& ms = eval.state[s];
+    ms.nTransitions = transOffset[s+1] - transOffset[s];
+    ms.transOffset = transOffset[s];
+    ms.logTransWeight.reserve (ms.nTransitions);
+    for (EvaluatedMachineState::TransIndex ti = 0; ti < ms.nTransitions; ++ti) {
+      const InputToken in = reader.index (eval.inputTokenizer.tok2sym.size());
+      const OutputToken out = reader.index (eval.outputTokenizer.tok2sym.size());
+      const uint64_t dest = reader.u64();
+      Require (dest < nStates, "State %lu does not exist", dest);
+      const LogWeight lw = reader.f64();
+      ms.outgoing[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (dest, EvaluatedMachineState::Trans ({ .logWeight = lw, .transIndex = ti })));
+      eval.state[dest].incoming[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (s, EvaluatedMachineState::Trans ({ .logWeight = lw, .transIndex = ti })));
+      ms.logTransWeight.push_back (lw);
+    }
+  }
+  eval.nTransitions = transOffset.back();
+
+  if (flags & MachineBinaryHasStateNames)
+    readStateNames (reader, eval.state);
+
+  LogThisAt(5,"Loaded evaluated machine with " << nStates << " states and " << eval.nTransitions << " transitions" << endl);
+  return eval;
+}
+
+EvaluatedMachine EvaluatedMachineBinary::fromFile (const string& filename) {
+  const MappedFile file (filename);
+  return fromBuffer (file.data(), file.size());
+}
+
+void MachineCountsBinary::writeBinary (const MachineCounts& counts, ostream& out) {
+  BinaryWriter writer (out);
+  out.write (MachineCountsBinaryMagic, MachineBinaryMagicLength);
+  writer.u32 (MachineCountsBinaryVersion);
+  writer.f64 (counts.loglike);
+  writer.u64 (counts.count.size());
+  uint64_t offset = 0;
+  writer.u64 (offset);
+  for (const auto& c: counts.count)
+    writer.u64 (offset += c.size());
+  for (const auto& c: counts.count)
+    for (double x: c)
+      writer.f64 (x);
+}
+
+void MachineCountsBinary::toFile (const MachineCounts& counts, const string& filename) {
+  ofstream out (filename, ios::binary);
+  if (!out)
+    Fail ("Couldn't open file: %s", filename.c_str());
+  writeBinary (counts, out);
+}
+
+MachineCounts MachineCountsBinary::fromBuffer (const char* data, size_t size) {
+  Require (size >= MachineBinaryMagicLength && memcmp (data, MachineCountsBinaryMagic, MachineBinaryMagicLength) == 0,
+	   "Not a binary counts file");
+  BinaryReader reader (data + MachineBinaryMagicLength, size - MachineBinaryMagicLength);
+  const uint32_t version = reader.u32();
+  Require (version == MachineCountsBinaryVersion, "Binary counts file has version %u; this build reads version %u", version, MachineCountsBinaryVersion);
+  MachineCounts counts;
+  counts.loglike = reader.f64();
+  const vguard<uint64_t> transOffset = reader.offsets ("Bad transition offsets in binary counts file");
+  const uint64_t nStates = transOffset.size() - 1;
+  reader.needArray (transOffset.back(), 8);
+  counts.count.resize (nStates);
+  for (uint64_t s = 0; s < nStates; ++s) {
+    counts.count[s].reserve (transOffset[s+1] - transOffset[s]);
+    for (uint64_t t = transOffset[s]; t < transOffset[s+1]; ++t)
+      counts.count[s].push_back (reader.f64());
+  }
+  return counts;
+}
+
+MachineCounts MachineCountsBinary::fromFile (const string& filename) {
+  const MappedFile file (filename);
+  return fromBuffer (file.data(), file.size());
+}
+
+bool MachineCountsBinary::isBinaryFile (const string& filename) {
+  return fileHasMagic (filename, MachineCountsBinaryMagic);
+}
+
+MachineCounts MachineCountsBinary::fromPartialFile (const string& filename) {
+  if (isBinaryFile (filename))
+    return fromFile (filename);
+  ifstream in (filename);
+  if (!in)
+    Fail ("File not found: %s", filename.c_str());
+  json j;
+  try {
+    in >> j;
+  } catch (const json::exception& e) {
+    Fail ("%s: %s", filename.c_str(), e.what());
+  }
+  MachineCounts counts;
+  counts.readPartialJson (j);
+  return counts;
+}
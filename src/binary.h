@@ -0,0 +1,92 @@
+#ifndef BINARY_INCLUDED
+#define BINARY_INCLUDED
+
+#include <cstdint>
+#include "machine.h"
+#include "eval.h"
+#include "counts.h"
+
+#define MachineBinaryMagic "MBOSSBIN"
+#define MachineBinaryMagicLength 8
+#define MachineBinaryVersion 1
+
+#define EvaluatedMachineBinaryMagic "MBOSSEVL"
+#define EvaluatedMachineBinaryVersion 1
+
+#define MachineCountsBinaryMagic "MBOSSCNT"
+#define MachineCountsBinaryVersion 1
+
+namespace MachineBoss {
+
+using namespace std;
+
+// MappedFile is a read-only view of a whole file: memory-mapped if possible, otherwise (e.g. for a pipe) read into memory
+class MappedFile {
+public:
+  MappedFile (const string& filename);
+  ~MappedFile();
+  MappedFile (const MappedFile&) = delete;
+  MappedFile& operator= (const MappedFile&) = delete;
+  const char* data() const { return mapped ? (const char*) mapped : contents.data(); }
+  size_t size() const { return mapped ? mappedSize : contents.size(); }
+private:
+  void* mapped;
+  size_t mappedSize;
+  string contents;
+};
+
+// Versioned binary format for machines, designed to be memory-mapped and loaded without any text parsing.
+// All integers are little-endian. Layout (version 1):
+//   magic "MBOSSBIN", u32 version, u32 flags (bit 0: state names present)
+//   input alphabet, output alphabet, parameter names: string tables (u64 count, u64 offsets[count+1], characters)
+//   expression DAG: u64 nodes, then for each node (children before parents) u8 type and its arguments:
+//     Int: i32 value; Dbl: f64 value; Param: u32 parameter name; Log, Exp: u32 node; Mul, Add, Sub, Div, Pow: u32 node, u32 node
+//   funcs: u64 count, then (u32 parameter name, u32 node) pairs
+//   cons: prob & rate as u64 count + u32 parameter names, then u64 norm groups, each as u64 count + u32 parameter names
+//   states: u64 nStates, u64 transOffset[nStates+1] (CSR), then per transition u32 input, u32 output, u64 dest, u32 weight node
+//     (symbol 0 is the empty string, symbol k>0 is alphabet entry k-1; weight node ~0 is a null weight)
+//   state names (if flagged): string table of JSON texts, with the empty string for a null name; parsed only when rendered
+struct MachineBinary {
+  static void writeBinary (const Machine& machine, ostream& out, bool saveStateNames = true);
+  static void toFile (const Machine& machine, const string& filename, bool saveStateNames = true);
+
+  static Machine fromBuffer (const char* data, size_t size);
+  static Machine fromFile (const string& filename);  // memory-maps the file if possible
+
+  static bool isBinary (const char* data, size_t size);  // checks magic number
+  static bool isBinaryFile (const string& filename);  // false for pipes & other non-regular files
+};
+
+// Binary format for EvaluatedMachines, bound to the parameters they were evaluated with, so that scoring jobs can skip
+// expression evaluation & tokenization and go straight to dynamic programming.
+// Same conventions as MachineBinary. Layout (version 1):
+//   magic "MBOSSEVL", u32 version, u32 flags (bit 0: state names present)
+//   input alphabet, output alphabet: string tables (token k>0 is entry k-1; token 0 is the empty string)
+//   states: u64 nStates, u64 transOffset[nStates+1] (CSR), then per transition u32 input token, u32 output token, u64 dest, f64 log-weight
+//   state names (if flagged): as for MachineBinary
+// A loaded EvaluatedMachine has no transWeightProgram, so it cannot be re-evaluated with updateWeights.
+struct EvaluatedMachineBinary {
+  static void writeBinary (const EvaluatedMachine& eval, ostream& out, bool saveStateNames = true);
+  static void toFile (const EvaluatedMachine& eval, const string& filename, bool saveStateNames = true);
+
+  static EvaluatedMachine fromBuffer (const char* data, size_t size);
+  static EvaluatedMachine fromFile (const string& filename);  // memory-maps the file if possible
+};
+
+// Binary format for partial MachineCounts (see MachineCounts::writePartialJson). Layout (version 1):
+//   magic "MBOSSCNT", u32 version, f64 log-likelihood, u64 nStates, u64 transOffset[nStates+1] (CSR), then f64 count per transition
+struct MachineCountsBinary {
+  static void writeBinary (const MachineCounts& counts, ostream& out);
+  static void toFile (const MachineCounts& counts, const string& filename);
+
+  static MachineCounts fromBuffer (const char* data, size_t size);
+  static MachineCounts fromFile (const string& filename);
+
+  static bool isBinaryFile (const string& filename);  // false for pipes & other non-regular files
+
+  static MachineCounts fromPartialFile (const string& filename);  // binary, or JSON as written by MachineCounts::writePartialJson
+};
+
+}  // end namespace
+
+#endif /* BINARY_INCLUDED */
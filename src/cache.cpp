@@ -0,0 +1,197 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "cache.h"
+#include "preset.h"
+#include "logger.h"
+#include "util.h"
+
+using namespace MachineBoss;
+
+#define FNVOffsetBasis 14695981039346656037ULL
+#define FNVPrime 1099511628211ULL
+
+// identifies the build of boss that made a cache entry, since machine construction algorithms can change between builds.
+// The Makefile defines this as a checksum of the source files, and recompiles cache.cpp whenever any of them changes.
+#ifndef MachineBossBuildId
+#define MachineBossBuildId "unknown"
+#endif
+
+static uint64_t fnv1a (const char* data, size_t size, uint64_t h = FNVOffsetBasis) {
+  for (size_t n = 0; n < size; ++n) {
+    h ^= (unsigned char) data[n];
+    h *= FNVPrime;
+  }
+  return h;
+}
+
+static string toHex (uint64_t h) {
+  ostringstream out;
+  out << hex << setw(16) << setfill('0') << h;
+  return out.str();
+}
+
+static string checksumLine (const char* data, size_t size) {
+  return toHex (fnv1a (data, size)) + "\n";
+}
+
+static bool isRegularFile (const string& filename) {
+  struct stat st;
+  return stat (filename.c_str(), &st) == 0 && S_ISREG (st.st_mode);
+}
+
+MachineCache::MachineCache (const string& dir, size_t maxBytes) :
+  dir (dir),
+  maxBytes (maxBytes)
+{
+  if (mkdir (dir.c_str(), 0777) != 0 && errno != EEXIST)
+    Fail ("Couldn't create cache directory: %s", dir.c_str());
+}
+
+string MachineCache::hash (const string& key) {
+  return toHex (fnv1a (key.data(), key.size()));
+}
+
+string MachineCache::fileDigest (const string& filename) {
+  const MappedFile file (filename);
+  return toHex (fnv1a (file.data(), file.size())) + ":" + to_string (file.size());
+}
+
+string MachineCache::describeTokens (const vector<string>& tokens) {
+  string desc;
+  for (const auto& token: tokens) {
+    desc += to_string (token.size()) + ":" + token;
+    if (isRegularFile (token))
+      desc += "@" + fileDigest (token);
+    desc += "\n";
+  }
+  return desc;
+}
+
+string MachineCache::presetDigest() {
+  // presets can be used implicitly (e.g. --revcomp uses compdna), so all of them are digested
+  uint64_t h = FNVOffsetBasis;
+  for (const auto& name: MachinePresets::presetNames()) {
+    const string json = MachinePresets::presetJson (name);
+    h = fnv1a (name.c_str(), name.size() + 1, h);
+    h = fnv1a (json.data(), json.size(), h);
+  }
+  return toHex (h);
+}
+
+string MachineCache::versionedKey (const string& key) {
+  static const string prefix = string ("version=") + to_string (MachineBinaryVersion) + "\n"
+    + "build=" + MachineBossBuildId + "\n"
+    + "presets=" + presetDigest() + "\n";
+  return prefix + key;
+}
+
+string MachineCache::entryPath (const string& fullKey) const {
+  return dir + "/" + hash (fullKey) + MachineCacheSuffix;
+}
+
+bool MachineCache::get (const string& key, Machine& machine) const {
+  const string fullKey = versionedKey (key);
+  const string path = entryPath (fullKey);
+  if (!isRegularFile (path))
+    return false;
+  const MappedFile file (path);
+  const string header = string (MachineCacheKeyMagic) + to_string (fullKey.size()) + "\n";
+  const size_t offset = header.size() + fullKey.size();
+  if (file.size() < offset
+      || memcmp (file.data(), header.data(), header.size()) != 0
+      || memcmp (file.data() + header.size(), fullKey.data(), fullKey.size()) != 0) {
+    LogThisAt(3,"Machine cache collision at " << path << endl);
+    return false;
+  }
+  // the key is followed by a checksum of the binary machine, so that a truncated or corrupted entry is rebuilt
+  const size_t checksumSize = MachineCacheChecksumSize + 1;
+  const char* body = file.data() + offset + checksumSize;
+  const size_t bodySize = file.size() < offset + checksumSize ? 0 : file.size() - offset - checksumSize;
+  if (file.size() < offset + checksumSize
+      || memcmp (file.data() + offset, checksumLine (body, bodySize).data(), checksumSize) != 0) {
+    Warn ("Discarding corrupt machine cache entry %s", path.c_str());
+    unlink (path.c_str());
+    return false;
+  }
+  machine = MachineBinary::fromBuffer (body, bodySize);
+  utimes (path.c_str(), NULL);  // mark as recently used
+  LogThisAt(3,"Loaded machine from cache " << path << endl);
+  return true;
+}
+
+void MachineCache::put (const string& key, const Machine& machine) const {
+  const string fullKey = versionedKey (key);
+  const string path = entryPath (fullKey);
+  const string tmpPath = path + "." + to_string (getpid()) + ".tmp";
+  {
+    ofstream out (tmpPath, ios::binary);
+    if (!out) {
+      Warn ("Couldn't write machine cache file %s", tmpPath.c_str());
+      return;
+    }
+    ostringstream body;
+    MachineBinary::writeBinary (machine, body);
+    const string bodyStr = body.str();
+    out << MachineCacheKeyMagic << fullKey.size() << "\n" << fullKey
+	<< checksumLine (bodyStr.data(), bodyStr.size()) << bodyStr;
+    if (!out) {
+      Warn ("Couldn't write machine cache file %s", tmpPath.c_str());
+      out.close();
+      unlink (tmpPath.c_str());
+      return;
+    }
+  }
+  if (rename (tmpPath.c_str(), path.c_str()) != 0) {
+    Warn ("Couldn't rename %s to %s", tmpPath.c_str(), path.c_str());
+    unlink (tmpPath.c_str());
+    return;
+  }
+  LogThisAt(3,"Saved machine to cache " << path << endl);
+  if (maxBytes)
+    evict();
+}
+
+void MachineCache::evict() const {
+  DIR* dirp = opendir (dir.c_str());
+  if (!dirp)
+    return;
+  struct Entry {
+    string path;
+    size_t size;
+    struct timespec mtime;
+  };
+  vector<Entry> entries;
+  size_t totalBytes = 0;
+  const size_t suffixLen = strlen (MachineCacheSuffix);
+  for (struct dirent* d = readdir (dirp); d; d = readdir (dirp)) {
+    const string name (d->d_name);
+    if (name.size() <= suffixLen || name.compare (name.size() - suffixLen, suffixLen, MachineCacheSuffix) != 0)
+      continue;
+    const string path = dir + "/" + name;
+    struct stat st;
+    if (stat (path.c_str(), &st) != 0)
+      continue;
+#ifdef __APPLE__
+    entries.push_back (Entry { path, (size_t) st.st_size, st.st_mtimespec });
+#else
+    entries.push_back (Entry { path, (size_t) st.st_size, st.st_mtim });
+#endif
+    totalBytes += st.st_size;
+  }
+  closedir (dirp);
+  sort (entries.begin(), entries.end(), [] (const Entry& a, const Entry& b) {
+      return a.mtime.tv_sec < b.mtime.tv_sec || (a.mtime.tv_sec == b.mtime.tv_sec && a.mtime.tv_nsec < b.mtime.tv_nsec);
+    });
+  for (auto iter = entries.begin(); totalBytes > maxBytes && iter != entries.end(); ++iter)
+    if (unlink (iter->path.c_str()) == 0) {
+      totalBytes -= iter->size;
+      LogThisAt(3,"Evicted " << iter->path << " from machine cache" << endl);
+    }
+}
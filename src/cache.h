@@ -0,0 +1,48 @@
+#ifndef CACHE_INCLUDED
+#define CACHE_INCLUDED
+
+#include "binary.h"
+
+#define MachineCacheSuffix ".mbc"
+#define MachineCacheKeyMagic "MBOSSKEY"
+#define MachineCacheChecksumSize 16  /* hex digits */
+
+namespace MachineBoss {
+
+using namespace std;
+
+// MachineCache is a persistent on-disk cache of constructed machines.
+// Entries are keyed by a canonical description of how the machine was built (see describeTokens),
+// prefixed by the binary format version, an identifier for the build of boss, and a digest of the compiled-in presets,
+// so that an upgraded boss does not reuse machines built by an older one.
+// Entries are stored in the binary machine format, preceded by the full key (so that hash collisions are detected)
+// and a checksum of the binary machine (so that a truncated or corrupted entry is discarded and rebuilt, rather than read).
+// Entries are written atomically (to a temporary file, then renamed), so concurrent processes can share a cache.
+// Reading an entry updates its modification time; if maxBytes is nonzero, the least recently used entries are evicted
+// whenever the cache grows beyond maxBytes.
+class MachineCache {
+public:
+  const string dir;
+  const size_t maxBytes;  // 0 = unbounded
+
+  MachineCache (const string& dir, size_t maxBytes = 0);
+
+  bool get (const string& key, Machine& machine) const;  // true on a hit
+  void put (const string& key, const Machine& machine) const;
+  void evict() const;
+
+  // canonical key for a list of command-line tokens: tokens naming existing files are followed by a digest of the file contents
+  static string describeTokens (const vector<string>& tokens);
+
+  static string fileDigest (const string& filename);  // 64-bit FNV-1a of contents, as hex, plus the file size
+  static string hash (const string& key);  // 64-bit FNV-1a, as hex
+  static string presetDigest();  // 64-bit FNV-1a of all preset names & JSON texts, as hex
+
+private:
+  static string versionedKey (const string& key);
+  string entryPath (const string& fullKey) const;
+};
+
+}  // end namespace
+
+#endif /* CACHE_INCLUDED */
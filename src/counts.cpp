@@ -1,7 +1,11 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multimin.h>
 #include "counts.h"
 #include "backward.h"
+#include "viterbi.h"
 #include "util.h"
 #include "logger.h"
 
@@ -14,6 +18,9 @@
 #define EpsilonAbsolute 1e-3
 #define MaxIterations 100
 
+// Number of shards for the E-step
+#define EStepShards 64
+
 // log levels
 #define ParamTransformLogLevel 9
 #define ObjectiveFunctionLogLevel 8
@@ -34,12 +41,125 @@ MachineCounts::MachineCounts (const EvaluatedMachine& machine, const SeqPair& se
   (void) add (machine, seqPair);
 }
 
-MachineCounts::MachineCounts (const EvaluatedMachine& machine, const SeqPairList& seqPairList, const list<Envelope>& envelopes)
+// The E-step is split into a fixed number of shards, which are accumulated independently (possibly on several threads)
+// and then combined by a pairwise tree reduction in shard order.
+// Since the shards do not depend on the number of threads, neither do the (floating-point) results.
+// runShard(n,begin,end) handles shard n, i.e. sequence pairs [begin,end)
+static void runEStepShards (size_t nPairs, size_t nShards, size_t nThreads, const function<void(size_t,size_t,size_t)>& runShard) {
+  const size_t shardSize = nPairs ? (nPairs + nShards - 1) / nShards : 0;
+  atomic<size_t> nextShard (0);
+  vguard<exception_ptr> shardError (nShards);
+  auto runShards = [&]() {
+    for (size_t n; (n = nextShard++) < nShards; ) {
+      try {
+	runShard (n, min (nPairs, n * shardSize), min (nPairs, (n + 1) * shardSize));
+      } catch (...) {
+	shardError[n] = current_exception();
+      }
+    }
+  };
+
+  nThreads = max ((size_t) 1, min (nThreads, nShards));
+  if (nThreads > 1) {
+    LogThisAt(5,"Running E-step on " << nPairs << " sequence pairs in " << nShards << " shards, using " << nThreads << " threads" << endl);
+    list<thread> threads;
+    for (size_t t = 0; t < nThreads; ++t) {
+      threads.push_back (thread (runShards));
+      logger.nameLastThread (threads, "E-step");
+    }
+    for (auto& thr: threads) {
+      logger.eraseThreadName (thr);
+      thr.join();
+    }
+  } else
+    runShards();
+
+  for (const auto& err: shardError)
+    if (err)
+      rethrow_exception (err);
+}
+
+static size_t nEStepShards (size_t nPairs) {
+  return max ((size_t) 1, min (nPairs, (size_t) EStepShards));
+}
+
+static void listSeqPairs (const SeqPairList& seqPairList, const list<Envelope>& envelopes, vguard<const SeqPair*>& seqPair, vguard<const Envelope*>& env) {
+  auto envIter = envelopes.begin();
+  for (const auto& sp: seqPairList.seqPairs) {
+    seqPair.push_back (&sp);
+    env.push_back (envIter == envelopes.end() ? NULL : &*(envIter++));
+  }
+}
+
+// The reduction runs as shards complete, so only the partial sums still waiting for a sibling are held in memory:
+// O(log(shards)) count tables for a single thread, rather than one per shard.
+MachineCounts::MachineCounts (const EvaluatedMachine& machine, const SeqPairList& seqPairList, const list<Envelope>& envelopes, size_t nThreads, bool viterbi)
 {
-  init (machine);
-  auto env = envelopes.begin();
-  for (const auto& seqPair: seqPairList.seqPairs)
-    (void) add (machine, seqPair, env == envelopes.end() ? Envelope(seqPair) : *(env++));
+  vguard<const SeqPair*> seqPair;
+  vguard<const Envelope*> env;
+  listSeqPairs (seqPairList, envelopes, seqPair, env);
+  const size_t nShards = nEStepShards (seqPair.size());
+
+  // node (level,i) of the reduction tree is the sum of shards [i*2^level, (i+1)*2^level)
+  mutex reductionMutex;
+  map<pair<size_t,size_t>,MachineCounts> waiting;  // completed nodes whose sibling is not yet complete
+  auto reduce = [&] (MachineCounts&& counts, size_t n) {
+    size_t level = 0;
+    while ((((size_t) 1) << level) < nShards) {
+      const size_t sibling = n ^ 1;
+      if ((sibling << level) < nShards) {
+	MachineCounts siblingCounts;
+	{
+	  lock_guard<mutex> lock (reductionMutex);
+	  const auto iter = waiting.find (make_pair (level, sibling));
+	  if (iter == waiting.end()) {
+	    waiting[make_pair (level, n)] = move (counts);
+	    return;
+	  }
+	  siblingCounts = move (iter->second);
+	  waiting.erase (iter);
+	}
+	if (n & 1) {
+	  siblingCounts += counts;
+	  counts = move (siblingCounts);
+	} else
+	  counts += siblingCounts;
+      }
+      ++level;
+      n >>= 1;
+    }
+    *this = move (counts);
+  };
+
+  runEStepShards (seqPair.size(), nShards, nThreads, [&] (size_t n, size_t begin, size_t end) {
+      MachineCounts shard;
+      shard.init (machine);
+      for (size_t i = begin; i < end; ++i) {
+	const Envelope e = env[i] ? *env[i] : Envelope(*seqPair[i]);
+	(void) (viterbi
+		? shard.addViterbi (machine, *seqPair[i], e)
+		: shard.add (machine, *seqPair[i], e));
+      }
+      reduce (move (shard), n);
+    });
+}
+
+double MachineCounts::forwardLogLike (const EvaluatedMachine& machine, const SeqPairList& seqPairList, const list<Envelope>& envelopes, size_t nThreads) {
+  vguard<const SeqPair*> seqPair;
+  vguard<const Envelope*> env;
+  listSeqPairs (seqPairList, envelopes, seqPair, env);
+  const size_t nShards = nEStepShards (seqPair.size());
+  vguard<double> shardLogLike (nShards, 0.);
+  runEStepShards (seqPair.size(), nShards, nThreads, [&] (size_t n, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+	const Envelope e = env[i] ? *env[i] : Envelope(*seqPair[i]);
+	shardLogLike[n] += ForwardMatrix (machine, *seqPair[i], e).logLike();
+      }
+    });
+  for (size_t stride = 1; stride < nShards; stride *= 2)
+    for (size_t n = 0; n + stride < nShards; n += 2 * stride)
+      shardLogLike[n] += shardLogLike[n + stride];
+  return shardLogLike[0];
 }
 
 void MachineCounts::init (const EvaluatedMachine& machine) {
@@ -63,10 +183,30 @@ double MachineCounts::add (const EvaluatedMachine& machine, const SeqPair& seqPa
   return result;
 }
 
+double MachineCounts::addViterbi (const EvaluatedMachine& machine, const SeqPair& seqPair, const Envelope& env) {
+  const ViterbiMatrix viterbi (machine, seqPair, env);
+  const double result = viterbi.logLike();
+  if (result > -numeric_limits<double>::infinity())
+    viterbi.getCounts (*this);
+  else
+    Warn ("No Viterbi path for sequence pair (%s,%s)", seqPair.input.name.c_str(), seqPair.output.name.c_str());
+  loglike += result;
+  return result;
+}
+
 MachineCounts& MachineCounts::operator+= (const MachineCounts& counts) {
   for (StateIndex s = 0; s < count.size(); ++s)
     for (size_t t = 0; t < count[s].size(); ++t)
       count[s][t] += counts.count[s][t];
+  loglike += counts.loglike;
+  return *this;
+}
+
+MachineCounts& MachineCounts::operator*= (double factor) {
+  for (auto& stateCount: count)
+    for (auto& c: stateCount)
+      c *= factor;
+  loglike *= factor;
   return *this;
 }
 
@@ -77,6 +217,45 @@ void MachineCounts::writeJson (ostream& outs) const {
   outs << "[" << join (s, ",\n ") << "]" << endl;
 }
 
+void MachineCounts::writePartialJson (ostream& outs) const {
+  json j = json::object();
+  if (isfinite (loglike))
+    j["loglike"] = loglike;
+  else
+    j["loglike"] = isnan (loglike) ? "NaN" : (loglike > 0 ? "Infinity" : "-Infinity");
+  json jc = json::array();
+  for (const auto& c: count)
+    jc.push_back (json (vector<double> (c.begin(), c.end())));
+  j["count"] = jc;
+  outs << j.dump() << endl;
+}
+
+void MachineCounts::readPartialJson (const json& j) {
+  Require (j.is_object() && j.count("loglike") && j.count("count") && j.at("count").is_array(),
+	   "Partial counts must be a JSON object with \"loglike\" and \"count\" fields");
+  const json& jl = j.at("loglike");
+  if (jl.is_string()) {
+    const string s = jl.get<string>();
+    loglike = s == "-Infinity" ? -numeric_limits<double>::infinity() : (s == "Infinity" ? numeric_limits<double>::infinity() : numeric_limits<double>::quiet_NaN());
+  } else
+    loglike = jl.get<double>();
+  count.clear();
+  for (const auto& jsc: j.at("count")) {
+    count.push_back (vguard<double>());
+    for (const auto& jtc: jsc)
+      count.back().push_back (jtc.get<double>());
+  }
+}
+
+bool MachineCounts::fits (const Machine& machine) const {
+  if (count.size() != machine.nStates())
+    return false;
+  for (StateIndex s = 0; s < count.size(); ++s)
+    if (count[s].size() != machine.state[s].trans.size())
+      return false;
+  return true;
+}
+
 void MachineCounts::writeParamCountsJson (ostream& outs, const Machine& machine, const ParamAssign& prob) const {
   const auto pc = paramCounts (machine, prob);
   outs << "{";
@@ -87,21 +266,33 @@ void MachineCounts::writeParamCountsJson (ostream& outs, const Machine& machine,
 }
 
 map<string,double> MachineCounts::paramCounts (const Machine& machine, const ParamAssign& prob) const {
-  map<string,double> paramCount;
+  // paramCount[p] = p * d/dp sum_t count[t] * log(weight[t]), computed by reverse-mode differentiation of the transition weights
   Assert (count.size() == machine.state.size(), "Number of states mismatch");
+  vguard<WeightExpr> transWeight;
+  vguard<double> countPerWeight;
   for (StateIndex s = 0; s < machine.nStates(); ++s) {
-    auto transIter = machine.state[s].trans.begin();
     Assert (count[s].size() == machine.state[s].trans.size(), "State size mismatch");
-    for (auto& c: count[s]) {
-      auto& trans = *(transIter++);
-      const auto transParams = WeightAlgebra::params (trans.weight, ParamDefs());
-      const double w = WeightAlgebra::eval (trans.weight, prob.defs);
-      for (auto& p: transParams) {
-	const auto deriv = WeightAlgebra::deriv (trans.weight, ParamDefs(), p);
-	paramCount[p] += c * WeightAlgebra::eval (deriv, prob.defs) * WeightAlgebra::asDouble (prob.defs.at(p)) / w;
-      }
-    }
+    for (const auto& trans: machine.state[s].trans)
+      transWeight.push_back (trans.weight);
   }
+  const WeightProgram program (transWeight, ParamDefs());
+  vguard<double> paramValue (program.nParams());
+  for (size_t k = 0; k < program.nParams(); ++k) {
+    if (!prob.defs.count (program.param[k]))
+      throw runtime_error(string("Parameter ") + program.param[k] + (" not defined"));
+    paramValue[k] = WeightAlgebra::eval (prob.defs.at (program.param[k]), prob.defs);
+  }
+  const vguard<double> w = program.eval (paramValue);
+  for (StateIndex s = 0; s < machine.nStates(); ++s)
+    for (auto c: count[s]) {
+      const double wt = w[countPerWeight.size()];
+      countPerWeight.push_back (c ? (c / wt) : 0.);
+    }
+  vguard<double> grad (program.nParams());
+  program.gradient (paramValue.data(), countPerWeight.data(), grad.data());
+  map<string,double> paramCount;
+  for (size_t k = 0; k < program.nParams(); ++k)
+    paramCount[program.param[k]] = grad[k] * paramValue[k];
   return paramCount;
 }
 
@@ -114,23 +305,51 @@ WeightExpr makeExpFunc (const string& trParam) {
   return WeightAlgebra::expOf (WeightAlgebra::minus (makeSquareFunc (trParam)));
 }
 
-MachineObjective::MachineObjective (const Machine& machine, const MachineCounts& counts, const Constraints& cons, const Params& constants) :
-  constraints (machine.cons.combine (cons)),
-  constantDefs (machine.funcs.combine (constants).defs),
-  objective (WeightAlgebra::zero())
-{
-  for (StateIndex s = 0; s < machine.state.size(); ++s) {
-    EvaluatedMachineState::TransIndex t = 0;
-    for (TransList::const_iterator iter = machine.state[s].trans.begin();
-	 iter != machine.state[s].trans.end(); ++iter, ++t) {
-      const WeightExpr term = WeightAlgebra::multiply (WeightAlgebra::doubleConstant (counts.count[s][t]),
-						       WeightAlgebra::logOf ((*iter).weight));
-      objective = WeightAlgebra::subtract (objective, term);
-    }
+// DirectFactors splits a transition weight into a product of
+// direct factors (a normalized or probability parameter p, or 1-p for a probability parameter),
+// constants (which are dropped), and other factors
+struct DirectFactors {
+  map<string,double> paramExponent, notParamExponent;
+  vguard<WeightExpr> other;
+  DirectFactors (const WeightExpr& w, const ParamDefs& defs, const set<string>& directParams, const set<string>& probParams) {
+    set<string> expanding;
+    factorize (w, defs, directParams, probParams, expanding);
+  }
+  void factorize (const WeightExpr& w, const ParamDefs& defs, const set<string>& directParams, const set<string>& probParams, set<string>& expanding) {
+    if (w && WeightAlgebra::isNumber(w))
+      return;
+    if (w && w->type == Mul) {
+      factorize (w->args.binary.l, defs, directParams, probParams, expanding);
+      factorize (w->args.binary.r, defs, directParams, probParams, expanding);
+    } else if (w && w->type == Div && WeightAlgebra::isNumber (w->args.binary.r))
+      factorize (w->args.binary.l, defs, directParams, probParams, expanding);
+    else if (w && w->type == Param) {
+      const string& n (*w->args.param);
+      if (defs.count(n)) {
+	if (expanding.count(n))
+	  other.push_back (w);
+	else {
+	  expanding.insert (n);
+	  factorize (defs.at(n), defs, directParams, probParams, expanding);
+	  expanding.erase (n);
+	}
+      } else if (directParams.count(n))
+	++paramExponent[n];
+      else
+	other.push_back (w);
+    } else if (w && w->type == Sub && WeightAlgebra::isOne (w->args.binary.l)
+	       && w->args.binary.r->type == Param
+	       && probParams.count (*w->args.binary.r->args.param)
+	       && !defs.count (*w->args.binary.r->args.param))
+      ++notParamExponent[*w->args.binary.r->args.param];
+    else
+      other.push_back (w);
   }
+};
 
+void ParamTransform::init (const Constraints& cons, const set<string>& p) {
+  transformedConstraints = cons;
   // p_i = (1 - exp(-x_i^2)) \prod_{k=1}^{i-1} exp(-x_k^2)
-  const set<string> p = WeightAlgebra::params (objective, ParamDefs());
   int trIdx = 0;
   auto makeTransformedParamName = [&] (const string& param) -> string {
     string trParam;
@@ -141,7 +360,7 @@ MachineObjective::MachineObjective (const Machine& machine, const MachineCounts&
     transformedParam.push_back (trParam);
     return trParam;
   };
-  for (const auto& c: constraints.norm) {
+  for (const auto& c: cons.norm) {
     WeightExpr notPrev = WeightAlgebra::one();
     for (size_t n = 0; n < c.size(); ++n) {
       const string& cParam = c[n];
@@ -156,11 +375,119 @@ MachineObjective::MachineObjective (const Machine& machine, const MachineCounts&
     }
   }
 
-  for (const auto& pParam: constraints.prob)
+  for (const auto& pParam: cons.prob)
     paramTransformDefs[pParam] = makeExpFunc (makeTransformedParamName (pParam));
 
-  for (const auto& rParam: constraints.rate)
+  for (const auto& rParam: cons.rate)
     paramTransformDefs[rParam] = makeSquareFunc (makeTransformedParamName (rParam));
+}
+
+vguard<double> ParamTransform::transformedValues (const Params& params) const {
+  vguard<double> x (transformedParam.size());
+  auto setValue = [&] (const string& param, double val) {
+    x[transformedParamIndex.at(param)] = val;
+    LogThisAt(ParamTransformLogLevel,"Setting " << transformedParam[transformedParamIndex.at(param)] << " to " << val << endl);
+  };
+  // p_i = (1 - z_i) \prod_{k=1}^{i-1} z_k
+  // where z_i = exp(-x_i^2)
+  // \prod_{k=1}^{i-1} z_k = 1 - \sum_{k=1}^{i-1} p_k
+  // so z_i = 1 - p_i / (1 - \sum_{k=1}^{i-1} p_k)
+  // x_i = sqrt(-log z_i)
+  for (const auto& c: transformedConstraints.norm) {
+    double pSum = 0;
+    for (size_t n = 0; n + 1 < c.size(); ++n) {
+      const string& cParam = c[n];
+      const double p = WeightAlgebra::asDouble (params.defs.at(cParam));
+      const double z = 1 - p / (1 - pSum);
+      pSum += p;
+      setValue (cParam, sqrt (-log (z)));
+    }
+  }
+  for (const auto& pParam: transformedConstraints.prob)
+    setValue (pParam, sqrt (-log (WeightAlgebra::asDouble (params.defs.at(pParam)))));
+  for (const auto& rParam: transformedConstraints.rate)
+    setValue (rParam, sqrt (WeightAlgebra::asDouble (params.defs.at(rParam))));
+  return x;
+}
+
+MachineObjective::MachineObjective (const Machine& machine, const MachineCounts& counts, const Constraints& cons, const Params& constants) :
+  constraints (machine.cons.combine (cons)),
+  constantDefs (machine.funcs.combine (constants).defs),
+  objective (WeightAlgebra::zero())
+{
+  // Find parameters that only appear as direct factors of transition weights (possibly via function definitions).
+  // Their M-step has a closed-form solution: normalize the expected counts.
+  set<string> directParams, probParams;
+  for (const auto& c: constraints.norm)
+    directParams.insert (c.begin(), c.end());
+  for (const auto& p: constraints.prob)
+    directParams.insert (p);
+  probParams.insert (constraints.prob.begin(), constraints.prob.end());
+
+  map<string,double> paramCount, notParamCount;
+  set<string> otherParams;
+  for (StateIndex s = 0; s < machine.state.size(); ++s) {
+    EvaluatedMachineState::TransIndex t = 0;
+    for (TransList::const_iterator iter = machine.state[s].trans.begin();
+	 iter != machine.state[s].trans.end(); ++iter, ++t) {
+      const double c = counts.count[s][t];
+      if (c == 0)
+	continue;
+      const DirectFactors factors ((*iter).weight, constantDefs, directParams, probParams);
+      for (const auto& p_e: factors.paramExponent)
+	paramCount[p_e.first] += c * p_e.second;
+      for (const auto& p_e: factors.notParamExponent)
+	notParamCount[p_e.first] += c * p_e.second;
+      for (const auto& f: factors.other) {
+	const auto fp = WeightAlgebra::params (f, constantDefs);
+	otherParams.insert (fp.begin(), fp.end());
+	const WeightExpr term = WeightAlgebra::multiply (WeightAlgebra::doubleConstant (c),
+							 WeightAlgebra::logOf (f));
+	objective = WeightAlgebra::subtract (objective, term);
+      }
+    }
+  }
+
+  auto addDirectTerms = [&] (const string& param) {
+    if (paramCount.count (param))
+      objective = WeightAlgebra::subtract (objective, WeightAlgebra::multiply (WeightAlgebra::doubleConstant (paramCount.at (param)),
+									       WeightAlgebra::logOf (WeightAlgebra::param (param))));
+    if (notParamCount.count (param))
+      objective = WeightAlgebra::subtract (objective, WeightAlgebra::multiply (WeightAlgebra::doubleConstant (notParamCount.at (param)),
+									       WeightAlgebra::logOf (WeightAlgebra::negate (WeightAlgebra::param (param)))));
+  };
+  auto countOf = [] (const map<string,double>& count, const string& param) {
+    return count.count(param) ? count.at(param) : 0.;
+  };
+
+  for (const auto& c: constraints.norm) {
+    bool closed = true;
+    double total = 0;
+    for (const auto& p: c) {
+      closed = closed && !otherParams.count(p);
+      total += countOf (paramCount, p);
+    }
+    if (!closed) {
+      numericConstraints.norm.push_back (c);
+      for (const auto& p: c)
+	addDirectTerms (p);
+    } else if (total > 0)
+      for (const auto& p: c)
+	closedFormParams.defs[p] = WeightAlgebra::doubleConstant (countOf (paramCount, p) / total);
+  }
+  for (const auto& p: constraints.prob) {
+    const double yes = countOf (paramCount, p), no = countOf (notParamCount, p);
+    if (otherParams.count(p)) {
+      numericConstraints.prob.push_back (p);
+      addDirectTerms (p);
+    } else if (yes + no > 0)
+      closedFormParams.defs[p] = WeightAlgebra::doubleConstant (yes / (yes + no));
+  }
+  numericConstraints.rate = constraints.rate;
+
+  LogThisAt(5,"M-step has closed-form solution for " << closedFormParams.defs.size() << " parameter(s)" << endl);
+
+  init (numericConstraints, WeightAlgebra::params (objective, ParamDefs()));
 
   if (LoggingThisAt(ParamTransformLogLevel))
     for (const auto& p_d: paramTransformDefs)
@@ -169,17 +496,19 @@ MachineObjective::MachineObjective (const Machine& machine, const MachineCounts&
   allDefs = constantDefs;
   allDefs.insert (paramTransformDefs.begin(), paramTransformDefs.end());
 
-  deriv.reserve (transformedParam.size());
-  for (const auto& p: transformedParam)
-    deriv.push_back (WeightAlgebra::deriv (objective, allDefs, p));
+  program = WeightProgram (vguard<WeightExpr> (1, objective), allDefs, transformedParam);
+  if (program.nParams() > transformedParam.size())
+    throw runtime_error(string("Parameter ") + program.param[transformedParam.size()] + (" not defined"));
+  LogThisAt(6,"Compiled M-step objective function into " << program.nInstructions() << " instructions" << endl);
 
   LogThisAt (ObjectiveFunctionLogLevel, toString());
 }
 
 string MachineObjective::toString() const {
+  WeightExprScope derivScope;
   string s = string("E = ") + WeightAlgebra::toString(objective,allDefs) + "\n";
   for (size_t n = 0; n < transformedParam.size(); ++n)
-    s += "dE/d" + transformedParam[n] + " = " + WeightAlgebra::toString(deriv[n],allDefs) + "\n";
+    s += "dE/d" + transformedParam[n] + " = " + WeightAlgebra::toString(WeightAlgebra::deriv(objective,allDefs,transformedParam[n]),allDefs) + "\n";
   return s;
 }
 
@@ -194,35 +523,48 @@ Params gsl_vector_to_params (const gsl_vector *v, const MachineObjective& ml) {
 double gsl_machine_objective (const gsl_vector *v, void *voidML)
 {
   const MachineObjective& ml (*((MachineObjective*)voidML));
-  const Params pv = gsl_vector_to_params (v, ml);
+  const vguard<double> v_stl = gsl_vector_to_stl(v);
 
-  const double f = WeightAlgebra::eval (ml.objective, pv.defs);
+  double f;
+  ml.program.eval (v_stl.data(), &f);
 
-  LogThisAt (OptimizationParamsLogLevel, JsonLoader<Params>::toJsonString(pv) << endl);
-  LogThisAt (ObjectiveFunctionLogLevel, "gsl_machine_objective(" << to_string_join(gsl_vector_to_stl(v)) << ") = " << f << endl);
+  if (LoggingThisAt(OptimizationParamsLogLevel))
+    LogThisAt (OptimizationParamsLogLevel, JsonLoader<Params>::toJsonString(gsl_vector_to_params (v, ml)) << endl);
+  LogThisAt (ObjectiveFunctionLogLevel, "gsl_machine_objective(" << to_string_join(v_stl) << ") = " << f << endl);
 
   return f;
 }
 
-void gsl_machine_objective_deriv (const gsl_vector *v, void *voidML, gsl_vector *df)
+void gsl_machine_objective_with_deriv (const gsl_vector *v, void *voidML, double *f, gsl_vector *df)
 {
   const MachineObjective& ml (*((MachineObjective*)voidML));
-  const Params pv = gsl_vector_to_params (v, ml);
-
-  for (size_t n = 0; n < ml.transformedParam.size(); ++n)
-    gsl_vector_set (df, n, WeightAlgebra::eval (ml.deriv[n], pv.defs));
-
-  const vguard<double> v_stl = gsl_vector_to_stl(v), df_stl = gsl_vector_to_stl(df);
-  LogThisAt (ObjectiveFunctionLogLevel, "gsl_machine_objective_deriv(" << to_string_join(v_stl) << ") = (" << to_string_join(df_stl) << ")" << endl);
+  const vguard<double> v_stl = gsl_vector_to_stl(v);
+
+  const double one = 1;
+  vguard<double> grad (ml.transformedParam.size());
+  ml.program.gradient (v_stl.data(), &one, grad.data(), f);
+  for (size_t n = 0; n < grad.size(); ++n)
+    gsl_vector_set (df, n, grad[n]);
+
+  if (LoggingThisAt(OptimizationParamsLogLevel))
+    LogThisAt (OptimizationParamsLogLevel, JsonLoader<Params>::toJsonString(gsl_vector_to_params (v, ml)) << endl);
+  LogThisAt (ObjectiveFunctionLogLevel, "gsl_machine_objective(" << to_string_join(v_stl) << ") = " << *f << endl);
+  LogThisAt (ObjectiveFunctionLogLevel, "gsl_machine_objective_deriv(" << to_string_join(v_stl) << ") = (" << to_string_join(grad) << ")" << endl);
 }
 
-void gsl_machine_objective_with_deriv (const gsl_vector *x, void *voidML, double *f, gsl_vector *df)
+void gsl_machine_objective_deriv (const gsl_vector *v, void *voidML, gsl_vector *df)
 {
-  *f = gsl_machine_objective (x, voidML);
-  gsl_machine_objective_deriv (x, voidML, df);
+  double f;
+  gsl_machine_objective_with_deriv (v, voidML, &f, df);
 }
 
 Params MachineObjective::optimize (const Params& seed) const {
+  Params finalParams = seed;
+  for (const auto& p_d: closedFormParams.defs)
+    finalParams.defs[p_d.first] = p_d.second;
+  if (transformedParam.empty())
+    return finalParams;
+
   gsl_multimin_function_fdf func;
   func.n = transformedParam.size();
   func.f = gsl_machine_objective;
@@ -230,36 +572,7 @@ Params MachineObjective::optimize (const Params& seed) const {
   func.fdf = gsl_machine_objective_with_deriv;
   func.params = (void*) this;
 
-  gsl_vector* x = gsl_vector_alloc (func.n);
-  // p_i = (1 - z_i) \prod_{k=1}^{i-1} z_k
-  // where z_i = exp(-x_i^2)
-  // \prod_{k=1}^{i-1} z_k = 1 - \sum_{k=1}^{i-1} p_k
-  // so z_i = 1 - p_i / (1 - \sum_{k=1}^{i-1} p_k)
-  // x_i = sqrt(-log z_i)
-  for (const auto& c: constraints.norm) {
-    double pSum = 0;
-    for (size_t n = 0; n + 1 < c.size(); ++n) {
-      const string& cParam = c[n];
-      const double p = WeightAlgebra::asDouble (seed.defs.at(cParam));
-      const double z = 1 - p / (1 - pSum);
-      const double val = sqrt (-log (z));
-      pSum += p;
-      gsl_vector_set (x, transformedParamIndex.at(cParam), val);
-      LogThisAt(ParamTransformLogLevel,"Setting " << transformedParam[transformedParamIndex.at(cParam)] << " to " << val << endl);
-    }
-  }
-  for (const auto& pParam: constraints.prob) {
-      const double p = WeightAlgebra::asDouble (seed.defs.at(pParam));
-      const double val = sqrt (-log (p));
-      gsl_vector_set (x, transformedParamIndex.at(pParam), val);
-      LogThisAt(ParamTransformLogLevel,"Setting " << transformedParam[transformedParamIndex.at(pParam)] << " to " << val << endl);
-  }
-  for (const auto& rParam: constraints.rate) {
-      const double r = WeightAlgebra::asDouble (seed.defs.at(rParam));
-      const double val = sqrt (r);
-      gsl_vector_set (x, transformedParamIndex.at(rParam), val);
-      LogThisAt(ParamTransformLogLevel,"Setting " << transformedParam[transformedParamIndex.at(rParam)] << " to " << val << endl);
-  }
+  gsl_vector* x = stl_to_gsl_vector (transformedValues (seed));
 
   const gsl_multimin_fdfminimizer_type *T = gsl_multimin_fdfminimizer_vector_bfgs2;
   gsl_multimin_fdfminimizer *s = gsl_multimin_fdfminimizer_alloc (T, func.n);
@@ -284,7 +597,6 @@ Params MachineObjective::optimize (const Params& seed) const {
   while (status == GSL_CONTINUE && iter < MaxIterations);
 
   const Params finalTransformedParams = gsl_vector_to_params (s->x, *this);
-  Params finalParams = seed;
   for (const auto& pt: paramTransformDefs)
     finalParams.defs[pt.first] = WeightAlgebra::doubleConstant (WeightAlgebra::eval (pt.second, finalTransformedParams.defs));
   
@@ -14,24 +14,43 @@ struct MachineCounts {
   MachineCounts();
   MachineCounts (const EvaluatedMachine&);
   MachineCounts (const EvaluatedMachine&, const SeqPair&);
-  MachineCounts (const EvaluatedMachine&, const SeqPairList&, const list<Envelope>& = list<Envelope>());
+  MachineCounts (const EvaluatedMachine&, const SeqPairList&, const list<Envelope>& = list<Envelope>(), size_t nThreads = 1, bool viterbi = false);  // result does not depend on nThreads
+  static double forwardLogLike (const EvaluatedMachine&, const SeqPairList&, const list<Envelope>& = list<Envelope>(), size_t nThreads = 1);  // same as the loglike of the constructor above, without the Backward pass
   void init (const EvaluatedMachine&);
   double add (const EvaluatedMachine&, const SeqPair&);  // returns log-likelihood
   double add (const EvaluatedMachine&, const SeqPair&, const Envelope&);  // returns log-likelihood
+  double addViterbi (const EvaluatedMachine&, const SeqPair&, const Envelope&);  // counts transitions on the Viterbi path only; returns Viterbi log-likelihood
   MachineCounts& operator+= (const MachineCounts&);
+  MachineCounts& operator*= (double);  // scales counts and log-likelihood
   map<string,double> paramCounts (const Machine&, const ParamAssign&) const;  // expectation of d(logLike)/d(logParam)
   void writeJson (ostream&) const;
   void writeParamCountsJson (ostream&, const Machine&, const ParamAssign&) const;
+
+  // partial counts, e.g. from one shard of a sharded run: raw per-transition counts & log-likelihood, which can be summed across shards
+  void writePartialJson (ostream&) const;  // {"loglike":...,"count":[[...],...]}, at full precision
+  void readPartialJson (const json&);
+  bool fits (const Machine&) const;  // true if indexed like the machine's transitions
 };
 
-// M-step
-struct MachineObjective {
-  const Constraints constraints;
+// ParamTransform maps constrained parameters onto unconstrained real-valued parameters x:
+// normalized groups via p_i = (1 - exp(-x_i^2)) \prod_{k<i} exp(-x_k^2), probabilities via p = exp(-x^2), rates via r = x^2
+struct ParamTransform {
+  Constraints transformedConstraints;
   vguard<string> transformedParam;
   map<string,size_t> transformedParamIndex;
-  ParamDefs constantDefs, paramTransformDefs, allDefs;
+  ParamDefs paramTransformDefs;  // constrained parameters, as functions of transformedParam
+  void init (const Constraints&, const set<string>& reservedNames);  // names of transformed parameters avoid reservedNames
+  vguard<double> transformedValues (const Params&) const;  // inverse transform, indexed like transformedParam
+};
+
+// M-step
+struct MachineObjective : ParamTransform {
+  const Constraints constraints;
+  Constraints numericConstraints;  // the subset of constraints whose parameters have no closed-form solution
+  Params closedFormParams;  // maximum-likelihood values of parameters that appear only as direct factors of transition weights
+  ParamDefs constantDefs, allDefs;
   WeightExpr objective;
-  vguard<WeightExpr> deriv;
+  WeightProgram program;  // evaluates objective (and its gradient), with transformedParam as inputs
   MachineObjective (const Machine&, const MachineCounts&, const Constraints&, const Params&);
   Params optimize (const Params& seed) const;
   string toString() const;
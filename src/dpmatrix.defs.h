@@ -14,7 +14,7 @@ DPMatrix<IndexMapper>::DPMatrix (const EvaluatedMachine& machine, const SeqPair&
 
 template<class IndexMapper>
 DPMatrix<IndexMapper>::DPMatrix (const EvaluatedMachine& machine, const SeqPair& seqPair, const Envelope& envelope) :
-  IndexMapper (seqPair),
+  IndexMapper (envelope),
   machine (machine),
   seqPair (seqPair),
   input (machine.inputTokenizer.tokenize (seqPair.input.seq)),
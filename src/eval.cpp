@@ -43,8 +43,15 @@ void EvaluatedMachine::init (const Machine& machine, const Params* params)
 {
   Assert (machine.isAdvancingMachine(), "Machine is not topologically sorted");
 
+  vector<WeightExpr> transWeightExpr;
+  for (const auto& ms: machine.state)
+    for (const auto& trans: ms.trans)
+      transWeightExpr.push_back (trans.weight);
+  transWeightProgram = WeightProgram (transWeightExpr, ParamDefs());
+  LogThisAt(7,"Compiled " << transWeightExpr.size() << " transition weights into " << transWeightProgram.nInstructions() << " instructions" << endl);
+
   ProgressLog(plog,6);
-  plog.initProgress ("Evaluating transition weights");
+  plog.initProgress ("Indexing transitions");
 
   EvaluatedMachineState::TransIndex tiCum = 0;
   for (StateIndex s = 0; s < nStates(); ++s) {
@@ -56,10 +63,9 @@ void EvaluatedMachine::init (const Machine& machine, const Params* params)
       const StateIndex d = trans.dest;
       const InputToken in = inputTokenizer.sym2tok.at (trans.in);
       const OutputToken out = outputTokenizer.sym2tok.at (trans.out);
-      const LogWeight lw = params ? log (WeightAlgebra::eval (trans.weight, params->defs)) : 0.;
-      state[s].outgoing[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (d, EvaluatedMachineState::Trans ({ .logWeight = lw, .transIndex = ti })));
-      state[d].incoming[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (s, EvaluatedMachineState::Trans ({ .logWeight = lw, .transIndex = ti })));
-      state[s].logTransWeight.push_back (lw);
+      state[s].outgoing[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (d, EvaluatedMachineState::Trans ({ .logWeight = 0., .transIndex = ti })));
+      state[d].incoming[in][out].insert (EvaluatedMachineState::StateTransMap::value_type (s, EvaluatedMachineState::Trans ({ .logWeight = 0., .transIndex = ti })));
+      state[s].logTransWeight.push_back (0.);
       ++ti;
     }
     state[s].nTransitions = ti;
@@ -67,6 +73,40 @@ void EvaluatedMachine::init (const Machine& machine, const Params* params)
     tiCum += ti;
   }
   nTransitions = tiCum;
+
+  if (params)
+    updateWeights (*params);
+}
+
+vguard<LogWeight> EvaluatedMachine::logTransWeights (const Params& params) const {
+  // resolve the machine's parameters using the supplied definitions
+  vector<WeightExpr> paramExpr;
+  for (const auto& p: transWeightProgram.param)
+    paramExpr.push_back (WeightAlgebra::param (p));
+  const vector<double> paramValue = WeightProgram (paramExpr, params.defs).eval();
+  const vector<double> transWeight = transWeightProgram.eval (paramValue);
+  vguard<LogWeight> logWeight (transWeight.size());
+  for (size_t n = 0; n < transWeight.size(); ++n)
+    logWeight[n] = log (transWeight[n]);
+  return logWeight;
+}
+
+void EvaluatedMachine::updateWeights (const Params& params) {
+  const vguard<LogWeight> logWeight = logTransWeights (params);
+  for (auto& ms: state)
+    for (EvaluatedMachineState::TransIndex ti = 0; ti < ms.nTransitions; ++ti)
+      ms.logTransWeight[ti] = logWeight[ms.transOffset + ti];
+
+  for (auto& ms: state) {
+    for (auto& in_ost: ms.outgoing)
+      for (auto& out_st: in_ost.second)
+	for (auto& st: out_st.second)
+	  st.second.logWeight = ms.logTransWeight[st.second.transIndex];
+    for (auto& in_ost: ms.incoming)
+      for (auto& out_st: in_ost.second)
+	for (auto& st: out_st.second)
+	  st.second.logWeight = state[st.first].logTransWeight[st.second.transIndex];
+  }
 }
 
 StateIndex EvaluatedMachine::nStates() const {
@@ -80,11 +80,14 @@ struct EvaluatedMachine {
   OutputTokenizer outputTokenizer;
   vguard<EvaluatedMachineState> state;
   EvaluatedMachineState::TransIndex nTransitions;
+  WeightProgram transWeightProgram;  // evaluates all transition weights (in order of state & TransIndex), with the machine's parameters as inputs
   EvaluatedMachine() { }
   EvaluatedMachine (const Machine&, const Params&);  // use machine.getParamDefs(true) to set missing parameters automatically
   EvaluatedMachine (const Machine&);  // WARNING: if this constructor is used, and no Params are supplied, all logWeight's will be zero
   bool canTokenize (const SeqPair&) const;
   void init (const Machine&, const Params*);
+  void updateWeights (const Params&);  // re-evaluates the logWeight's, keeping the topology, tokenizers & transition indices
+  vguard<LogWeight> logTransWeights (const Params&) const;  // log-weights of all transitions, indexed by transOffset + TransIndex
   void writeJson (ostream&) const;
   string toJsonString() const;
   StateIndex nStates() const;
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <fstream>
 #include "fastseq.h"
 #include "util.h"
 #include "logger.h"
@@ -154,29 +155,163 @@ void initFastSeq (FastSeq& seq, kseq_t* ks) {
     seq.qual = string(ks->qual.s);
 }
 
-void MachineBoss::readFastSeqs (const char* filename, vguard<FastSeq>& seqs) {
-  gzFile fp = gzopen(filename, "r");
-  Require (fp != Z_NULL, "Couldn't open %s", filename);
+FastSeqReader::FastSeqReader (const string& filename) :
+  filename (filename)
+{
+  fp = gzopen (filename.c_str(), "r");
+  Require (fp != Z_NULL, "Couldn't open %s", filename.c_str());
+  ks = kseq_init (fp);
+}
 
-  kseq_t *ks = kseq_init(fp);
-  while (true) {
-    if (kseq_read(ks) == -1)
-      break;
+FastSeqReader::~FastSeqReader() {
+  kseq_destroy ((kseq_t*) ks);
+  gzclose (fp);
+}
+
+bool FastSeqReader::next (FastSeq& seq) {
+  if (kseq_read ((kseq_t*) ks) == -1)
+    return false;
+  seq = FastSeq();
+  initFastSeq (seq, (kseq_t*) ks);
+  return true;
+}
 
-    FastSeq seq;
-    initFastSeq (seq, ks);
+void FastSeqReader::rewind() {
+  Require (gzrewind (fp) == 0, "Couldn't rewind %s", filename.c_str());
+  kseq_rewind ((kseq_t*) ks);
+}
 
+void MachineBoss::readFastSeqs (const char* filename, vguard<FastSeq>& seqs) {
+  FastSeqReader reader (filename);
+  const size_t nOld = seqs.size();
+  FastSeq seq;
+  while (reader.next (seq))
     seqs.push_back (seq);
-  }
-  kseq_destroy (ks);
-  gzclose (fp);
 
-  LogThisAt(3, "Read " << plural(seqs.size(),"sequence") << " from " << filename << endl);
+  LogThisAt(3, "Read " << plural(seqs.size() - nOld,"sequence") << " from " << filename << endl);
   
-  if (seqs.empty())
+  if (seqs.size() == nOld)
     Warn ("Couldn't read any sequences from %s", filename);
 }
 
+FastaIndex::FastaIndex (const string& filename) :
+  filename (filename)
+{
+  const string faiFilename = indexFilename (filename);
+  ifstream in (faiFilename);
+  if (!in)
+    Fail ("FASTA index %s not found; build it with --index-fasta %s", faiFilename.c_str(), filename.c_str());
+  string line;
+  while (getline (in, line)) {
+    const vguard<string> field = split (line, "\t");
+    if (field.empty() || (field.size() == 1 && field[0].empty()))
+      continue;
+    Require (field.size() == 5, "Bad line in FASTA index %s (only FASTA indices are supported): %s", faiFilename.c_str(), line.c_str());
+    Entry e;
+    e.name = field[0];
+    e.length = stoul (field[1]);
+    e.offset = stoul (field[2]);
+    e.lineBases = stoul (field[3]);
+    e.lineWidth = stoul (field[4]);
+    Require (e.lineWidth >= e.lineBases && (e.lineBases > 0 || e.length == 0), "Bad line in FASTA index %s: %s", faiFilename.c_str(), line.c_str());
+    Require (!entryIndex.count (e.name), "Duplicate sequence name %s in FASTA index %s", e.name.c_str(), faiFilename.c_str());
+    entryIndex[e.name] = entry.size();
+    entry.push_back (e);
+  }
+  LogThisAt(3, "Loaded index of " << plural(entry.size(),"sequence") << " in " << filename << endl);
+}
+
+string FastaIndex::indexFilename (const string& filename) {
+  return filename + ".fai";
+}
+
+void FastaIndex::build (const string& filename) {
+  ifstream in (filename, ios::binary);
+  if (!in)
+    Fail ("File not found: %s", filename.c_str());
+  Require (in.peek() != 0x1f, "Can't index %s: compressed FASTA files are not supported", filename.c_str());
+  const string faiFilename = indexFilename (filename);
+  ofstream out (faiFilename);
+  if (!out)
+    Fail ("Couldn't write %s", faiFilename.c_str());
+
+  Entry e;
+  bool inRecord = false, lastLineShort = false;
+  size_t nRecords = 0, lineNumber = 0;
+  set<string> names;
+  auto finishRecord = [&] () {
+    if (inRecord) {
+      out << e.name << '\t' << e.length << '\t' << e.offset << '\t' << e.lineBases << '\t' << e.lineWidth << '\n';
+      ++nRecords;
+    }
+  };
+  string line;
+  size_t pos = 0;
+  while (getline (in, line)) {
+    ++lineNumber;
+    const size_t lineBytes = line.size() + (in.eof() ? 0 : 1);  // include the newline, if present
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.size() && line[0] == '>') {
+      finishRecord();
+      const size_t nameEnd = line.find_first_of (" \t");
+      e = Entry();
+      e.name = line.substr (1, nameEnd == string::npos ? string::npos : nameEnd - 1);
+      Require (!names.count (e.name), "Duplicate sequence name %s in %s", e.name.c_str(), filename.c_str());
+      names.insert (e.name);
+      e.length = e.lineBases = e.lineWidth = 0;
+      e.offset = pos + lineBytes;
+      inRecord = true;
+      lastLineShort = false;
+    } else if (inRecord) {
+      if (line.empty()) {
+	lastLineShort = true;
+      } else {
+	Require (!lastLineShort && (e.lineBases == 0 || line.size() <= e.lineBases),
+		 "Can't index %s: line %lu of sequence %s has a different length from the first line", filename.c_str(), lineNumber, e.name.c_str());
+	if (e.lineBases == 0) {
+	  e.lineBases = line.size();
+	  e.lineWidth = lineBytes;
+	} else if (line.size() < e.lineBases)
+	  lastLineShort = true;
+	e.length += line.size();
+      }
+    } else
+      Require (line.empty(), "Can't index %s: %s does not look like a FASTA file", filename.c_str(), filename.c_str());
+    pos += lineBytes;
+  }
+  finishRecord();
+  LogThisAt(3, "Indexed " << plural(nRecords,"sequence") << " in " << filename << endl);
+}
+
+size_t FastaIndex::recordIndex (const string& name) const {
+  const auto iter = entryIndex.find (name);
+  if (iter == entryIndex.end())
+    Fail ("Sequence %s not found in %s", name.c_str(), filename.c_str());
+  return iter->second;
+}
+
+FastSeq FastaIndex::read (istream& in, size_t record) const {
+  Assert (record < entry.size(), "Record %lu out of range", record);
+  const Entry& e = entry[record];
+  FastSeq seq;
+  seq.name = e.name;
+  if (e.length) {
+    const size_t bytes = (e.length / e.lineBases) * e.lineWidth + e.length % e.lineBases;
+    string buf (bytes, '\0');
+    in.clear();
+    in.seekg (e.offset);
+    in.read (&buf[0], bytes);
+    Require ((size_t) in.gcount() == bytes, "Couldn't read sequence %s from %s; is the index out of date?", e.name.c_str(), filename.c_str());
+    seq.seq.reserve (e.length);
+    for (char c: buf)
+      if (c != '\n' && c != '\r')
+	seq.seq.push_back (c);
+    Require (seq.seq.size() == e.length, "Sequence %s in %s does not match its index; is the index out of date?", e.name.c_str(), filename.c_str());
+  }
+  return seq;
+}
+
 vguard<FastSeq> MachineBoss::readFastSeqs (const char* filename) {
   vguard<FastSeq> seqs;
   readFastSeqs (filename, seqs);
@@ -59,6 +59,41 @@ struct FastSeq {
   void writeFastq (ostream& out) const;
 };
 
+// FastSeqReader streams records from a (possibly gzipped) FASTA or FASTQ file, one at a time
+class FastSeqReader {
+public:
+  const string filename;
+  FastSeqReader (const string& filename);
+  ~FastSeqReader();
+  FastSeqReader (const FastSeqReader&) = delete;
+  FastSeqReader& operator= (const FastSeqReader&) = delete;
+  bool next (FastSeq&);  // returns false at end of file
+  void rewind();  // fails unless the file is seekable
+private:
+  gzFile fp;
+  void* ks;  // kseq_t, which is only defined in fastseq.cpp
+};
+
+// FastaIndex is a samtools-style .fai index, giving random access to the records of an uncompressed FASTA file.
+// Each line of the index is: name, length, offset of first base, bases per line, bytes per line (tab-separated)
+struct FastaIndex {
+  struct Entry {
+    string name;
+    size_t length, offset, lineBases, lineWidth;
+  };
+  string filename;  // the FASTA file
+  vguard<Entry> entry;
+  map<string,size_t> entryIndex;
+
+  FastaIndex (const string& filename);  // loads filename.fai, failing if it does not exist
+  static string indexFilename (const string& filename);
+  static void build (const string& filename);  // writes filename.fai
+
+  size_t nRecords() const { return entry.size(); }
+  size_t recordIndex (const string& name) const;  // fails if there is no such record
+  FastSeq read (istream& in, size_t record) const;  // seeks to the record in the (open) FASTA file
+};
+
 void readFastSeqs (const char* filename, vguard<FastSeq>&);
 vguard<FastSeq> readFastSeqs (const char* filename);
 
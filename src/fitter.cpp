@@ -1,13 +1,39 @@
+#include <cstdio>
+#include <cmath>
+#include <gsl/gsl_multimin.h>
 #include "fitter.h"
 #include "eval.h"
 #include "counts.h"
 #include "logger.h"
+#include "logsumexp.h"
 
 #define MaxEMIterations 1000
 #define MinEMImprovement .001
 
+// GSL parameters for direct optimization
+#define DirectStepSize 0.1
+#define DirectLineSearchTolerance 1e-4
+#define DirectGradientTolerance 1e-4
+#define DirectMaxSmallImprovements 3
+
+#define DefaultOnlineBatchSize 100
+#define DefaultOnlineEpochs 1
+#define DefaultOnlineStepDecay .7
+#define DefaultCheckpointInterval 100
+
 using namespace MachineBoss;
 
+MachineFitter::MachineFitter() :
+  threads (1),
+  accelerate (false),
+  viterbi (false),
+  direct (false),
+  batchSize (DefaultOnlineBatchSize),
+  epochs (DefaultOnlineEpochs),
+  stepDecay (DefaultOnlineStepDecay),
+  checkpointInterval (DefaultCheckpointInterval)
+{ }
+
 Constraints MachineFitter::allConstraints() const {
   return machine.cons.combine (constraints);
 }
@@ -22,13 +48,21 @@ Params MachineFitter::fit (const SeqPairList& trainingSet, size_t width) const {
 
 Params MachineFitter::fit (const SeqPairList& trainingSet, const list<Envelope>& envelopes) const {
   Assert (envelopes.size() == trainingSet.seqPairs.size(), "Envelope/training set mismatch");
+  Require (!direct || !(accelerate || viterbi), "Direct (L-BFGS) fitting can't be combined with acceleration or Viterbi training");
+  if (direct)
+    return fitDirect (trainingSet, envelopes);
+  if (accelerate)
+    return fitAccelerated (trainingSet, envelopes);
   Params params = seed;
   double prev;
-  for (size_t iter = 0; true; ++iter) {
+  EvaluatedMachine eval (machine);
+  size_t iter;
+  for (iter = 0; true; ++iter) {
+    WeightExprScope iterScope;  // frees the objective function & intermediate parameters of each iteration
     const Params allParams = machine.funcs.combine(constants).combine(params);
-    const EvaluatedMachine eval (machine, allParams);
-    const MachineCounts counts (eval, trainingSet, envelopes);
-    LogThisAt(2,"Baum-Welch iteration #" << (iter+1) << ": log-likelihood " << counts.loglike << endl);
+    eval.updateWeights (allParams);
+    const MachineCounts counts (eval, trainingSet, envelopes, threads, viterbi);
+    LogThisAt(2,(viterbi ? "Viterbi training" : "Baum-Welch") << " iteration #" << (iter+1) << ": " << (viterbi ? "Viterbi " : "") << "log-likelihood " << counts.loglike << endl);
     LogThisAt(4,"Parameters:" << endl << JsonWriter<Params>::toJsonString(params) << endl);
     if (iter > 0) {
       if (iter == MaxEMIterations)
@@ -41,7 +75,328 @@ Params MachineFitter::fit (const SeqPairList& trainingSet, const list<Envelope>&
     MachineObjective objective (machine, counts, constraints, constants);
     LogThisAt(5,"Optimizing M-step objective function" << endl);
     params = objective.optimize (params);
+    iterScope.keep (params.defs);
     prev = counts.loglike;
   }
+  LogThisAt(2,(viterbi ? "Viterbi training" : "Baum-Welch") << " finished after " << (iter+1) << " E-step passes" << endl);
+  return params;
+}
+
+// Maps constrained parameters to an unconstrained vector: log for normalized groups & rates, logit for probabilities
+static vguard<double> unconstrainedParams (const Params& params, const Constraints& cons) {
+  vguard<double> x;
+  const auto value = [&] (const string& p) { return WeightAlgebra::eval (params.defs.at(p), ParamDefs()); };
+  for (const auto& group: cons.norm)
+    for (const auto& p: group)
+      x.push_back (log (value(p)));
+  for (const auto& p: cons.prob) {
+    const double v = value(p);
+    x.push_back (log(v) - log(1 - v));
+  }
+  for (const auto& p: cons.rate)
+    x.push_back (log (value(p)));
+  return x;
+}
+
+// Inverse of unconstrainedParams
+static Params constrainedParams (const vguard<double>& x, const Constraints& cons) {
+  Params params;
+  size_t n = 0;
+  for (const auto& group: cons.norm) {
+    const double xMax = *max_element (x.begin() + n, x.begin() + n + group.size());
+    double norm = 0;
+    for (size_t k = 0; k < group.size(); ++k)
+      norm += exp (x[n+k] - xMax);
+    for (const auto& p: group)
+      params.defs[p] = WeightAlgebra::doubleConstant (exp (x[n++] - xMax) / norm);
+  }
+  for (const auto& p: cons.prob)
+    params.defs[p] = WeightAlgebra::doubleConstant (1 / (1 + exp (-x[n++])));
+  for (const auto& p: cons.rate)
+    params.defs[p] = WeightAlgebra::doubleConstant (exp (x[n++]));
   return params;
 }
+
+// SQUAREM (Varadhan & Roland, 2008; steplength scheme S3), applied to the unconstrained parameter vector.
+// Each cycle takes two EM steps from x0 to x1 and x2, then extrapolates along r = x1-x0, v = x2-2*x1+x0.
+// The extrapolated point is kept (after one stabilizing EM step) only if its log-likelihood is no worse than that of x1;
+// otherwise the cycle falls back to x2.
+// To estimate the passes saved, a step length s is counted as 2s plain EM steps (s = 1 lands exactly on x2).
+Params MachineFitter::fitAccelerated (const SeqPairList& trainingSet, const list<Envelope>& envelopes) const {
+  const Constraints cons = allConstraints();
+  Params params = seed;
+  double prev = -numeric_limits<double>::infinity();
+  EvaluatedMachine eval (machine);
+  size_t nPasses = 0, nAccepted = 0, nRejected = 0;
+  double emSteps = 0;  // plain EM steps covered so far
+  const auto eStep = [&] (const Params& p) {
+    eval.updateWeights (machine.funcs.combine(constants).combine(p));
+    ++nPasses;
+    return MachineCounts (eval, trainingSet, envelopes, threads, viterbi);
+  };
+  const auto mStep = [&] (const MachineCounts& counts, const Params& p) {
+    const MachineObjective objective (machine, counts, constraints, constants);
+    return objective.optimize (p);
+  };
+  size_t iter;
+  for (iter = 0; true; ++iter) {
+    WeightExprScope iterScope;  // frees the objective functions & intermediate parameters of each cycle
+    const MachineCounts counts0 = eStep (params);
+    LogThisAt(2,"SQUAREM cycle #" << (iter+1) << ": log-likelihood " << counts0.loglike << endl);
+    LogThisAt(4,"Parameters:" << endl << JsonWriter<Params>::toJsonString(params) << endl);
+    if (iter > 0) {
+      if (iter == MaxEMIterations)
+	break;
+      const double improvement = (counts0.loglike - prev) / abs(prev);
+      if (improvement < MinEMImprovement)
+	break;
+    }
+    const Params params1 = mStep (counts0, params);
+    const MachineCounts counts1 = eStep (params1);
+    if ((counts1.loglike - counts0.loglike) / abs(counts0.loglike) < MinEMImprovement) {
+      params = params1;
+      iterScope.keep (params.defs);
+      ++emSteps;
+      break;
+    }
+    const Params params2 = mStep (counts1, params1);
+    const vguard<double> x0 = unconstrainedParams (params, cons), x1 = unconstrainedParams (params1, cons), x2 = unconstrainedParams (params2, cons);
+    double rr = 0, vv = 0;
+    for (size_t n = 0; n < x0.size(); ++n) {
+      const double r = x1[n] - x0[n], v = x2[n] - 2*x1[n] + x0[n];
+      rr += r*r;
+      vv += v*v;
+    }
+    const double alpha = vv > 0 ? min (-sqrt (rr / vv), -1.) : -1.;
+    Params next = params2;
+    double cycleSteps = 2;
+    if (alpha < -1 && isfinite (alpha)) {
+      vguard<double> x (x0.size());
+      for (size_t n = 0; n < x.size(); ++n)
+	x[n] = x0[n] - 2*alpha*(x1[n] - x0[n]) + alpha*alpha*(x2[n] - 2*x1[n] + x0[n]);
+      if (all_of (x.begin(), x.end(), [] (double xn) { return isfinite (xn); })) {
+	const Params extrapolated = params2.combine (constrainedParams (x, cons), true);
+	const MachineCounts countsX = eStep (extrapolated);
+	LogThisAt(3,"SQUAREM step length " << -alpha << ": log-likelihood " << countsX.loglike << " (EM step: " << counts1.loglike << ")" << endl);
+	if (countsX.loglike >= counts1.loglike) {
+	  next = mStep (countsX, extrapolated);
+	  cycleSteps = -2*alpha + 1;
+	  ++nAccepted;
+	} else
+	  ++nRejected;
+      }
+    }
+    params = next;
+    iterScope.keep (params.defs);
+    prev = counts0.loglike;
+    emSteps += cycleSteps;
+  }
+  LogThisAt(2,"SQUAREM finished after " << (iter+1) << " cycles and " << nPasses << " E-step passes (" << nAccepted << " extrapolations accepted, " << nRejected << " rejected)" << endl);
+  const double emPasses = emSteps + 1;  // plain EM also evaluates its final parameters
+  const long saved = lround (emPasses) - (long) nPasses;
+  LogThisAt(2,"Plain EM would have needed about " << lround (emPasses) << " E-step passes for the same steps ("
+	    << (saved > 0 ? string("saved ") + plural (saved, "pass", "passes") : string("no passes saved")) << ")" << endl);
+  return params;
+}
+
+// DirectLikelihood is the objective function for direct (L-BFGS) maximization of the log-likelihood.
+// The constrained parameters are mapped to unconstrained ones using ParamTransform.
+// Each evaluation runs one pass over the training set: Forward-only if just the value is needed (e.g. during line searches),
+// otherwise Forward-Backward, and the gradient is obtained by reverse-mode differentiation of the transition weights, weighted by (expected count / weight).
+struct DirectLikelihood : ParamTransform {
+  const MachineFitter& fitter;
+  const SeqPairList& trainingSet;
+  const list<Envelope>& envelopes;
+  Params fixedParams;  // function definitions, constants, and unconstrained parameters
+  vguard<string> constrainedParam;
+  WeightProgram paramProgram;  // evaluates constrained parameters as functions of transformed parameters
+  WeightProgram weightProgram;  // evaluates transition weights as functions of transformed parameters
+  EvaluatedMachine eval;
+  const double nPairs;  // the objective is scaled by 1/nPairs, so that step sizes & tolerances do not depend on the size of the training set
+  size_t nPasses, nForwardPasses;
+  DirectLikelihood (const MachineFitter& fitter, const SeqPairList& trainingSet, const list<Envelope>& envelopes, const Params& seed) :
+    fitter (fitter),
+    trainingSet (trainingSet),
+    envelopes (envelopes),
+    eval (fitter.machine),
+    nPairs (max ((size_t) 1, trainingSet.seqPairs.size())),
+    nPasses (0),
+    nForwardPasses (0)
+  {
+    const Constraints cons = fitter.allConstraints();
+    init (cons, fitter.machine.params());
+    fixedParams = fitter.machine.funcs.combine (fitter.constants);
+    for (const auto& p_d: seed.defs)
+      if (!paramTransformDefs.count (p_d.first) && !fixedParams.defs.count (p_d.first))
+	fixedParams.defs[p_d.first] = p_d.second;
+    vguard<WeightExpr> paramExpr;
+    for (const auto& p_d: paramTransformDefs) {
+      constrainedParam.push_back (p_d.first);
+      paramExpr.push_back (p_d.second);
+    }
+    paramProgram = WeightProgram (paramExpr, ParamDefs(), transformedParam);
+    ParamDefs allDefs = fixedParams.defs;
+    allDefs.insert (paramTransformDefs.begin(), paramTransformDefs.end());
+    vguard<WeightExpr> transWeight;
+    for (const auto& ms: fitter.machine.state)
+      for (const auto& trans: ms.trans)
+	transWeight.push_back (trans.weight);
+    weightProgram = WeightProgram (transWeight, allDefs, transformedParam);
+    Require (weightProgram.nParams() <= transformedParam.size(),
+	     "Parameter %s not defined", weightProgram.param[transformedParam.size()].c_str());
+  }
+  Params params (const double* x) const {
+    vguard<double> value (constrainedParam.size());
+    paramProgram.eval (x, value.data());
+    Params p;
+    for (size_t n = 0; n < value.size(); ++n)
+      p.defs[constrainedParam[n]] = WeightAlgebra::doubleConstant (value[n]);
+    return p;
+  }
+  // returns log-likelihood; if grad is non-null, fills it with the gradient of log-likelihood with respect to x
+  double logLike (const double* x, double* grad) {
+    WeightExprScope evalScope;
+    eval.updateWeights (fixedParams.combine (params (x), true));
+    if (!grad) {
+      const double ll = MachineCounts::forwardLogLike (eval, trainingSet, envelopes, fitter.threads);
+      ++nForwardPasses;
+      LogThisAt(3,"Forward pass #" << nForwardPasses << ": log-likelihood " << ll << endl);
+      return ll;
+    }
+    const MachineCounts counts (eval, trainingSet, envelopes, fitter.threads);
+    ++nPasses;
+    LogThisAt(3,"Forward-Backward pass #" << nPasses << ": log-likelihood " << counts.loglike << endl);
+    vguard<double> w (weightProgram.nResults()), countPerWeight;
+    weightProgram.eval (x, w.data());
+    for (const auto& stateCount: counts.count)
+      for (auto c: stateCount) {
+	const double wt = w[countPerWeight.size()];
+	countPerWeight.push_back (c ? (c / wt) : 0.);
+      }
+    weightProgram.gradient (x, countPerWeight.data(), grad);
+    return counts.loglike;
+  }
+};
+
+static double gsl_direct_objective (const gsl_vector *v, void *voidDL) {
+  DirectLikelihood& dl (*((DirectLikelihood*)voidDL));
+  const vguard<double> x = gsl_vector_to_stl (v);
+  return -dl.logLike (x.data(), NULL) / dl.nPairs;
+}
+
+static void gsl_direct_objective_with_deriv (const gsl_vector *v, void *voidDL, double *f, gsl_vector *df) {
+  DirectLikelihood& dl (*((DirectLikelihood*)voidDL));
+  const vguard<double> x = gsl_vector_to_stl (v);
+  vguard<double> grad (x.size());
+  *f = -dl.logLike (x.data(), grad.data()) / dl.nPairs;
+  for (size_t n = 0; n < grad.size(); ++n)
+    gsl_vector_set (df, n, -grad[n] / dl.nPairs);
+}
+
+static void gsl_direct_objective_deriv (const gsl_vector *v, void *voidDL, gsl_vector *df) {
+  double f;
+  gsl_direct_objective_with_deriv (v, voidDL, &f, df);
+}
+
+Params MachineFitter::fitDirect (const SeqPairList& trainingSet, const list<Envelope>& envelopes) const {
+  DirectLikelihood dl (*this, trainingSet, envelopes, seed);
+  Params params = seed;
+  if (dl.transformedParam.empty())
+    return params;
+
+  gsl_multimin_function_fdf func;
+  func.n = dl.transformedParam.size();
+  func.f = gsl_direct_objective;
+  func.df = gsl_direct_objective_deriv;
+  func.fdf = gsl_direct_objective_with_deriv;
+  func.params = (void*) &dl;
+
+  gsl_vector* x = stl_to_gsl_vector (dl.transformedValues (seed));
+  gsl_multimin_fdfminimizer *s = gsl_multimin_fdfminimizer_alloc (gsl_multimin_fdfminimizer_vector_bfgs2, func.n);
+  gsl_multimin_fdfminimizer_set (s, &func, x, DirectStepSize, DirectLineSearchTolerance);
+
+  double prev = -s->f * dl.nPairs;
+  size_t nSmallImprovements = 0;
+  for (size_t iter = 0; iter < MaxEMIterations; ++iter) {
+    const int status = gsl_multimin_fdfminimizer_iterate (s);
+    const double loglike = -s->f * dl.nPairs;
+    LogThisAt(2,"L-BFGS iteration #" << (iter+1) << ": log-likelihood " << loglike << endl);
+    if (status)
+      break;
+    // stop when the gradient is small, or when several consecutive iterations have each made little relative improvement
+    if (gsl_multimin_test_gradient (s->gradient, DirectGradientTolerance) == GSL_SUCCESS)
+      break;
+    const double improvement = (loglike - prev) / abs(prev);
+    nSmallImprovements = improvement < MinEMImprovement ? (nSmallImprovements + 1) : 0;
+    if (nSmallImprovements == DirectMaxSmallImprovements)
+      break;
+    prev = loglike;
+  }
+
+  const vguard<double> xFinal = gsl_vector_to_stl (s->x);
+  params = params.combine (dl.params (xFinal.data()), true);
+  LogThisAt(2,"L-BFGS finished after " << plural (dl.nPasses, "Forward-Backward pass", "Forward-Backward passes")
+	    << " and " << plural (dl.nForwardPasses, "Forward-only pass", "Forward-only passes") << endl);
+
+  gsl_multimin_fdfminimizer_free (s);
+  gsl_vector_free (x);
+
+  return params;
+}
+
+Params MachineFitter::fitOnline (SeqPairReader& reader) const {
+  return fitOnline (reader, [] (const SeqPairList& batch) { return batch.envelopes(); });
+}
+
+Params MachineFitter::fitOnline (SeqPairReader& reader, size_t width) const {
+  return fitOnline (reader, [width] (const SeqPairList& batch) { return batch.envelopes (width); });
+}
+
+Params MachineFitter::fitOnline (SeqPairReader& reader, const function<list<Envelope>(const SeqPairList&)>& getEnvelopes) const {
+  Require (batchSize > 0, "Mini-batch size must be positive");
+  Require (epochs > 0, "Number of epochs must be positive");
+  Params params = seed;
+  EvaluatedMachine eval (machine);
+  MachineCounts stats;  // running average of per-pair expected counts
+  size_t nUpdates = 0;
+  for (size_t epoch = 0; epoch < epochs; ++epoch) {
+    reader.rewind();
+    while (true) {
+      SeqPairList batch;
+      const size_t nPairs = reader.next (batch, batchSize);
+      if (nPairs == 0)
+	break;
+      WeightExprScope iterScope;  // frees the objective function & intermediate parameters of each update
+      const Params allParams = machine.funcs.combine(constants).combine(params);
+      eval.updateWeights (allParams);
+      MachineCounts counts (eval, batch, getEnvelopes (batch), threads, viterbi);
+      const double stepSize = nUpdates ? pow (nUpdates + 2., -stepDecay) : 1.;
+      counts *= stepSize / nPairs;
+      if (nUpdates)
+	(stats *= 1. - stepSize) += counts;
+      else
+	stats = counts;
+      LogThisAt(2,"Online EM update #" << (nUpdates+1) << " (epoch " << (epoch+1) << "): mean log-likelihood " << (counts.loglike / stepSize) << " over " << nPairs << " sequence pairs" << endl);
+      LogThisAt(4,"Parameters:" << endl << JsonWriter<Params>::toJsonString(params) << endl);
+      MachineObjective objective (machine, stats, constraints, constants);
+      params = objective.optimize (params);
+      iterScope.keep (params.defs);
+      ++nUpdates;
+      if (!checkpointFilename.empty() && checkpointInterval > 0 && nUpdates % checkpointInterval == 0)
+	saveCheckpoint (params);
+    }
+    Require (nUpdates > 0, "No training data in %s", reader.filename.c_str());
+  }
+  if (!checkpointFilename.empty())
+    saveCheckpoint (params);
+  return params;
+}
+
+void MachineFitter::saveCheckpoint (const Params& params) const {
+  // write to a temporary file, then rename, so that an interrupted run never leaves a truncated checkpoint
+  const string tmpFilename = checkpointFilename + ".tmp";
+  JsonWriter<Params>::toFile (params, tmpFilename);
+  if (rename (tmpFilename.c_str(), checkpointFilename.c_str()) != 0)
+    Fail ("Couldn't rename %s to %s", tmpFilename.c_str(), checkpointFilename.c_str());
+  LogThisAt(3,"Saved parameters to " << checkpointFilename << endl);
+}
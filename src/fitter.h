@@ -1,6 +1,7 @@
 #ifndef FITTER_INCLUDED
 #define FITTER_INCLUDED
 
+#include <functional>
 #include "machine.h"
 #include "params.h"
 #include "constraints.h"
@@ -12,11 +13,32 @@ struct MachineFitter {
   Machine machine;
   Constraints constraints;
   Params seed, constants;
+  size_t threads;  // number of threads for the E-step
+  bool accelerate;  // if true, fit() extrapolates EM steps using SQUAREM
+  bool viterbi;  // if true, the E-step counts transitions on the Viterbi path only (hard EM)
+  bool direct;  // if true, fit() maximizes the log-likelihood directly by L-BFGS, rather than by EM
+
+  // online (stepwise) EM settings
+  size_t batchSize;  // sequence pairs per mini-batch
+  size_t epochs;  // passes through the training set
+  double stepDecay;  // step size is 1 for the first update, then (t+2)^(-stepDecay) for update t (counting from 0); should be in (0.5,1]
+  size_t checkpointInterval;  // number of mini-batches between checkpoints
+  string checkpointFilename;  // if nonempty, parameters are saved here every checkpointInterval mini-batches
+
+  MachineFitter();
 
   Constraints allConstraints() const;  // combines machine.cons and constraints
   Params fit (const SeqPairList&) const;
   Params fit (const SeqPairList&, size_t) const;
   Params fit (const SeqPairList&, const list<Envelope>&) const;
+  Params fitAccelerated (const SeqPairList&, const list<Envelope>&) const;
+  Params fitDirect (const SeqPairList&, const list<Envelope>&) const;
+
+  // online EM: streams mini-batches of training data, interpolating expected counts between batches
+  Params fitOnline (SeqPairReader&) const;
+  Params fitOnline (SeqPairReader&, size_t) const;
+  Params fitOnline (SeqPairReader&, const function<list<Envelope>(const SeqPairList&)>&) const;
+  void saveCheckpoint (const Params&) const;
 };
 
 }  // end namespace
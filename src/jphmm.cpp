@@ -26,6 +26,9 @@ JPHMM::JPHMM (const vguard<FastSeq>& seqs)
   const auto nRows = WeightAlgebra::intConstant (rows), nOtherRows = WeightAlgebra::intConstant (rows - 1);
   const auto startProb = WeightAlgebra::reciprocal (nRows), pJump = WeightAlgebra::param (jumpParam);
   const auto stayProb = rows == 1 ? WeightAlgebra::one() : WeightAlgebra::negate (pJump), jumpProb = WeightAlgebra::divide (pJump, nOtherRows);
+  auto cellNames = make_shared<StateNameArena> (StateNameArena::Cell);
+  cellNames->rowKey = jpHMMrowTag;
+  cellNames->colKey = jpHMMcolTag;
   for (int row = 0; row < rows; ++row)
     state[startState()].trans.push_back (MachineTransition (string(), string (1, seqs[row].seq[0]), emitState(row,0), startProb));
   for (int srcCol = 0; srcCol < cols; ++srcCol) {
@@ -33,8 +36,7 @@ JPHMM::JPHMM (const vguard<FastSeq>& seqs)
     for (int srcRow = 0; srcRow < rows; ++srcRow) {
       MachineState& srcState = state[emitState(srcRow,srcCol)];
       TransList& srcTrans = srcState.trans;
-      srcState.name[jpHMMrowTag] = srcRow + 1;
-      srcState.name[jpHMMcolTag] = srcCol + 1;
+      srcState.name = StateName (cellNames, srcRow + 1, srcCol + 1);
       if (destCol < cols)
 	for (int destRow = 0; destRow < rows; ++destRow)
 	  srcTrans.push_back (MachineTransition (string(), string (1, seqs[destRow].seq[destCol]), emitState(destRow,destCol), srcRow == destRow ? stayProb : jumpProb));
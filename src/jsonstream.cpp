@@ -0,0 +1,262 @@
+#include <fstream>
+#include "jsonstream.h"
+#include "schema.h"
+#include "util.h"
+
+using namespace MachineBoss;
+
+JsonFragmentSax::JsonFragmentSax (CapturePredicate capture, FragmentCallback callback) :
+  capture (capture),
+  callback (callback)
+{ }
+
+json JsonFragmentSax::path() const {
+  json p = json::array();
+  for (const auto& level: outer)
+    if (level.isArray)
+      p.push_back (level.index);
+    else
+      p.push_back (level.key);
+  return p;
+}
+
+void JsonFragmentSax::advance() {
+  if (!outer.empty() && outer.back().isArray)
+    ++outer.back().index;
+}
+
+void JsonFragmentSax::scalar (json&& val) {
+  if (inner.empty()) {
+    callback (path(), val);
+    advance();
+  } else {
+    json& parent = *inner.back();
+    if (parent.is_array())
+      parent.push_back (std::move (val));
+    else
+      parent[innerKey] = std::move (val);
+  }
+}
+
+bool JsonFragmentSax::startContainer (json&& empty) {
+  if (inner.empty()) {
+    if (capture (path())) {
+      fragment = std::move (empty);
+      inner.push_back (&fragment);
+    } else
+      outer.push_back (OuterLevel { empty.is_array(), 0, std::string() });
+  } else {
+    json& parent = *inner.back();
+    if (parent.is_array()) {
+      parent.push_back (std::move (empty));
+      inner.push_back (&parent.back());
+    } else {
+      json& child = parent[innerKey];
+      child = std::move (empty);
+      inner.push_back (&child);
+    }
+  }
+  return true;
+}
+
+bool JsonFragmentSax::endContainer() {
+  if (inner.empty())
+    outer.pop_back();
+  else {
+    inner.pop_back();
+    if (!inner.empty())
+      return true;
+    callback (path(), fragment);
+    fragment = json();
+  }
+  advance();
+  return true;
+}
+
+bool JsonFragmentSax::null() {
+  scalar (json());
+  return true;
+}
+
+bool JsonFragmentSax::boolean (bool val) {
+  scalar (json (val));
+  return true;
+}
+
+bool JsonFragmentSax::number_integer (number_integer_t val) {
+  scalar (json (val));
+  return true;
+}
+
+bool JsonFragmentSax::number_unsigned (number_unsigned_t val) {
+  scalar (json (val));
+  return true;
+}
+
+bool JsonFragmentSax::number_float (number_float_t val, const string_t& s) {
+  scalar (json (val));
+  return true;
+}
+
+bool JsonFragmentSax::string (string_t& val) {
+  scalar (json (std::move (val)));
+  return true;
+}
+
+bool JsonFragmentSax::start_object (size_t elements) {
+  return startContainer (json::object());
+}
+
+bool JsonFragmentSax::key (string_t& val) {
+  if (inner.empty())
+    outer.back().key = val;
+  else
+    innerKey = val;
+  return true;
+}
+
+bool JsonFragmentSax::end_object() {
+  return endContainer();
+}
+
+bool JsonFragmentSax::start_array (size_t elements) {
+  return startContainer (json::array());
+}
+
+bool JsonFragmentSax::end_array() {
+  return endContainer();
+}
+
+bool JsonFragmentSax::parse_error (size_t position, const std::string& last_token, const nlohmann::detail::exception& ex) {
+  Fail ("JSON parse error at byte %lu: %s", position, ex.what());
+  return false;
+}
+
+void JsonFragmentSax::parse (istream& in, CapturePredicate capture, FragmentCallback callback) {
+  JsonFragmentSax sax (capture, callback);
+  json::sax_parse (in, &sax);
+}
+
+void JsonFragmentSax::parse (const char* begin, const char* end, CapturePredicate capture, FragmentCallback callback) {
+  JsonFragmentSax sax (capture, callback);
+  json::sax_parse (begin, end, &sax);
+}
+
+// builds a Machine one state at a time
+struct MachineStreamBuilder {
+  Machine& machine;
+  const bool trusted;
+  json header;  // top-level values other than "state"
+  bool sawState;
+  MachineStateReader reader;  // state IDs in "to" are resolved once all states are known
+
+  MachineStreamBuilder (Machine& machine, bool trusted) :
+    machine (machine),
+    trusted (trusted || MachineSchema::inputTrusted()),
+    header (json::object()),
+    sawState (false)
+  { }
+
+  bool capture (const json& path) {
+    if (path.size() == 1 && path[0] == "state") {
+      sawState = true;
+      return false;
+    }
+    return path.size() == 1 || path.size() == 2;
+  }
+
+  void receive (const json& path, json& fragment) {
+    Require (path.size() > 0, "Machine is not a JSON object");
+    Require (path[0].is_string(), "Machine is not a JSON object");
+    const string key = path[0].get<string>();
+    if (path.size() == 1) {
+      Require (key != "state", "state is not an array");
+      header[key] = std::move (fragment);
+    } else {
+      Require (path[1].is_number(), "state is not an array");
+      addState (fragment);
+    }
+  }
+
+  void addState (json& js) {
+    if (!trusted) {
+      // a machine whose only state is js is schema-valid iff js is a valid state
+      json single;
+      single["state"].push_back (std::move (js));
+      MachineSchema::validateOrDie ("machine", single);
+      js = std::move (single["state"][0]);
+    }
+    reader.readState (machine.state, js);
+  }
+
+  void finish() {
+    if (!sawState) {
+      // composite machine, or an invalid one: either way, Machine::readJson knows what to do
+      machine.readJson (header);
+      return;
+    }
+    if (!trusted) {
+      header["state"] = json::array();
+      MachineSchema::validateOrDie ("machine", header);
+    }
+    if (header.count("defs"))
+      machine.funcs.readJson (header.at("defs"));
+    if (header.count("cons"))
+      machine.cons.readJson (header.at("cons"));
+    reader.resolveDests (machine.state);
+  }
+};
+
+void MachineStreamLoader::readJson (Machine& machine, istream& in) {
+  MachineStreamBuilder builder (machine, false);
+  JsonFragmentSax::parse (in,
+			  [&] (const json& path) { return builder.capture (path); },
+			  [&] (const json& path, json& fragment) { builder.receive (path, fragment); });
+  builder.finish();
+}
+
+Machine MachineStreamLoader::fromJson (istream& in) {
+  Machine machine;
+  readJson (machine, in);
+  return machine;
+}
+
+Machine MachineStreamLoader::fromBuffer (const char* data, size_t size, bool trusted) {
+  Machine machine;
+  MachineStreamBuilder builder (machine, trusted);
+  JsonFragmentSax::parse (data, data + size,
+			  [&] (const json& path) { return builder.capture (path); },
+			  [&] (const json& path, json& fragment) { builder.receive (path, fragment); });
+  builder.finish();
+  return machine;
+}
+
+Machine MachineStreamLoader::fromFile (const string& filename) {
+  ifstream infile (filename);
+  if (!infile)
+    Fail ("File not found: %s", filename.c_str());
+  return fromJson (infile);
+}
+
+void SeqPairStreamLoader::readJson (istream& in, Callback callback) {
+  JsonFragmentSax::parse (in,
+			  [] (const json& path) { return path.size() == 1; },
+			  [&] (const json& path, json& fragment) {
+			    Require (path.size() == 1 && path[0].is_number(), "SeqPair list is not a JSON array");
+			    SeqPair seqPair;
+			    seqPair.readJson (fragment);
+			    callback (seqPair);
+			  });
+}
+
+void SeqPairStreamLoader::readFile (const string& filename, Callback callback) {
+  ifstream infile (filename);
+  if (!infile)
+    Fail ("File not found: %s", filename.c_str());
+  readJson (infile, callback);
+}
+
+void SeqPairStreamLoader::readFiles (SeqPairList& seqPairList, const vector<string>& filenames) {
+  for (const auto& filename: filenames)
+    readFile (filename, [&] (SeqPair& seqPair) { seqPairList.seqPairs.push_back (std::move (seqPair)); });
+}
@@ -0,0 +1,78 @@
+#ifndef JSONSTREAM_INCLUDED
+#define JSONSTREAM_INCLUDED
+
+#include "machine.h"
+#include "seqpair.h"
+
+namespace MachineBoss {
+
+using namespace std;
+using json = nlohmann::json;
+
+// JsonFragmentSax is a SAX handler that never builds a DOM for the whole document.
+// Values whose path satisfies the capture predicate are assembled into small DOM fragments and passed to the callback as soon as they are complete;
+// containers that are not captured are descended into, and scalars outside captured values are passed to the callback as they arrive.
+// A path is a JSON array of object keys (strings) and array indices (numbers) leading from the root to the value.
+class JsonFragmentSax : public nlohmann::json_sax<json> {
+public:
+  typedef function<bool(const json& path)> CapturePredicate;
+  typedef function<void(const json& path, json& fragment)> FragmentCallback;
+
+  JsonFragmentSax (CapturePredicate capture, FragmentCallback callback);
+
+  bool null() override;
+  bool boolean (bool val) override;
+  bool number_integer (number_integer_t val) override;
+  bool number_unsigned (number_unsigned_t val) override;
+  bool number_float (number_float_t val, const string_t& s) override;
+  bool string (string_t& val) override;
+  bool start_object (size_t elements) override;
+  bool key (string_t& val) override;
+  bool end_object() override;
+  bool start_array (size_t elements) override;
+  bool end_array() override;
+  bool parse_error (size_t position, const std::string& last_token, const nlohmann::detail::exception& ex) override;
+
+  // parses a stream or an in-memory buffer, failing on malformed JSON
+  static void parse (istream& in, CapturePredicate capture, FragmentCallback callback);
+  static void parse (const char* begin, const char* end, CapturePredicate capture, FragmentCallback callback);
+
+private:
+  struct OuterLevel {
+    bool isArray;
+    size_t index;
+    std::string key;
+  };
+  CapturePredicate capture;
+  FragmentCallback callback;
+  vector<OuterLevel> outer;  // containers above the current fragment
+  vector<json*> inner;  // open containers within the current fragment
+  json fragment;
+  std::string innerKey;
+  json path() const;
+  void advance();
+  void scalar (json&& val);
+  bool startContainer (json&& empty);
+  bool endContainer();
+};
+
+// Streaming loader for machines: each state is converted as soon as its closing brace is read, so peak memory is one state's DOM plus the machine itself.
+// Composite machines ("compose", "concat", etc) are delegated to Machine::readJson once their (small) operand DOM is complete.
+struct MachineStreamLoader {
+  static void readJson (Machine& machine, istream& in);
+  static Machine fromJson (istream& in);
+  static Machine fromFile (const std::string& filename);
+  static Machine fromBuffer (const char* data, size_t size, bool trusted = false);  // trusted skips schema validation (e.g. for embedded presets)
+};
+
+// Streaming loader for SeqPairLists: each SeqPair is passed to the callback as soon as it has been read, and then discarded.
+struct SeqPairStreamLoader {
+  typedef function<void(SeqPair&)> Callback;
+  static void readJson (istream& in, Callback callback);
+  static void readFile (const std::string& filename, Callback callback);
+  static void readFiles (SeqPairList& seqPairList, const vector<std::string>& filenames);
+};
+
+}  // end namespace
+
+#endif /* JSONSTREAM_INCLUDED */
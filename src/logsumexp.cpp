@@ -81,6 +81,13 @@ vguard<double> MachineBoss::gsl_vector_to_stl (const gsl_vector* v) {
   return stlv;
 }
 
+gsl_vector* MachineBoss::stl_to_gsl_vector (const vguard<double>& stlv) {
+  gsl_vector* v = gsl_vector_alloc (stlv.size());
+  for (size_t i = 0; i < stlv.size(); ++i)
+    gsl_vector_set (v, i, stlv[i]);
+  return v;
+}
+
 vguard<vguard<LogProb> > MachineBoss::log_vector_gsl_vector (const vguard<const gsl_vector*>& v) {
   vguard<vguard<LogProb> > result (v.size());
   for (size_t i = 0; i < v.size(); ++i)
@@ -139,6 +139,7 @@ vguard<vguard<LogProb> > log_matrix (const vguard<vguard<double> >& m);
 
 vguard<LogProb> log_gsl_vector (const gsl_vector* v);
 vguard<double> gsl_vector_to_stl (const gsl_vector* v);
+gsl_vector* stl_to_gsl_vector (const vguard<double>& v);
 
 vguard<vguard<LogProb> > log_vector_gsl_vector (const vguard<const gsl_vector*>& v);
 
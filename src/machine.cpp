@@ -2,6 +2,7 @@
 #include <fstream>
 #include <set>
 #include <functional>
+#include <tuple>
 #include <json.hpp>
 
 #include "machine.h"
@@ -19,6 +20,31 @@ using namespace MachineBoss;
 using json = nlohmann::json;
 using placeholders::_1;
 
+// stateNames returns the names of a machine's states, for use in a StateNameArena
+vguard<StateName> stateNames (const Machine& m) {
+  vguard<StateName> names;
+  names.reserve (m.nStates());
+  for (const auto& ms: m.state)
+    names.push_back (ms.name);
+  return names;
+}
+
+// tagStateNames lazily replaces each non-null name n of states [begin,end) with [tag,n]
+void tagStateNames (vguard<MachineState>& state, StateIndex begin, StateIndex end, const char* tag) {
+  bool allNull = true;
+  for (StateIndex s = begin; allNull && s < end; ++s)
+    allNull = state[s].name.is_null();
+  if (allNull)
+    return;
+  auto arena = make_shared<StateNameArena> (StateNameArena::Tagged);
+  arena->tag = tag;
+  arena->first.reserve (end - begin);
+  for (StateIndex s = begin; s < end; ++s)
+    arena->first.push_back (move (state[s].name));
+  for (StateIndex s = begin; s < end; ++s)
+    state[s].name = arena->first[s - begin].is_null() ? StateName() : StateName (arena, s - begin);
+}
+
 struct TransAccumulator {
   TransList* transList;  // if non-null, will accumulate transitions direct to this list, without collapsing
   map<StateIndex,map<InputSymbol,map<OutputSymbol,WeightExpr> > > t;
@@ -218,14 +244,15 @@ void Machine::writeJson (ostream& out, bool memoizeRepeatedExpressions, bool sho
 	WeightAlgebra::countRefs (t.weight, counts, params, dummyDefs, NULL);
     }
 
-    auto iter = WeightAlgebra::exprBegin();
-    for (ExprIndex n = 0; n < counts.size(); ++iter, ++n) {
-      const WeightExpr expr = &*iter;
-      if (counts[n] > 1
+    for (const auto& expr_count: counts) {
+      const WeightExpr expr = expr_count.first;
+      if (expr_count.second > 1
 	  && expr->type != Dbl && expr->type != Int && expr->type != Param && expr->type != Null
 	  && !WeightAlgebra::isOne (expr))
 	common.push_back (expr);
     }
+    // most recently created first
+    sort (common.begin(), common.end(), [] (const WeightExpr a, const WeightExpr b) { return a->index > b->index; });
 
     map<string,string> def2name;
     size_t n = 0;
@@ -261,10 +288,11 @@ void Machine::writeJson (ostream& out, bool memoizeRepeatedExpressions, bool sho
     set<string> seenStateID;
     for (StateIndex s = 0; s < nStates(); ++s) {
       const MachineState& ms = state[s];
-      json id = ms.name;
+      const json name = ms.name.toJson();
+      json id = name;
       int n = 1;
       while (seenStateID.count (id.dump()))
-	id = json::array ({{ ms.name, ++n }});
+	id = json::array ({{ name, ++n }});
       seenStateID.insert (id.dump());
       uniqueName.push_back (id);
     }
@@ -279,7 +307,7 @@ void Machine::writeJson (ostream& out, bool memoizeRepeatedExpressions, bool sho
     if (useStateIDs || !ms.name.is_null()) {
       if (!useStateIDs)
 	out << "," << endl << "   ";
-      out << "\"id\":" << (useStateIDs ? uniqueName[s] : ms.name);
+      out << "\"id\":" << (useStateIDs ? uniqueName[s] : ms.name.toJson());
     }
     if (ms.trans.size()) {
       out << "," << endl << "   \"trans\":[";
@@ -443,65 +471,70 @@ void Machine::readJson (const json& pj) {
     if (pj.count("cons"))
       cons.readJson (pj.at("cons"));
 
-    json jstate = pj.at("state");
+    const json& jstate = pj.at("state");
     Assert (jstate.is_array(), "state is not an array");
-    map<string,StateIndex> id2n;
-    set<string> dupIds;
-    for (const json& js : jstate) {
-      MachineState ms;
-      if (js.count("n")) {
-	const StateIndex n = js.at("n").get<StateIndex>();
-	Require ((StateIndex) state.size() == n, "StateIndex n=%ld out of sequence", n);
-      }
-      if (js.count("id")) {
-	const StateName id = js.at("id");
-	Assert (!id.is_number(), "id can't be a number");
-	const string idStr = id.dump();
-	if (id2n.count (idStr)) {
-	  dupIds.insert (idStr);
-	  Warn ("Duplicate state ID: %s", idStr.c_str());
-	} else
-	  id2n[idStr] = state.size();
-	ms.name = id;
-      }
-      state.push_back (ms);
+    MachineStateReader reader;
+    for (const json& js : jstate)
+      reader.readState (state, js);
+    reader.resolveDests (state);
+  }
+}
+
+void MachineStateReader::readState (vguard<MachineState>& state, const json& js) {
+  MachineState ms;
+  if (js.count("n")) {
+    const StateIndex n = js.at("n").get<StateIndex>();
+    Require ((StateIndex) state.size() == n, "StateIndex n=%ld out of sequence", n);
+  }
+  if (js.count("id")) {
+    const json& id = js.at("id");
+    Assert (!id.is_number(), "id can't be a number");
+    const string idStr = id.dump();
+    if (id2n.count (idStr)) {
+      dupIds.insert (idStr);
+      Warn ("Duplicate state ID: %s", idStr.c_str());
+    } else
+      id2n[idStr] = state.size();
+    ms.name = id;
+  }
+  if (js.count ("trans")) {
+    const json& jtrans = js.at("trans");
+    Assert (jtrans.is_array(), "trans is not an array");
+    for (const json& jt : jtrans) {
+      MachineTransition t;
+      const json& dest = jt.at("to");
+      if (dest.is_number())
+	t.dest = dest.get<StateIndex>();
+      if (jt.count("in"))
+	t.in = jt.at("in").get<string>();
+      if (jt.count("out"))
+	t.out = jt.at("out").get<string>();
+      t.weight = (jt.count("weight")
+		  ? WeightAlgebra::fromJson (jt.at("weight"))
+		  : (jt.count("expr")
+		     ? parseWeightExpr (jt.at("expr").get<string>())
+		     : WeightAlgebra::one()));
+      ms.trans.push_back (t);
+      namedDest.push_back (dest.is_number() ? string() : dest.dump());
     }
+  }
+  state.push_back (std::move (ms));
+}
 
-    vguard<MachineState>::iterator msiter = state.begin();
-    for (const json& js : jstate) {
-      MachineState& ms = *msiter++;
-      if (js.count ("trans")) {
-	const json& jtrans = js.at("trans");
-	Assert (jtrans.is_array(), "trans is not an array");
-	for (const json& jt : jtrans) {
-	  MachineTransition t;
-	  const json& dest = jt.at("to");
-	  if (dest.is_number())
-	    t.dest = dest.get<StateIndex>();
-	  else {
-	    const string dstr = dest.dump();
-	    Require (id2n.count(dstr), "No such state in \"to\": %s", dstr.c_str());
-	    Require (!dupIds.count(dstr), "Ambiguous destination state ID in \"to\": %s", dstr.c_str());
-	    t.dest = id2n.at (dstr);
-	  }
-	  if (jt.count("in"))
-	    t.in = jt.at("in").get<string>();
-	  if (jt.count("out"))
-	    t.out = jt.at("out").get<string>();
-	  t.weight = (jt.count("weight")
-		      ? WeightAlgebra::fromJson (jt.at("weight"))
-		      : (jt.count("expr")
-			 ? parseWeightExpr (jt.at("expr").get<string>())
-			 : WeightAlgebra::one()));
-	  ms.trans.push_back (t);
-	}
+void MachineStateReader::resolveDests (vguard<MachineState>& state) const {
+  auto dstrIter = namedDest.begin();
+  for (auto& ms: state)
+    for (auto& t: ms.trans) {
+      const string& dstr = *dstrIter++;
+      if (!dstr.empty()) {
+	Require (id2n.count(dstr), "No such state in \"to\": %s", dstr.c_str());
+	Require (!dupIds.count(dstr), "Ambiguous destination state ID in \"to\": %s", dstr.c_str());
+	t.dest = id2n.at (dstr);
       }
     }
-
-    for (const auto& ms: state)
-      for (const auto& t: ms.trans)
-	Assert (t.dest < state.size(), "State %ld does not exist", t.dest);
-  }
+  for (const auto& ms: state)
+    for (const auto& t: ms.trans)
+      Assert (t.dest < state.size(), "State %ld does not exist", t.dest);
 }
 
 void Machine::writeDot (ostream& out, const char* emptyLabelText, bool mergeEdges, bool abbreviateLabels) const {
@@ -519,7 +552,7 @@ void Machine::writeDot (ostream& out, const char* emptyLabelText, bool mergeEdge
 
   // state nodes
   for (StateIndex s = 0; s < nStates(); ++s) {
-    const auto& n = state[s].name;
+    const json n = state[s].name.toJson();
     const string shape = (s == endIdx) ? "doublecircle" : "circle";
     out << " " << s << " [shape=" << shape << ",label=\""
 	<< escaped_str (n.is_string() ? n.get<string>() : n.dump())
@@ -793,7 +826,10 @@ inline StateIndex compState2j (StateIndex comp, StateIndex jStates) {
 
 Machine Machine::compose (const Machine& first, const Machine& origSecond, bool assignStateNames, bool collapseDegenerateTransitions, SilentCycleStrategy cycleStrategy) {
   LogThisAt(3,"Composing " << first.nStates() << "-state transducer with " << origSecond.nStates() << "-state transducer" << endl);
-  const Machine second = origSecond.isWaitingMachine() ? origSecond : origSecond.waitingMachine();
+  Machine waitingSecond;
+  if (!origSecond.isWaitingMachine())
+    waitingSecond = origSecond.waitingMachine();
+  const Machine& second = origSecond.isWaitingMachine() ? origSecond : waitingSecond;
   Assert (second.isWaitingMachine(), "Attempt to compose transducers A*B where B is not a waiting machine");
 
   const StateIndex iStates = first.nStates(), jStates = second.nStates();
@@ -853,14 +889,12 @@ Machine Machine::compose (const Machine& first, const Machine& origSecond, bool
   comp.resize (keptState.size());
 
   if (assignStateNames) {
-    ProgressLog(plogName,6);
-    plogName.initProgress ("Constructing namespace (%lu states)", keptState.size());
+    auto names = make_shared<StateNameArena> (StateNameArena::Product);
+    names->first = stateNames (first);
+    names->second = stateNames (second);
     for (StateIndex k = 0; k < keptState.size(); ++k) {
       const StateIndex c = keptState[k];
-      const StateIndex i = compState2i(c,jStates), j = compState2j(c,jStates);
-      plogName.logProgress (k / (double) keptState.size(), "state %ld/%ld", k, keptState.size());
-      MachineState& ms = comp[k];
-      ms.name = StateName ({first.state[i].name, second.state[j].name});
+      comp[k].name = StateName (names, compState2i(c,jStates), compState2j(c,jStates));
     }
   }
 
@@ -903,13 +937,16 @@ Machine Machine::compose (const Machine& first, const Machine& origSecond, bool
   }
 
   LogThisAt(3,"Transducer composition yielded " << compMachine.nStates() << "-state machine" << endl);
-  return compMachine.ergodicMachine().advanceSort().processCycles(cycleStrategy).ergodicMachine();
+  return move(compMachine).ergodicMachine().advanceSort().processCycles(cycleStrategy).ergodicMachine();
 }
 
 Machine Machine::intersect (const Machine& first, const Machine& origSecond, SilentCycleStrategy cycleStrategy) {
   LogThisAt(3,"Intersecting " << first.nStates() << "-state transducer with " << origSecond.nStates() << "-state transducer" << endl);
   Assert (first.outputAlphabet().empty() && origSecond.outputAlphabet().empty(), "Attempt to intersect transducers A&B with nonempty output alphabets");
-  const Machine second = origSecond.isWaitingMachine() ? origSecond : origSecond.waitingMachine();
+  Machine waitingSecond;
+  if (!origSecond.isWaitingMachine())
+    waitingSecond = origSecond.waitingMachine();
+  const Machine& second = origSecond.isWaitingMachine() ? origSecond : waitingSecond;
   Assert (second.isWaitingMachine(), "Attempt to intersect transducers A&B where B is not a waiting machine");
 
   Machine interMachine;
@@ -923,12 +960,14 @@ Machine Machine::intersect (const Machine& first, const Machine& origSecond, Sil
 
   const bool assignStateNames = !first.stateNamesAreAllNull() && !second.stateNamesAreAllNull();
 
-  for (StateIndex i = 0; i < first.nStates(); ++i)
-    for (StateIndex j = 0; j < second.nStates(); ++j) {
-      MachineState& ms = inter[interState(i,j)];
-      if (assignStateNames)
-	ms.name = StateName ({first.state[i].name, second.state[j].name});
-    }
+  if (assignStateNames) {
+    auto names = make_shared<StateNameArena> (StateNameArena::Product);
+    names->first = stateNames (first);
+    names->second = stateNames (second);
+    for (StateIndex i = 0; i < first.nStates(); ++i)
+      for (StateIndex j = 0; j < second.nStates(); ++j)
+	inter[interState(i,j)].name = StateName (names, i, j);
+  }
 
   for (StateIndex i = 0; i < first.nStates(); ++i)
     for (StateIndex j = 0; j < second.nStates(); ++j) {
@@ -949,7 +988,7 @@ Machine Machine::intersect (const Machine& first, const Machine& origSecond, Sil
     }
 
   LogThisAt(3,"Transducer intersection yielded " << interMachine.nStates() << "-state machine" << endl);
-  return interMachine.ergodicMachine().advanceSort().processCycles(cycleStrategy).ergodicMachine();
+  return move(interMachine).ergodicMachine().advanceSort().processCycles(cycleStrategy).ergodicMachine();
 }
 
 set<StateIndex> Machine::accessibleStates() const {
@@ -993,61 +1032,70 @@ set<StateIndex> Machine::accessibleStates() const {
   return as;
 }
 
-Machine Machine::ergodicMachine() const {
-  Machine em;
+Machine Machine::ergodicMachine() const& {
+  return Machine(*this).ergodicMachine();
+}
+
+Machine Machine::ergodicMachine() && {
   if (isErgodicMachine()) {
-    em = *this;
     LogThisAt(5,"Machine is ergodic; no transformation necessary" << endl);
-  } else {
-    em.import (*this);
-    vguard<bool> keep (nStates(), false);
-    for (StateIndex s : accessibleStates())
-      keep[s] = true;
-
-    if (!keep[nStates()-1]) {
-      Warn ("End state is not accessible");
-      return zero();
-    }
-    
-    map<StateIndex,StateIndex> nullEquiv;
-    for (StateIndex s = 0; s < nStates(); ++s)
-      if (keep[s]) {
-	StateIndex d = s;
-	while (state[d].trans.size() == 1 && state[d].trans.front().isSilent() && WeightAlgebra::isOne(state[d].trans.front().weight))
-	  d = state[d].trans.front().dest;
-	if (d != s)
-	  nullEquiv[s] = d;
-      }
-    vguard<StateIndex> old2new (nStates());
-    StateIndex ns = 0;
-    for (StateIndex oldIdx = 0; oldIdx < nStates(); ++oldIdx)
-      if (keep[oldIdx] && !nullEquiv.count(oldIdx))
-	old2new[oldIdx] = ns++;
-    for (StateIndex oldIdx = 0; oldIdx < nStates(); ++oldIdx)
-      if (keep[oldIdx] && nullEquiv.count(oldIdx))
-	old2new[oldIdx] = old2new[nullEquiv.at(oldIdx)];
-
-    if (!ns) {
-      Warn ("Machine has no accessible states");
-      return zero();
-    }
+    return move(*this);
+  }
 
-    em.state.reserve (ns);
-    for (StateIndex oldIdx = 0; oldIdx < nStates(); ++oldIdx)
-      if (keep[oldIdx] && !nullEquiv.count(oldIdx)) {
-	em.state.push_back (MachineState());
-	em.state.back().name = state[oldIdx].name;
-	for (auto& t: state[oldIdx].trans)
-	  if (keep[t.dest])
-	    em.state.back().trans.push_back (MachineTransition (t.in, t.out, old2new.at(t.dest), t.weight));
-      }
+  const StateIndex nOldStates = nStates();
+  vguard<bool> keep (nOldStates, false);
+  for (StateIndex s : accessibleStates())
+    keep[s] = true;
 
-    Assert (em.isErgodicMachine(), "failed to create ergodic machine");
-    LogThisAt(5,"Trimmed " << nStates() << "-state transducer into " << em.nStates() << "-state ergodic machine" << endl);
-    LogThisAt(7,MachineLoader::toJsonString(em) << endl);
+  if (!keep[nOldStates-1]) {
+    Warn ("End state is not accessible");
+    return zero();
   }
 
-  return em;
+  map<StateIndex,StateIndex> nullEquiv;
+  for (StateIndex s = 0; s < nOldStates; ++s)
+    if (keep[s]) {
+      StateIndex d = s;
+      while (state[d].trans.size() == 1 && state[d].trans.front().isSilent() && WeightAlgebra::isOne(state[d].trans.front().weight))
+	d = state[d].trans.front().dest;
+      if (d != s)
+	nullEquiv[s] = d;
+    }
+  vguard<StateIndex> old2new (nOldStates);
+  StateIndex ns = 0;
+  for (StateIndex oldIdx = 0; oldIdx < nOldStates; ++oldIdx)
+    if (keep[oldIdx] && !nullEquiv.count(oldIdx))
+      old2new[oldIdx] = ns++;
+  for (StateIndex oldIdx = 0; oldIdx < nOldStates; ++oldIdx)
+    if (keep[oldIdx] && nullEquiv.count(oldIdx))
+      old2new[oldIdx] = old2new[nullEquiv.at(oldIdx)];
+
+  if (!ns) {
+    Warn ("Machine has no accessible states");
+    return zero();
+  }
+
+  // compact the state vector in place (new index never exceeds old index)
+  for (StateIndex oldIdx = 0; oldIdx < nOldStates; ++oldIdx)
+    if (keep[oldIdx] && !nullEquiv.count(oldIdx)) {
+      MachineState& ms = state[oldIdx];
+      for (auto iter = ms.trans.begin(); iter != ms.trans.end(); )
+	if (keep[iter->dest]) {
+	  iter->dest = old2new.at(iter->dest);
+	  ++iter;
+	} else
+	  iter = ms.trans.erase (iter);
+      const StateIndex newIdx = old2new[oldIdx];
+      if (newIdx != oldIdx)
+	state[newIdx] = move(ms);
+    }
+  state.resize (ns);
+
+  Assert (isErgodicMachine(), "failed to create ergodic machine");
+  LogThisAt(5,"Trimmed " << nOldStates << "-state transducer into " << nStates() << "-state ergodic machine" << endl);
+  LogThisAt(7,MachineLoader::toJsonString(*this) << endl);
+
+  return move(*this);
 }
 
 Machine Machine::waitingMachine (const char* waitTag, const char* continueTag) const {
@@ -1066,10 +1114,10 @@ Machine Machine::waitingMachine (const char* waitTag, const char* continueTag) c
       if (!ms.waits() && !ms.continues()) {
 	MachineState c, w;
 	if (continueTag)
-	  c.name[continueTag] = ms.name;
+	  c.name = json::object ({{ continueTag, ms.name.toJson() }});
 	else
 	  c.name = ms.name;
-	w.name[waitTag] = ms.name;
+	w.name = json::object ({{ waitTag, ms.name.toJson() }});
 	for (const auto& t: ms.trans)
 	  if (t.inputEmpty())
 	    c.trans.push_back(t);
@@ -1136,7 +1184,7 @@ void updateFwdTrans (const Machine& machine, FwdTransMap& fwdTrans, size_t& nEli
   }
 }
 
-Machine Machine::processCycles (SilentCycleStrategy cycleStrategy) const {
+Machine Machine::processCycles (SilentCycleStrategy cycleStrategy) const& {
   return (cycleStrategy == LeaveSilentCycles
 	  ? *this
 	  : (cycleStrategy == SumSilentCycles
@@ -1144,37 +1192,49 @@ Machine Machine::processCycles (SilentCycleStrategy cycleStrategy) const {
 	     : dropSilentBackTransitions()));
 }
 
-Machine Machine::dropSilentBackTransitions() const {
-  Machine am;
+Machine Machine::processCycles (SilentCycleStrategy cycleStrategy) && {
+  if (cycleStrategy == SumSilentCycles)
+    return move(*this).advancingMachine();
+  if (cycleStrategy == BreakSilentCycles)
+    return move(*this).dropSilentBackTransitions();
+  return move(*this);
+}
+
+Machine Machine::dropSilentBackTransitions() const& {
+  return Machine(*this).dropSilentBackTransitions();
+}
+
+Machine Machine::dropSilentBackTransitions() && {
   if (isAdvancingMachine()) {
-    am = *this;
     LogThisAt(5,"Machine is already an advancing machine; no transformation necessary" << endl);
-  } else {
-    am.import (*this);
-    if (nStates()) {
-      am.state.reserve (nStates());
-      for (StateIndex s = 0; s < nStates(); ++s) {
-	const MachineState& ms = state[s];
-	am.state.push_back (MachineState());
-	MachineState& ams = am.state.back();
-	ams.name = ms.name;
+    return move(*this);
+  }
+  const size_t nOldTransitions = nTransitions();
+  for (StateIndex s = 0; s < nStates(); ++s) {
+    MachineState& ms = state[s];
+    for (auto iter = ms.trans.begin(); iter != ms.trans.end(); )
+      if (iter->isSilent() && iter->dest <= s) {
+	LogThisAt(6,"Dropping silent transition from #" << s << " to #" << iter->dest << ": " << ms.name << "  -->  " << state[iter->dest].name << endl);
+	iter = ms.trans.erase (iter);
+      } else
+	++iter;
+  }
 
-	for (const auto& t: ms.trans)
-	  if (!(t.isSilent() && t.dest <= s))
-	    ams.trans.push_back (t);
-	  else
-	    LogThisAt(6,"Dropping silent transition from #" << s << " to #" << t.dest << ": " << ms.name << "  -->  " << state[t.dest].name << endl);
-      }
+  Assert (isAdvancingMachine(), "failed to create advancing machine");
+  LogThisAt(5,"Converted " << nOldTransitions << "-transition transducer into " << nTransitions() << "-transition advancing machine by dropping silent back-transitions" << endl);
+  LogThisAt(7,MachineLoader::toJsonString(*this) << endl);
+  return move(*this);
+}
 
-      Assert (am.isAdvancingMachine(), "failed to create advancing machine");
-      LogThisAt(5,"Converted " << nTransitions() << "-transition transducer into " << am.nTransitions() << "-transition advancing machine by dropping silent back-transitions" << endl);
-      LogThisAt(7,MachineLoader::toJsonString(am) << endl);
-    }
+Machine Machine::advancingMachine() && {
+  if (isAdvancingMachine()) {
+    LogThisAt(5,"Machine is already an advancing machine; no transformation necessary" << endl);
+    return move(*this);
   }
-  return am;
+  return static_cast<const Machine&>(*this).advancingMachine();
 }
 
-Machine Machine::advancingMachine() const {
+Machine Machine::advancingMachine() const& {
   Machine am;
   if (isAdvancingMachine()) {
     am = *this;
@@ -1229,24 +1289,56 @@ Machine Machine::advancingMachine() const {
   return am;
 }
 
-Machine Machine::decodeSort() const {
+Machine Machine::decodeSort() const& {
   return advanceSort (&Machine::nEmptyOutputBackTransitions, &MachineTransition::outputEmpty, "non-outputting");
 }
 
-Machine Machine::encodeSort() const {
+Machine Machine::decodeSort() && {
+  return move(*this).advanceSort (&Machine::nEmptyOutputBackTransitions, &MachineTransition::outputEmpty, "non-outputting");
+}
+
+Machine Machine::encodeSort() const& {
   return transpose().decodeSort().transpose();
 }
 
+Machine Machine::encodeSort() && {
+  return move(*this).transpose().decodeSort().transpose();
+}
+
 bool isMachineTransition (const MachineTransition*) { return true; }
-Machine Machine::toposort() const {
+Machine Machine::toposort() const& {
   return advanceSort (&Machine::nBackTransitions, &isMachineTransition, "general");
 }
 
+Machine Machine::toposort() && {
+  return move(*this).advanceSort (&Machine::nBackTransitions, &isMachineTransition, "general");
+}
+
 Machine Machine::advanceSort (function<size_t(const Machine*)> countBackTransitions,
 			      function<bool(const MachineTransition*)> mustAdvance,
-			      const char* sortType) const
+			      const char* sortType) const&
+{
+  return Machine(*this).advanceSort (countBackTransitions, mustAdvance, sortType);
+}
+
+void Machine::reorderStates (const vguard<StateIndex>& order) {
+  Assert (order.size() == nStates(), "State permutation has wrong size");
+  vguard<StateIndex> old2new (nStates());
+  for (StateIndex n = 0; n < nStates(); ++n)
+    old2new[order[n]] = n;
+  vguard<MachineState> newState (nStates());
+  for (StateIndex n = 0; n < nStates(); ++n) {
+    newState[n] = move(state[order[n]]);
+    for (auto& trans: newState[n].trans)
+      trans.dest = old2new[trans.dest];
+  }
+  state.swap (newState);
+}
+
+Machine Machine::advanceSort (function<size_t(const Machine*)> countBackTransitions,
+			      function<bool(const MachineTransition*)> mustAdvance,
+			      const char* sortType) &&
 {
-  Machine result;
   const size_t nSilentBackBefore = countBackTransitions (this);
   if (nSilentBackBefore) {
     vguard<vguard<StateIndex> > silentIncoming (nStates()), silentOutgoing (nStates());
@@ -1323,58 +1415,56 @@ Machine Machine::advanceSort (function<size_t(const Machine*)> countBackTransiti
       old2new[order[n]] = n;
     }
 
-    if (!orderChanged) {
-      result = *this;
+    if (!orderChanged)
       LogThisAt(5,"Sorting left machine unchanged with " << nSilentBackBefore << " backward " << sortType << " transitions" << endl);
-    } else {
-      result.import (*this);
-      result.state.reserve (nStates());
-      for (const auto s: order) {
-	result.state.push_back (state[s]);
-	for (auto& trans: result.state.back().trans)
-	  trans.dest = old2new[trans.dest];
-      }
-    }
+    else
+      reorderStates (order);
 
-    const size_t nSilentBackAfter = countBackTransitions (&result);
+    const size_t nSilentBackAfter = countBackTransitions (this);
     if (nSilentBackAfter >= nSilentBackBefore) {
       if (orderChanged) {
 	if (nSilentBackAfter > nSilentBackBefore)
 	  LogThisAt(5,"Sorting increased number of " << sortType << " transitions from " << nSilentBackBefore << " to " << nSilentBackAfter << "; restoring original order" << endl);
 	else
 	  LogThisAt(5,"Sorting left number of backward " << sortType << " transitions unchanged at " << nSilentBackBefore << "; restoring original order" << endl);
-	result = *this;
+	reorderStates (old2new);
+	orderChanged = false;
       }
     } else
       LogThisAt(5,"Sorting reduced number of backward " << sortType << " transitions from " << nSilentBackBefore << " to " << nSilentBackAfter << endl);
 
     if (nSilentBackAfter && !hasNullPaddingStates()) {
       LogThisAt(5,"Trying to sort again with \"dummy\" null start & end states..." << endl);
-      const Machine withDummy = padWithNullStates();
+      Machine withDummy;
+      if (orderChanged) {
+	// pad the machine in its original order
+	Machine original (*this);
+	original.reorderStates (old2new);
+	withDummy = original.padWithNullStates();
+      } else
+	withDummy = padWithNullStates();
       Assert (withDummy.hasNullPaddingStates(), "Dummy machine does not look like a dummy, triggering infinite dummification loop");
-      const Machine sortedWithDummy = withDummy.advanceSort (countBackTransitions, mustAdvance);
+      Machine sortedWithDummy = move(withDummy).advanceSort (countBackTransitions, mustAdvance);
       const size_t nSilentBackDummy = countBackTransitions (&sortedWithDummy);
       LogThisAt(5,"Padding with \"dummy\" null states " << (nSilentBackDummy < nSilentBackAfter ? (nSilentBackDummy ? "is better, though not perfect" : "worked!") : "failed") << endl);
       if (nSilentBackDummy < nSilentBackAfter)
-	result = sortedWithDummy;
+	*this = move(sortedWithDummy);
     }
-    LogThisAt(7,"Sorted machine:" << endl << MachineLoader::toJsonString(result) << endl);
-  } else {
+    LogThisAt(7,"Sorted machine:" << endl << MachineLoader::toJsonString(*this) << endl);
+  } else
     LogThisAt(5,"Machine has no backward " << sortType << " transitions; sort unnecessary" << endl);
-    result = *this;
-  }
   
   // show silent backward transitions
 #define SilentBackwardLogLevel 9
-  if (countBackTransitions (&result) > 0 && LoggingThisAt(SilentBackwardLogLevel)) {
+  if (countBackTransitions (this) > 0 && LoggingThisAt(SilentBackwardLogLevel)) {
     LogThisAt(SilentBackwardLogLevel,"Backward " << sortType << " transitions:" << endl);
     for (StateIndex s = 1; s < nStates(); ++s)
-      for (const auto& t: result.state[s].trans)
+      for (const auto& t: state[s].trans)
 	if (mustAdvance(&t) && t.dest <= s)
-	  LogThisAt(SilentBackwardLogLevel,"[" << s << "," << result.state[s].name << endl << "," << t.dest << "," << result.state[t.dest].name << "]" << endl);
+	  LogThisAt(SilentBackwardLogLevel,"[" << s << "," << state[s].name << endl << "," << t.dest << "," << state[t.dest].name << "]" << endl);
   }
 
-  return result;
+  return move(*this);
 }
 
 Machine Machine::padWithNullStates() const {
@@ -1489,7 +1579,7 @@ Machine Machine::mergeEquivalentStates() const {
 	if (redirect.count (t.dest))
 	  t.dest = redirect.at (t.dest);
     // Step 4: Remove unreachable states
-    current = current.ergodicMachine();
+    current = move(current).ergodicMachine();
     LogThisAt(4,"After merge pass: " << current.nStates() << " states (was " << nOldStates << ")" << endl);
     if (current.nStates() == nOldStates)
       break;
@@ -1505,6 +1595,290 @@ Machine Machine::mergeEquivalentStates() const {
   return current;
 }
 
+// WeightedDFA: a deterministic weighted automaton over (input,output) label pairs, with log-space weights.
+// This is the intermediate representation used by determinize() and minimize().
+#define DeterminizeLogWeightPrecision 1e-9  /* log-weights are rounded to this precision when comparing subsets & signatures */
+#define WeightPushTolerance 1e-12
+#define MaxWeightPushIterations 1000
+
+struct WeightedDFA {
+  typedef pair<InputSymbol,OutputSymbol> Label;
+  typedef pair<StateIndex,double> Arc;  // (dest, logWeight)
+  vguard<map<Label,Arc> > arc;
+  vguard<double> logFinal;
+  vguard<StateName> name;
+  bool build (const Machine& m, StateIndex maxStates);  // returns false if maxStates is exceeded
+  void pushWeights();
+  void minimize();
+  Machine machine() const;
+  static long long quantize (double logWeight);
+};
+
+long long WeightedDFA::quantize (double logWeight) {
+  return isinf(logWeight) ? numeric_limits<long long>::min() : llround (logWeight / DeterminizeLogWeightPrecision);
+}
+
+bool WeightedDFA::build (const Machine& m, StateIndex maxStates) {
+  const ParamDefs defs = m.getParamDefs().defs;
+  vguard<vguard<double> > logWeight (m.nStates());
+  for (StateIndex s = 0; s < m.nStates(); ++s)
+    for (const auto& t: m.state[s].trans) {
+      double w;
+      if (WeightAlgebra::isNumber (t.weight))
+	w = WeightAlgebra::asDouble (t.weight);
+      else {
+	Require (WeightAlgebra::params (t.weight, defs).empty(), "Machine has unbound parameters; evaluate the weights (e.g. using --evaluate) before determinizing");
+	w = WeightAlgebra::eval (t.weight, defs);
+      }
+      Require (w >= 0, "Can't determinize a machine with negative weights");
+      Assert (!t.isSilent() || s == m.startState(), "Silent transitions remain after elimination");
+      logWeight[s].push_back (log (w));
+    }
+
+  // Subsets are maps from states to residual log-weights
+  typedef map<StateIndex,double> Subset;
+  typedef vguard<pair<StateIndex,long long> > SubsetKey;
+  vguard<Subset> subset;
+  map<SubsetKey,StateIndex> subsetIndex;
+  const bool useNames = !m.stateNamesAreAllNull();
+  auto findSubset = [&] (const Subset& sub) -> StateIndex {
+    SubsetKey key;
+    key.reserve (sub.size());
+    for (const auto& s_lw: sub)
+      key.push_back (pair<StateIndex,long long> (s_lw.first, quantize (s_lw.second)));
+    const auto iter = subsetIndex.find (key);
+    if (iter != subsetIndex.end())
+      return iter->second;
+    const StateIndex idx = subset.size();
+    subsetIndex[key] = idx;
+    subset.push_back (sub);
+    arc.push_back (map<Label,Arc>());
+    logFinal.push_back (sub.count (m.endState()) ? sub.at (m.endState()) : -numeric_limits<double>::infinity());
+    json subsetName;
+    if (useNames)
+      for (const auto& s_lw: sub)
+	subsetName.push_back (m.state[s_lw.first].name.toJson());
+    name.push_back (StateName (move (subsetName)));
+    return idx;
+  };
+
+  // Initial subset is the start state, plus the destinations of any silent transitions from the start state
+  Subset init;
+  init[m.startState()] = 0;
+  {
+    auto lwIter = logWeight[m.startState()].begin();
+    for (const auto& t: m.state[m.startState()].trans)
+      if (t.isSilent())
+	log_accum_exp_slow (init.insert (Subset::value_type (t.dest, -numeric_limits<double>::infinity())).first->second, *lwIter++);
+      else
+	++lwIter;
+  }
+  findSubset (init);
+
+  ProgressLog(plog,6);
+  plog.initProgress ("Weighted subset construction");
+  for (StateIndex i = 0; i < subset.size(); ++i) {
+    plog.logProgress (i / (double) subset.size(), "state %llu/%llu", i, (StateIndex) subset.size());
+    if (subset.size() > maxStates)
+      return false;
+    map<Label,Subset> next;
+    for (const auto& s_lw: subset[i]) {
+      auto lwIter = logWeight[s_lw.first].begin();
+      for (const auto& t: m.state[s_lw.first].trans) {
+	const double lw = *lwIter++;
+	if (!t.isSilent() && !isinf (lw)) {
+	  Subset& dest = next[Label (t.in, t.out)];
+	  log_accum_exp_slow (dest.insert (Subset::value_type (t.dest, -numeric_limits<double>::infinity())).first->second, s_lw.second + lw);
+	}
+      }
+    }
+    for (auto& label_sub: next) {
+      Subset& sub = label_sub.second;
+      double total = -numeric_limits<double>::infinity();
+      for (const auto& s_lw: sub)
+	log_accum_exp_slow (total, s_lw.second);
+      for (auto& s_lw: sub)
+	s_lw.second -= total;
+      const StateIndex dest = findSubset (sub);
+      arc[i][label_sub.first] = Arc (dest, total);
+    }
+  }
+  return true;
+}
+
+void WeightedDFA::pushWeights() {
+  const StateIndex n = arc.size();
+  // Visit states in DFS postorder, so that (for acyclic automata) the iteration converges in one sweep
+  vguard<StateIndex> order;
+  order.reserve (n);
+  {
+    vguard<bool> seen (n, false);
+    typedef map<Label,Arc>::const_iterator ArcIter;
+    vguard<pair<StateIndex,ArcIter> > stack;
+    stack.push_back (pair<StateIndex,ArcIter> (0, arc[0].begin()));
+    seen[0] = true;
+    while (!stack.empty()) {
+      const StateIndex s = stack.back().first;
+      ArcIter& iter = stack.back().second;
+      if (iter == arc[s].end()) {
+	order.push_back (s);
+	stack.pop_back();
+      } else {
+	const StateIndex d = (iter++)->second.first;
+	if (!seen[d]) {
+	  seen[d] = true;
+	  stack.push_back (pair<StateIndex,ArcIter> (d, arc[d].begin()));
+	}
+      }
+    }
+  }
+
+  // potential[s] = log of summed weight of all paths from s to termination
+  vguard<double> potential (n, -numeric_limits<double>::infinity());
+  bool converged = false;
+  for (int iter = 0; iter < MaxWeightPushIterations && !converged; ++iter) {
+    converged = true;
+    for (StateIndex s: order) {
+      double p = logFinal[s];
+      for (const auto& label_arc: arc[s])
+	log_accum_exp_slow (p, label_arc.second.second + potential[label_arc.second.first]);
+      if (p != potential[s] && !(abs (p - potential[s]) < WeightPushTolerance))
+	converged = false;
+      potential[s] = p;
+    }
+  }
+  for (double p: potential)
+    if (isnan(p) || p == numeric_limits<double>::infinity())
+      converged = false;
+  if (!converged) {
+    Warn ("Weight pushing failed to converge; minimizing without pushing");
+    return;
+  }
+
+  // Leave the total weight on the start state's outgoing transitions, since there is no separate initial weight
+  for (StateIndex s = 0; s < n; ++s) {
+    if (isinf (potential[s])) {
+      arc[s].clear();
+      logFinal[s] = -numeric_limits<double>::infinity();
+      continue;
+    }
+    const double p = s == 0 ? 0. : potential[s];
+    for (auto iter = arc[s].begin(); iter != arc[s].end(); )
+      if (isinf (potential[iter->second.first]))
+	iter = arc[s].erase (iter);
+      else {
+	iter->second.second += potential[iter->second.first] - p;
+	++iter;
+      }
+    logFinal[s] -= p;
+  }
+}
+
+void WeightedDFA::minimize() {
+  // Moore-style partition refinement: states are split by final weight and by (label, weight, destination class) of outgoing arcs
+  const StateIndex n = arc.size();
+  typedef tuple<Label,StateIndex,long long> ArcSignature;
+  typedef tuple<StateIndex,long long,vguard<ArcSignature> > Signature;
+  vguard<StateIndex> cls (n, 0);
+  StateIndex nClasses = 0;
+  while (true) {
+    map<Signature,StateIndex> sigClass;
+    vguard<StateIndex> newCls (n);
+    for (StateIndex s = 0; s < n; ++s) {
+      vguard<ArcSignature> arcSig;
+      arcSig.reserve (arc[s].size());
+      for (const auto& label_arc: arc[s])
+	arcSig.push_back (ArcSignature (label_arc.first, cls[label_arc.second.first], quantize (label_arc.second.second)));
+      const StateIndex c = sigClass.size();
+      newCls[s] = sigClass.insert (pair<Signature,StateIndex> (Signature (cls[s], quantize (logFinal[s]), arcSig), c)).first->second;
+    }
+    cls.swap (newCls);
+    if (sigClass.size() == nClasses)
+      break;
+    nClasses = sigClass.size();
+  }
+  LogThisAt(4,"Partition refinement merged " << n << " states into " << nClasses << " classes" << endl);
+
+  vguard<StateIndex> rep (nClasses, n);
+  for (StateIndex s = 0; s < n; ++s)
+    if (rep[cls[s]] == n)
+      rep[cls[s]] = s;
+  vguard<map<Label,Arc> > newArc (nClasses);
+  vguard<double> newLogFinal (nClasses);
+  vguard<StateName> newName (nClasses);
+  for (StateIndex c = 0; c < nClasses; ++c) {
+    const StateIndex s = rep[c];
+    for (const auto& label_arc: arc[s])
+      newArc[c][label_arc.first] = Arc (cls[label_arc.second.first], label_arc.second.second);
+    newLogFinal[c] = logFinal[s];
+    newName[c] = name[s];
+  }
+  arc.swap (newArc);
+  logFinal.swap (newLogFinal);
+  name.swap (newName);
+}
+
+Machine WeightedDFA::machine() const {
+  const StateIndex n = arc.size();
+  vguard<StateIndex> finals;
+  for (StateIndex s = 0; s < n; ++s)
+    if (!isinf (logFinal[s]))
+      finals.push_back (s);
+  if (finals.empty())
+    return Machine::zero();
+  // If there is a single final state with unit final weight and no outgoing transitions, it becomes the end state;
+  // otherwise, a new end state is added, with silent transitions from the final states
+  const bool finalIsEnd = finals.size() == 1 && arc[finals[0]].empty() && quantize (logFinal[finals[0]]) == 0 && (finals[0] != 0 || n == 1);
+  vguard<StateIndex> newIndex (n);
+  StateIndex ns = 0;
+  for (StateIndex s = 0; s < n; ++s)
+    if (!finalIsEnd || s != finals[0])
+      newIndex[s] = ns++;
+  if (finalIsEnd)
+    newIndex[finals[0]] = ns;
+  const StateIndex end = ns++;
+
+  Machine m;
+  m.state.resize (ns);
+  for (StateIndex s = 0; s < n; ++s) {
+    MachineState& ms = m.state[newIndex[s]];
+    ms.name = name[s];
+    for (const auto& label_arc: arc[s])
+      ms.trans.push_back (MachineTransition (label_arc.first.first, label_arc.first.second, newIndex[label_arc.second.first], exp (label_arc.second.second)));
+    if (!isinf (logFinal[s]) && newIndex[s] != end)
+      ms.trans.push_back (MachineTransition (InputSymbol(), OutputSymbol(), end, exp (logFinal[s])));
+  }
+  return move(m).ergodicMachine();
+}
+
+Machine Machine::determinize (StateIndex maxStates) const {
+  const Machine em = eliminateSilentTransitions();
+  LogThisAt(3,"Determinizing " << em.nStates() << "-state transducer" << endl);
+  WeightedDFA dfa;
+  if (!dfa.build (em, maxStates)) {
+    Warn ("Determinization exceeded %llu states; machine left undeterminized", maxStates);
+    return *this;
+  }
+  const Machine dm = dfa.machine();
+  LogThisAt(3,"Determinization of " << nStates() << "-state, " << nTransitions() << "-transition machine yielded " << dm.nStates() << "-state, " << dm.nTransitions() << "-transition machine" << endl);
+  return dm;
+}
+
+Machine Machine::minimize (StateIndex maxStates) const {
+  const Machine em = eliminateSilentTransitions();
+  LogThisAt(3,"Minimizing " << em.nStates() << "-state transducer" << endl);
+  WeightedDFA dfa;
+  if (!dfa.build (em, maxStates)) {
+    Warn ("Determinization exceeded %llu states; machine left unminimized", maxStates);
+    return *this;
+  }
+  dfa.pushWeights();
+  dfa.minimize();
+  const Machine mm = dfa.machine();
+  LogThisAt(3,"Minimization of " << nStates() << "-state, " << nTransitions() << "-transition machine yielded " << mm.nStates() << "-state, " << mm.nTransitions() << "-transition machine" << endl);
+  return mm;
+}
+
 Machine Machine::eliminateSingleSilentIncomingStates() const {
   const Machine rm = isAdvancingMachine() ? *this : advanceSort();
   LogThisAt(4,"Eliminating states with single silent incoming transition from " << rm.nStates() << "-state transducer" << endl);
@@ -1659,7 +2033,7 @@ Machine Machine::eliminateSilentTransitions (SilentCycleStrategy cycleStrategy)
     }
     em.state[0].trans.insert (em.state[0].trans.end(), silentTrans[0].begin(), silentTrans[0].end());
   }
-  const Machine elimMachine = em.ergodicMachine();
+  const Machine elimMachine = move(em).ergodicMachine();
   LogThisAt(3,"Elimination of silent transitions from " << nStates() << "-state, " << nTransitions() << "-transition machine yielded " << elimMachine.nStates() << "-state, " << elimMachine.nTransitions() << "-transition machine" << endl);
   return elimMachine;
 }
@@ -1746,21 +2120,23 @@ Machine Machine::wildSingleEcho (const vguard<InputSymbol>& symbols) {
 }
 
 Machine Machine::concatenate (const Machine& left, const Machine& right, const char* leftTag, const char* rightTag) {
+  return concatenate (Machine (left), Machine (right), leftTag, rightTag);
+}
+
+Machine Machine::concatenate (Machine&& left, Machine&& right, const char* leftTag, const char* rightTag) {
   Assert (left.nStates() && right.nStates(), "Attempt to concatenate transducer with uninitialized transducer");
-  Machine m (left);
-  m.import (left, right);
-  for (auto& ms: m.state)
-    if (!ms.name.is_null())
-      ms.name = json::array ({leftTag, ms.name});
-  m.state.insert (m.state.end(), right.state.begin(), right.state.end());
-  for (StateIndex s = left.state.size(); s < m.nStates(); ++s) {
-    MachineState& ms = m.state[s];
-    if (!ms.name.is_null())
-      ms.name = json::array ({rightTag, m.state[s].name});
-    for (auto& t: ms.trans)
-      t.dest += left.state.size();
-  }
-  m.state[left.endState()].trans.push_back (MachineTransition (string(), string(), right.startState() + left.state.size(), WeightAlgebra::one()));
+  const StateIndex leftStates = left.nStates(), leftEnd = left.endState(), rightStart = right.startState() + leftStates;
+  Machine m (move (left));
+  m.import (right);
+  m.state.reserve (leftStates + right.nStates());
+  for (auto& ms: right.state)
+    m.state.push_back (move (ms));
+  tagStateNames (m.state, 0, leftStates, leftTag);
+  tagStateNames (m.state, leftStates, m.nStates(), rightTag);
+  for (StateIndex s = leftStates; s < m.nStates(); ++s)
+    for (auto& t: m.state[s].trans)
+      t.dest += leftStates;
+  m.state[leftEnd].trans.push_back (MachineTransition (string(), string(), rightStart, WeightAlgebra::one()));
   return m;
 }
 
@@ -1781,20 +2157,14 @@ Machine Machine::takeUnion (const Machine& first, const Machine& second, const W
   m.state.insert (m.state.end(), first.state.begin(), first.state.end());
   m.state.insert (m.state.end(), second.state.begin(), second.state.end());
   m.state.push_back (MachineState());
-  for (StateIndex s = 0; s < first.nStates(); ++s) {
-    MachineState& ms = m.state[s+1];
-    if (!ms.name.is_null())
-      ms.name = json::array ({"union-1", ms.name});
-    for (auto& t: ms.trans)
+  tagStateNames (m.state, 1, 1 + first.nStates(), "union-1");
+  tagStateNames (m.state, 1 + first.nStates(), 1 + first.nStates() + second.nStates(), "union-2");
+  for (StateIndex s = 0; s < first.nStates(); ++s)
+    for (auto& t: m.state[s+1].trans)
       ++t.dest;
-  }
-  for (StateIndex s = 0; s < second.nStates(); ++s) {
-    MachineState& ms = m.state[s+1+first.nStates()];
-    if (!ms.name.is_null())
-      ms.name = json::array ({"union-2", ms.name});
-    for (auto& t: ms.trans)
+  for (StateIndex s = 0; s < second.nStates(); ++s)
+    for (auto& t: m.state[s+1+first.nStates()].trans)
       t.dest += 1 + first.nStates();
-  }
   m.state[0].trans.push_back (MachineTransition (string(), string(), 1, pFirst));
   m.state[0].trans.push_back (MachineTransition (string(), string(), 1 + first.nStates(), pSecond));
   m.state[1 + first.endState()].trans.push_back (MachineTransition (string(), string(), m.endState(), WeightAlgebra::one()));
@@ -1806,9 +2176,7 @@ Machine Machine::zeroOrOne (const Machine& q) {
   Assert (q.nStates(), "Attempt to quantify uninitialized transducer");
   Machine m (q);
   if (!m.state.back().terminates()) {
-    for (auto& ms: m.state)
-      if (!ms.name.is_null())
-	ms.name = json::array ({"quant-main", ms.name});
+    tagStateNames (m.state, 0, m.nStates(), "quant-main");
     m.state.back().trans.push_back (MachineTransition (string(), string(), m.endState() + 1, WeightAlgebra::one()));
     m.state.push_back (MachineState());
     if (!q.stateNamesAreAllNull())
@@ -1842,17 +2210,14 @@ Machine Machine::kleeneLoop (const Machine& main, const Machine& loop) {
   const bool assignStateNames = !main.stateNamesAreAllNull() && !loop.stateNamesAreAllNull();
   Machine m (main);
   m.state.reserve (main.nStates() + loop.nStates() + 1);
-  for (auto& ms: m.state)
-    if (assignStateNames && !ms.name.is_null())
-      ms.name = json::array ({"loop-main", ms.name});
   m.state.insert (m.state.end(), loop.state.begin(), loop.state.end());
-  for (StateIndex s = main.nStates(); s < m.nStates(); ++s) {
-    MachineState& ms = m.state[s];
-    if (assignStateNames && !ms.name.is_null())
-      ms.name = json::array ({"loop-continue", m.state[s].name});
-    for (auto& t: ms.trans)
-      t.dest += main.nStates();
+  if (assignStateNames) {
+    tagStateNames (m.state, 0, main.nStates(), "loop-main");
+    tagStateNames (m.state, main.nStates(), m.nStates(), "loop-continue");
   }
+  for (StateIndex s = main.nStates(); s < m.nStates(); ++s)
+    for (auto& t: m.state[s].trans)
+      t.dest += main.nStates();
   m.state.push_back (MachineState());
   if (assignStateNames)
     m.state.back().name = json::array ({"loop-end"});
@@ -1875,7 +2240,22 @@ Machine Machine::repeat (const Machine& m, int copies) {
   return result;
 }
 
-Machine Machine::reverse() const {
+Machine Machine::reverse() && {
+  Machine m;
+  m.funcs = move (funcs);
+  m.cons = move (cons);
+  m.state.resize (nStates());
+  for (StateIndex s = 0; s < nStates(); ++s) {
+    const StateIndex r = nStates() - 1 - s;
+    MachineState& ms = state[s];
+    m.state[r].name = move (ms.name);
+    for (auto& t: ms.trans)
+      m.state[nStates() - 1 - t.dest].trans.push_back (MachineTransition (move (t.in), move (t.out), r, t.weight));
+  }
+  return m;
+}
+
+Machine Machine::reverse() const& {
   Machine m;
   m.import (*this);
   m.state.resize (nStates());
@@ -1889,12 +2269,15 @@ Machine Machine::reverse() const {
   return m;
 }
 
-Machine Machine::transpose() const {
-  Machine m (*this);
-  for (auto& ms: m.state)
+Machine Machine::transpose() const& {
+  return Machine(*this).transpose();
+}
+
+Machine Machine::transpose() && {
+  for (auto& ms: state)
     for (auto& t: ms.trans)
       swap (t.in, t.out);
-  return m;
+  return move(*this);
 }
 
 Machine Machine::null() {
@@ -2140,13 +2523,16 @@ Machine Machine::subgraph (const vguard<vguard<bool> >& transAllowed) const {
 	rs.trans.push_back (*iter);
   }
   LogThisAt(5,"Subgraph of " << nTransitions() << "-transition machine has " << result.nTransitions() << " transitions" << endl);
-  return result.ergodicMachine().eliminateRedundantStates();
+  return move(result).ergodicMachine().eliminateRedundantStates();
 }
 
-Machine Machine::stripNames() const {
-  Machine m (*this);
-  for (auto& ms: m.state)
-    ms.name = nullptr;
-  return m;
+Machine Machine::stripNames() const& {
+  return Machine(*this).stripNames();
+}
+
+Machine Machine::stripNames() && {
+  for (auto& ms: state)
+    ms.name = StateName();
+  return move(*this);
 }
 
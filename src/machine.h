@@ -12,6 +12,7 @@
 #include "vguard.h"
 #include "params.h"
 #include "constraints.h"
+#include "statename.h"
 
 namespace MachineBoss {
 
@@ -28,9 +29,10 @@ typedef unsigned long long StateIndex;
 #define MachineStartTag      "start"
 #define MachineEndTag        "end"
 
+#define DefaultMaxDeterminizedStates 100000
+
 typedef string OutputSymbol;
 typedef string InputSymbol;
-typedef json StateName;
 
 struct MachineTransition {
   InputSymbol in;
@@ -64,6 +66,18 @@ struct MachineState {
   bool isLoud() const;  // exitsWithIO() && !exitsWithoutIO()      ["emit" state]
 };
 
+// MachineStateReader parses the elements of a machine's JSON "state" array, one at a time.
+// A "to" given as a state ID may refer to a later state, so IDs are resolved once all the states have been read.
+// Used by Machine::readJson, and by MachineStreamLoader (which reads states as they are parsed).
+struct MachineStateReader {
+  map<string,StateIndex> id2n;
+  set<string> dupIds;
+  list<string> namedDest;  // "to" of every transition read so far, in order (empty if numeric)
+
+  void readState (vguard<MachineState>& state, const json& js);  // appends a state
+  void resolveDests (vguard<MachineState>& state) const;  // call after the last readState
+};
+
 struct Machine {
   typedef enum SilentCycleStrategy { LeaveSilentCycles = 0, BreakSilentCycles = 1, SumSilentCycles = 2 } SilentCycleStrategy;
 
@@ -100,6 +114,8 @@ struct Machine {
   // For example:
   //   wildGenerator.X.wildGenerator  where "." represents concatenation
   // always yields a single left-flanking state, then X's states, then a single right-flanking state
+  // Methods with both const& and && overloads modify rvalues in place, so chained calls
+  // such as compose(a,b).ergodicMachine().advanceSort() avoid deep-copying the state vector.
   static Machine null();  // single state, no transitions: weight is one for empty string, zero for all other strings
   static Machine zero();  // two states, no transitions: weight is zero for all strings
   static Machine singleTransition (const WeightExpr& weight);
@@ -107,6 +123,7 @@ struct Machine {
   static Machine compose (const Machine& first, const Machine& second, bool assignCompositeStateNames = true, bool collapseDegenerateTransitions = true, SilentCycleStrategy cycleStrategy = SumSilentCycles);
   static Machine intersect (const Machine& first, const Machine& second, SilentCycleStrategy cycleStrategy = SumSilentCycles);
   static Machine concatenate (const Machine& left, const Machine& right, const char* leftTag = MachineCatLeftTag, const char* rightTag = MachineCatRightTag);  // guaranteed: left's states followed by right's states
+  static Machine concatenate (Machine&& left, Machine&& right, const char* leftTag = MachineCatLeftTag, const char* rightTag = MachineCatRightTag);
 
   static Machine generator (const vguard<OutputSymbol>& seq, const string& name = string(MachineDefaultSeqTag));
   static Machine recognizer (const vguard<InputSymbol>& seq, const string& name = string(MachineDefaultSeqTag));
@@ -132,8 +149,10 @@ struct Machine {
 
   static Machine repeat (const Machine&, int copies);
   
-  Machine reverse() const;
-  Machine transpose() const;
+  Machine reverse() const&;
+  Machine reverse() &&;
+  Machine transpose() const&;
+  Machine transpose() &&;
 
   bool inputEmpty() const;  // true iff machine is a generator
   bool outputEmpty() const;  // true iff machine is a recognizer
@@ -165,25 +184,35 @@ struct Machine {
   Machine normalizeJointly() const;  // for each state, sum_{outgoing transitions} p(trans) = 1
   Machine normalizeConditionally() const;  // for each state & each input token, sum_{outgoing transitions} p(trans) = 1
 
-  Machine ergodicMachine() const;  // remove unreachable states
+  Machine ergodicMachine() const&;  // remove unreachable states
+  Machine ergodicMachine() &&;
   Machine waitingMachine (const char* waitTag = MachineWaitTag, const char* continueTag = MachineContinueTag) const;  // convert to waiting machine
 
   size_t nBackTransitions() const;
   size_t nSilentBackTransitions() const;
   size_t nEmptyOutputBackTransitions() const;
-  Machine decodeSort() const;  // does advanceSort() on non-outputting transitions
-  Machine encodeSort() const;  // same as transpose().decodeSort().transpose()
-  Machine toposort() const;  // does advanceSort() on all transitions
-  Machine advancingMachine() const;  // convert to advancing machine by eliminating silent back-transitions
+  Machine decodeSort() const&;  // does advanceSort() on non-outputting transitions
+  Machine decodeSort() &&;
+  Machine encodeSort() const&;  // same as transpose().decodeSort().transpose()
+  Machine encodeSort() &&;
+  Machine toposort() const&;  // does advanceSort() on all transitions
+  Machine toposort() &&;
+  Machine advancingMachine() const&;  // convert to advancing machine by eliminating silent back-transitions
+  Machine advancingMachine() &&;
 
   // advanceSort tries to minimize number of "silent" i->j transitions where j<i
   // Different applications can override definition of "silent", e.g. for decoding s/silent/non-outputting/
   Machine advanceSort (function<size_t(const Machine*)> countBackTransitions = &Machine::nSilentBackTransitions,
 		       function<bool(const MachineTransition*)> mustAdvance = &MachineTransition::isSilent,
-		       const char* mustAdvanceDescription = "silent") const;
+		       const char* mustAdvanceDescription = "silent") const&;
+  Machine advanceSort (function<size_t(const Machine*)> countBackTransitions = &Machine::nSilentBackTransitions,
+		       function<bool(const MachineTransition*)> mustAdvance = &MachineTransition::isSilent,
+		       const char* mustAdvanceDescription = "silent") &&;
 
-  Machine processCycles (SilentCycleStrategy cycleStrategy = SumSilentCycles) const;  // returns either advancingMachine(), dropSilentBackTransitions(), or clone of self, depending on strategy
-  Machine dropSilentBackTransitions() const;
+  Machine processCycles (SilentCycleStrategy cycleStrategy = SumSilentCycles) const&;  // returns either advancingMachine(), dropSilentBackTransitions(), or clone of self, depending on strategy
+  Machine processCycles (SilentCycleStrategy cycleStrategy = SumSilentCycles) &&;
+  Machine dropSilentBackTransitions() const&;
+  Machine dropSilentBackTransitions() &&;
   Machine eliminateSilentTransitions (SilentCycleStrategy cycleStrategy = SumSilentCycles) const;  // eliminates silent transitions, first processing cycles using the selected strategy
 
   Machine eliminateSingleSilentIncomingStates() const;  // eliminates states which have only one incoming silent transition
@@ -191,11 +220,21 @@ struct Machine {
   Machine eliminateRedundantStates() const;  // eliminates states which have only one incoming and/or outgoing silent transition
   Machine mergeEquivalentStates() const;  // merge states with identical outgoing transitions
 
+  // Weighted determinization & minimization, for machines with numeric weights (e.g. after evaluation).
+  // Silent transitions are eliminated first, then a weighted subset construction is performed in the log semiring,
+  // treating each (input,output) label pair as a single symbol.
+  // If the subset construction exceeds maxStates states, a warning is issued and the machine is returned unchanged.
+  Machine determinize (StateIndex maxStates = DefaultMaxDeterminizedStates) const;
+  Machine minimize (StateIndex maxStates = DefaultMaxDeterminizedStates) const;  // determinize, push weights toward start, merge equivalent states
+
   Machine subgraph (const vguard<vguard<bool> >&) const;
   Machine downsample (double maxProportionOfTransitionsToKeep, double minPostProbOfSelectedTransitions = 0.) const;
   Machine stochasticDownsample (mt19937& rng, double maxProportionOfTransitionsToKeep, int maxNumberOfPathsToSample) const;
 
-  Machine stripNames() const;  // some algorithms take a while to construct the namespace... this helps
+  Machine stripNames() const&;  // some algorithms take a while to construct the namespace... this helps
+  Machine stripNames() &&;
+
+  void reorderStates (const vguard<StateIndex>& order);  // in-place permutation: new state #n is old state #order[n]
   
   // helpers to import defs & constraints from other machine(s)
   void import (const Machine& m, bool overwrite = false);
@@ -0,0 +1,41 @@
+#include "npy.h"
+#include "util.h"
+
+using namespace MachineBoss;
+
+static bool isLittleEndian() {
+  const uint16_t one = 1;
+  return *(const char*) &one;
+}
+
+string NpyWriter::header (const char* type, const vguard<size_t>& shape) {
+  string dict = string ("{'descr': '") + (isLittleEndian() ? "<" : ">") + type + "', 'fortran_order': False, 'shape': (";
+  for (size_t n = 0; n < shape.size(); ++n)
+    dict += (n ? ", " : "") + to_string (shape[n]);
+  dict += shape.size() == 1 ? ",), }" : "), }";
+  // pad with spaces, and terminate with a newline, so that the data are aligned
+  const size_t preambleSize = NpyMagicLength + 4;
+  const size_t paddedSize = (preambleSize + dict.size() + 1 + NpyHeaderAlignment - 1) / NpyHeaderAlignment * NpyHeaderAlignment;
+  dict.append (paddedSize - preambleSize - dict.size() - 1, ' ');
+  dict += '\n';
+  Assert (dict.size() <= 0xffff, "NumPy header too long");
+  string h (NpyMagic, NpyMagicLength);
+  h += (char) 1;  // major version
+  h += (char) 0;  // minor version
+  h += (char) (dict.size() & 0xff);
+  h += (char) (dict.size() >> 8);
+  return h + dict;
+}
+
+void NpyWriter::writeHeader (ostream& out, const char* type, const vguard<size_t>& shape) {
+  const string h = header (type, shape);
+  out.write (h.data(), h.size());
+}
+
+void NpyWriter::writeData (ostream& out, const vguard<double>& data) {
+  out.write ((const char*) data.data(), data.size() * sizeof(double));
+}
+
+void NpyWriter::writeData (ostream& out, const vguard<int64_t>& data) {
+  out.write ((const char*) data.data(), data.size() * sizeof(int64_t));
+}
@@ -0,0 +1,28 @@
+#ifndef NPY_INCLUDED
+#define NPY_INCLUDED
+
+#include <cstdint>
+#include <iostream>
+#include "vguard.h"
+
+#define NpyMagic "\x93NUMPY"
+#define NpyMagicLength 6
+#define NpyHeaderAlignment 64
+
+namespace MachineBoss {
+
+using namespace std;
+
+// NpyWriter writes arrays in NumPy's .npy format (version 1.0), in native byte order.
+// The header is written first, then the data in row-major order (e.g. a row at a time), so arrays can be streamed.
+// Several arrays can be written to the same file, one after another; numpy.load reads them back in turn from an open file.
+struct NpyWriter {
+  static void writeHeader (ostream& out, const char* type, const vguard<size_t>& shape);  // type is a NumPy type code without byte order, e.g. "f8" or "i8"
+  static void writeData (ostream& out, const vguard<double>& data);
+  static void writeData (ostream& out, const vguard<int64_t>& data);
+  static string header (const char* type, const vguard<size_t>& shape);
+};
+
+}  // end namespace
+
+#endif /* NPY_INCLUDED */
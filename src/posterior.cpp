@@ -0,0 +1,84 @@
+#include "posterior.h"
+#include "logger.h"
+
+using namespace MachineBoss;
+
+PosteriorWriter::PosteriorWriter (const EvaluatedMachine& machine, bool sparse) :
+  machine (machine),
+  sparse (sparse)
+{ }
+
+void PosteriorWriter::setGroups (const json& j) {
+  Require (j.is_array(), "State groups must be a JSON array of arrays of state ids");
+  map<string,StateIndex> stateIndex;
+  for (StateIndex s = 0; s < machine.nStates(); ++s)
+    stateIndex[machine.state[s].name.dump()] = s;
+  groups.clear();
+  for (const auto& jg: j) {
+    Require (jg.is_array(), "State groups must be a JSON array of arrays of state ids");
+    groups.push_back (vguard<StateIndex>());
+    for (const auto& js: jg) {
+      const auto iter = stateIndex.find (js.dump());
+      if (iter != stateIndex.end())
+	groups.back().push_back (iter->second);
+      else if (js.is_number_unsigned() && js.get<StateIndex>() < machine.nStates())
+	groups.back().push_back (js.get<StateIndex>());
+      else
+	Fail ("State %s not found", js.dump().c_str());
+    }
+  }
+}
+
+size_t PosteriorWriter::nGroups() const {
+  return groups.empty() ? machine.nStates() : groups.size();
+}
+
+void PosteriorWriter::write (ostream& out, const SeqPair& seqPair) const {
+  write (out, seqPair, Envelope (seqPair));
+}
+
+void PosteriorWriter::write (ostream& out, const SeqPair& seqPair, const Envelope& env) const {
+  const size_t nOut = env.outLen + 1, nIn = env.inLen + 1, nG = nGroups();
+  if (sparse) {
+    NpyWriter::writeHeader (out, "i8", vguard<size_t> ({ nOut, 2 }));
+    vguard<int64_t> bounds;
+    bounds.reserve (2 * nOut);
+    for (size_t outPos = 0; outPos < nOut; ++outPos) {
+      bounds.push_back (env.inStart[outPos]);
+      bounds.push_back (env.inEnd[outPos]);
+    }
+    NpyWriter::writeData (out, bounds);
+    NpyWriter::writeHeader (out, "f8", vguard<size_t> ({ (size_t) env.offsets().back(), nG }));
+  } else
+    NpyWriter::writeHeader (out, "f8", vguard<size_t> ({ nOut, nIn, nG }));
+
+  vguard<double> outRow;
+  auto writeRow = [&] (Envelope::OutputIndex, Envelope::InputIndex inStart, Envelope::InputIndex inEnd, const vguard<double>& postProb) {
+    const size_t nStates = machine.nStates();
+    const size_t rowStart = sparse ? 0 : inStart, rowLen = sparse ? inEnd - inStart : nIn;
+    outRow.assign (rowLen * nG, 0.);
+    for (Envelope::InputIndex inPos = inStart; inPos < inEnd; ++inPos) {
+      const double* cellPost = postProb.data() + (inPos - inStart) * nStates;
+      double* cellOut = outRow.data() + (inPos - inStart + rowStart) * nG;
+      if (groups.empty())
+	copy (cellPost, cellPost + nStates, cellOut);
+      else
+	for (size_t g = 0; g < nG; ++g)
+	  for (StateIndex s: groups[g])
+	    cellOut[g] += cellPost[s];
+    }
+    NpyWriter::writeData (out, outRow);
+  };
+
+  if (machine.canTokenize (seqPair)) {
+    const ForwardMatrix forward (machine, seqPair, env);
+    const BackwardMatrix backward (machine, seqPair, env);
+    backward.getPostProbs (forward, writeRow);
+  } else {
+    vguard<double> zeros;
+    for (Envelope::OutputIndex outPos = 0; outPos <= env.outLen; ++outPos) {
+      zeros.assign ((env.inEnd[outPos] - env.inStart[outPos]) * machine.nStates(), 0.);
+      writeRow (outPos, env.inStart[outPos], env.inEnd[outPos], zeros);
+    }
+  }
+}
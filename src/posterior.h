@@ -0,0 +1,34 @@
+#ifndef POSTERIOR_INCLUDED
+#define POSTERIOR_INCLUDED
+
+#include "backward.h"
+#include "npy.h"
+
+namespace MachineBoss {
+
+using namespace std;
+
+// PosteriorWriter exports posterior state probabilities (Forward x Backward / likelihood) for each sequence pair, as .npy arrays.
+// Each DP cell has one value per state, or per state group (the sum over the group's states, if groups are set).
+// Dense output is a float64 array of shape (outLen+1, inLen+1, nGroups), with zeros outside the envelope.
+// Sparse output is an int64 array of shape (outLen+1, 2), giving the envelope's [inStart,inEnd) for each output position,
+// followed by a float64 array of shape (nCells, nGroups) for the cells inside the envelope, in row-major order.
+// The arrays for successive sequence pairs follow one another in the same stream.
+// Rows are written as they are computed, so the matrix of posteriors is never held in memory (the Forward & Backward matrices are).
+class PosteriorWriter {
+public:
+  const EvaluatedMachine& machine;
+  vguard<vguard<StateIndex> > groups;  // empty = one group per state
+  bool sparse;
+
+  PosteriorWriter (const EvaluatedMachine&, bool sparse = false);
+  void setGroups (const json&);  // JSON array of groups, each an array of state ids (or, failing that, state indices)
+  size_t nGroups() const;
+
+  void write (ostream&, const SeqPair&, const Envelope&) const;
+  void write (ostream&, const SeqPair&) const;  // default envelope: the full matrix, or the alignment path if there is one
+};
+
+}  // end namespace
+
+#endif /* POSTERIOR_INCLUDED */
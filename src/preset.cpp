@@ -1,15 +1,19 @@
 #include "preset.h"
+#include "jsonstream.h"
 #include "util.h"
 
 using namespace MachineBoss;
 
-struct PresetCache {
-  map<string,string> namedPreset;
-  vguard<string> names;
-  PresetCache();
+// Presets are compiled in as xxd byte arrays, and nothing is copied or parsed at startup.
+// A preset is parsed directly from its embedded bytes when it is requested.
+// Schema validation is skipped for presets, as they are validated by the preset tests.
+struct PresetEntry {
+  const char* name;
+  const unsigned char* text;
+  const unsigned int* len;
 };
 
-#define addPreset(NAME) namedPreset[#NAME] = string (preset_##NAME##_json, preset_##NAME##_json + preset_##NAME##_json_len); names.push_back (#NAME);
+#define addPreset(NAME) { #NAME, preset_##NAME##_json, &preset_##NAME##_json_len }
 
 #include "preset/null.h"
 
@@ -44,54 +48,62 @@ struct PresetCache {
 #include "preset/hamming31.h"
 #include "preset/hamming74.h"
 
-PresetCache::PresetCache() {
-  addPreset(null);
+static const PresetEntry presets[] = {
+  addPreset(null),
 
-  addPreset(compdna);
-  addPreset(comprna);
+  addPreset(compdna),
+  addPreset(comprna),
 
-  addPreset(dnapsw);
-  addPreset(protpsw);
+  addPreset(dnapsw),
+  addPreset(protpsw),
 
-  addPreset(translate);
-  addPreset(prot2dna);
-  addPreset(psw2dna);
+  addPreset(translate),
+  addPreset(prot2dna),
+  addPreset(psw2dna),
 
-  addPreset(iupacdna);
-  addPreset(iupacaa);
+  addPreset(iupacdna),
+  addPreset(iupacaa),
 
-  addPreset(dna2rna);
-  addPreset(rna2dna);
+  addPreset(dna2rna),
+  addPreset(rna2dna),
 
-  addPreset(bintern);
-  addPreset(terndna);
+  addPreset(bintern),
+  addPreset(terndna),
 
-  addPreset(jukescantor);
-  addPreset(dnapswnbr);
+  addPreset(jukescantor),
+  addPreset(dnapswnbr),
 
-  addPreset(tkf91root);
-  addPreset(tkf91branch);
+  addPreset(tkf91root),
+  addPreset(tkf91branch),
 
-  addPreset(tolower);
-  addPreset(toupper);
+  addPreset(tolower),
+  addPreset(toupper),
 
-  addPreset(hamming31);
-  addPreset(hamming74);
-}
-
-PresetCache presetCache;  // singleton
+  addPreset(hamming31),
+  addPreset(hamming74)
+};
 
 Machine MachinePresets::makePreset (const string& presetName) {
-  if (!presetCache.namedPreset.count(presetName))
-    throw runtime_error (string("Preset ") + presetName + " not found");
-  const auto presetText = presetCache.namedPreset.at (presetName);
-  return MachineLoader::fromJson (json::parse (presetText));
+  for (const auto& preset: presets)
+    if (presetName == preset.name)
+      return MachineStreamLoader::fromBuffer ((const char*) preset.text, *preset.len, true);
+  throw runtime_error (string("Preset ") + presetName + " not found");
 }
 
 Machine MachinePresets::makePreset (const char* presetName) {
   return makePreset (string (presetName));
 }
 
+string MachinePresets::presetJson (const string& presetName) {
+  for (const auto& preset: presets)
+    if (presetName == preset.name)
+      return string ((const char*) preset.text, *preset.len);
+  throw runtime_error (string("Preset ") + presetName + " not found");
+}
+
 vector<string> MachinePresets::presetNames() {
-  return presetCache.names;
+  vector<string> names;
+  for (const auto& preset: presets)
+    names.push_back (preset.name);
+  return names;
 }
@@ -9,6 +9,7 @@ struct MachinePresets {
   static Machine makePreset (const char* presetName);
   static Machine makePreset (const string& presetName);
   static vector<string> presetNames();
+  static string presetJson (const string& presetName);  // the compiled-in JSON text
 };
 
 }  // end namespace
@@ -83,17 +83,17 @@ unsigned char preset_jukescantor_json[] = {
   0x0a, 0x5d, 0x2c, 0x0a, 0x20, 0x22, 0x64, 0x65, 0x66, 0x73, 0x22, 0x3a,
   0x20, 0x7b, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x70, 0x4e, 0x6f, 0x53, 0x75,
   0x62, 0x22, 0x3a, 0x7b, 0x22, 0x65, 0x78, 0x70, 0x22, 0x3a, 0x7b, 0x22,
-  0x2d, 0x22, 0x3a, 0x5b, 0x30, 0x2c, 0x22, 0x74, 0x22, 0x5d, 0x7d, 0x7d,
-  0x2c, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x70, 0x53, 0x75, 0x62, 0x22, 0x3a,
-  0x7b, 0x22, 0x6e, 0x6f, 0x74, 0x22, 0x3a, 0x22, 0x70, 0x4e, 0x6f, 0x53,
-  0x75, 0x62, 0x22, 0x7d, 0x2c, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x70, 0x44,
-  0x69, 0x66, 0x66, 0x22, 0x3a, 0x7b, 0x22, 0x2f, 0x22, 0x3a, 0x5b, 0x22,
-  0x70, 0x53, 0x75, 0x62, 0x22, 0x2c, 0x34, 0x5d, 0x7d, 0x2c, 0x0a, 0x20,
-  0x20, 0x20, 0x22, 0x70, 0x53, 0x61, 0x6d, 0x65, 0x22, 0x3a, 0x7b, 0x22,
-  0x2b, 0x22, 0x3a, 0x5b, 0x22, 0x70, 0x4e, 0x6f, 0x53, 0x75, 0x62, 0x22,
-  0x2c, 0x22, 0x70, 0x44, 0x69, 0x66, 0x66, 0x22, 0x5d, 0x7d, 0x0a, 0x20,
-  0x7d, 0x2c, 0x0a, 0x20, 0x22, 0x63, 0x6f, 0x6e, 0x73, 0x22, 0x3a, 0x7b,
-  0x0a, 0x20, 0x20, 0x20, 0x22, 0x72, 0x61, 0x74, 0x65, 0x22, 0x3a, 0x5b,
-  0x22, 0x74, 0x22, 0x5d, 0x0a, 0x20, 0x7d, 0x0a, 0x7d, 0x0a
+  0x2a, 0x22, 0x3a, 0x5b, 0x2d, 0x31, 0x2c, 0x22, 0x74, 0x22, 0x5d, 0x7d,
+  0x7d, 0x2c, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x70, 0x53, 0x75, 0x62, 0x22,
+  0x3a, 0x7b, 0x22, 0x6e, 0x6f, 0x74, 0x22, 0x3a, 0x22, 0x70, 0x4e, 0x6f,
+  0x53, 0x75, 0x62, 0x22, 0x7d, 0x2c, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x70,
+  0x44, 0x69, 0x66, 0x66, 0x22, 0x3a, 0x7b, 0x22, 0x2f, 0x22, 0x3a, 0x5b,
+  0x22, 0x70, 0x53, 0x75, 0x62, 0x22, 0x2c, 0x34, 0x5d, 0x7d, 0x2c, 0x0a,
+  0x20, 0x20, 0x20, 0x22, 0x70, 0x53, 0x61, 0x6d, 0x65, 0x22, 0x3a, 0x7b,
+  0x22, 0x2b, 0x22, 0x3a, 0x5b, 0x22, 0x70, 0x4e, 0x6f, 0x53, 0x75, 0x62,
+  0x22, 0x2c, 0x22, 0x70, 0x44, 0x69, 0x66, 0x66, 0x22, 0x5d, 0x7d, 0x0a,
+  0x20, 0x7d, 0x2c, 0x0a, 0x20, 0x22, 0x63, 0x6f, 0x6e, 0x73, 0x22, 0x3a,
+  0x7b, 0x0a, 0x20, 0x20, 0x20, 0x22, 0x72, 0x61, 0x74, 0x65, 0x22, 0x3a,
+  0x5b, 0x22, 0x74, 0x22, 0x5d, 0x0a, 0x20, 0x7d, 0x0a, 0x7d, 0x0a
 };
-unsigned int preset_jukescantor_json_len = 1150;
+unsigned int preset_jukescantor_json_len = 1151;
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 #include <valijson/adapters/nlohmann_json_adapter.hpp>
 #include <valijson/utils/nlohmann_json_utils.hpp>
@@ -25,9 +28,13 @@ using valijson::Validator;
 using valijson::ValidationResults;
 using valijson::adapters::NlohmannJsonAdapter;
 
+// SchemaCache holds the text of each schema, and compiles each schema (with its references) at most once
 struct SchemaCache {
   map<string,string> namedSchema;
+  mutable map<string,unique_ptr<Schema> > compiledSchema;
+  mutable mutex compiledSchemaMutex;
   json getSchema (const string& name) const;
+  const Schema& getCompiledSchema (const string& name) const;
   bool validate (const char* schemaName, const json& data) const;
   SchemaCache();
 };
@@ -71,13 +78,23 @@ void freeSchema (const json* schema) {
   delete schema;
 }
 
+const Schema& SchemaCache::getCompiledSchema (const string& name) const {
+  lock_guard<mutex> lock (compiledSchemaMutex);
+  auto iter = compiledSchema.find (name);
+  if (iter == compiledSchema.end()) {
+    unique_ptr<Schema> schema (new Schema());
+    SchemaParser parser;
+    const json schemaDoc = getSchema (name);
+    NlohmannJsonAdapter schemaAdapter (schemaDoc);
+    parser.populateSchema (schemaAdapter, *schema, fetchSchema, freeSchema);
+    iter = compiledSchema.insert (make_pair (name, move (schema))).first;
+  }
+  return *iter->second;
+}
+
 bool SchemaCache::validate (const char* schemaNameStem, const json& data) const {
-  Schema schema;
-  SchemaParser parser;
   const string schemaName = string(SchemaUrlPrefix) + schemaNameStem + SchemaUrlSuffix;
-  const json schemaDoc = schemaCache.getSchema (schemaName);
-  NlohmannJsonAdapter schemaAdapter (schemaDoc);
-  parser.populateSchema (schemaAdapter, schema, fetchSchema, freeSchema);
+  const Schema& schema = getCompiledSchema (schemaName);
   NlohmannJsonAdapter dataAdapter (data);
   Validator validator;
   ValidationResults results;
@@ -90,8 +107,18 @@ bool SchemaCache::validate (const char* schemaNameStem, const json& data) const
   return valid;
 }
 
+static atomic<bool> schemaInputTrusted (false);
+
 bool detail::MachineSchema::validate (const char* schemaNameStem, const nlohmann::json& data) {
-  return schemaCache.validate (schemaNameStem, data);
+  return schemaInputTrusted || schemaCache.validate (schemaNameStem, data);
+}
+
+void detail::MachineSchema::trustInput (bool trust) {
+  schemaInputTrusted = trust;
+}
+
+bool detail::MachineSchema::inputTrusted() {
+  return schemaInputTrusted;
 }
 
 void detail::MachineSchema::validateOrDie (const char* schemaNameStem, const nlohmann::json& data) {
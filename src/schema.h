@@ -10,6 +10,8 @@ namespace detail {
 struct MachineSchema {
   static bool validate (const char* schemaName, const nlohmann::json&);
   static void validateOrDie (const char* schemaName, const nlohmann::json&);
+  static void trustInput (bool trust = true);  // if true, validation is skipped (for trusted, e.g. machine-generated, input)
+  static bool inputTrusted();
 };
 
 }  // end namespace detail
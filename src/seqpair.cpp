@@ -257,3 +257,46 @@ void SeqPairList::writeJson (ostream& out) const {
   }
   out << "]";
 }
+
+SeqPairReader::SeqPairReader (const string& filename) :
+  filename (filename),
+  in (filename),
+  lineNumber (0)
+{
+  if (!in)
+    Fail ("File not found: %s", filename.c_str());
+}
+
+bool SeqPairReader::next (SeqPair& seqPair) {
+  string line;
+  while (getline (in, line)) {
+    ++lineNumber;
+    if (line.find_first_not_of (" \t\r") == string::npos)
+      continue;
+    json j;
+    try {
+      j = json::parse (line);
+    } catch (const json::exception& e) {
+      Fail ("%s line %lu: %s", filename.c_str(), lineNumber, e.what());
+    }
+    seqPair = JsonLoader<SeqPair>::fromJson (j);
+    return true;
+  }
+  return false;
+}
+
+size_t SeqPairReader::next (SeqPairList& seqPairList, size_t maxPairs) {
+  size_t n = 0;
+  SeqPair seqPair;
+  while (n < maxPairs && next (seqPair)) {
+    seqPairList.seqPairs.push_back (seqPair);
+    ++n;
+  }
+  return n;
+}
+
+void SeqPairReader::rewind() {
+  in.clear();
+  in.seekg (0);
+  lineNumber = 0;
+}
@@ -120,6 +120,20 @@ struct SeqPairList {
   void writeJson (ostream&) const;
 };
 
+// SeqPairReader streams sequence pairs from a file containing one JSON SeqPair per line,
+// so that large training sets need not be held in memory
+class SeqPairReader {
+public:
+  const string filename;
+  SeqPairReader (const string& filename);
+  bool next (SeqPair&);  // returns false at end of file
+  size_t next (SeqPairList&, size_t maxPairs);  // appends up to maxPairs pairs; returns the number appended
+  void rewind();
+private:
+  ifstream in;
+  size_t lineNumber;
+};
+
 }  // end namespace
 
 #endif /* SEQPAIR_INCLUDED */
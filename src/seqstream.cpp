@@ -0,0 +1,281 @@
+#include <thread>
+#include <limits>
+#include <sys/stat.h>
+#include "seqstream.h"
+#include "logger.h"
+#include "util.h"
+
+using namespace MachineBoss;
+
+NamedSeqSource::NamedSeqSource() :
+  fileEmpty (true),
+  readerPending (false),
+  keepRecords (false),
+  readerDone (false),
+  fileRecord (0),
+  recordBegin (0),
+  recordEnd (0),
+  nextKept (0),
+  nextSeq (0),
+  nextRecord (0)
+{ }
+
+Shard Shard::parse (const string& spec) {
+  Shard shard;
+  const size_t slash = spec.find ('/');
+  Require (slash != string::npos, "Shard must be specified as i/N, e.g. 1/4");
+  try {
+    shard.index = stoul (spec.substr (0, slash));
+    shard.count = stoul (spec.substr (slash + 1));
+  } catch (const logic_error&) {
+    Fail ("Shard must be specified as i/N, e.g. 1/4");
+  }
+  Require (shard.count > 0 && shard.index >= 1 && shard.index <= shard.count, "Shard %s is out of range: i/N must have 1 <= i <= N", spec.c_str());
+  return shard;
+}
+
+vguard<size_t> RecordSelection::records (const FastaIndex& index) const {
+  vguard<size_t> selected;
+  if (names.size())
+    for (const auto& name: names)
+      selected.push_back (index.recordIndex (name));
+  else {
+    const size_t from = first ? first : 1, to = last ? min (last, index.nRecords()) : index.nRecords();
+    Require (from <= index.nRecords() || from > to, "Record range starts at %lu, but %s only has %lu records", from, index.filename.c_str(), index.nRecords());
+    for (size_t r = from; r <= to; ++r)
+      selected.push_back (r - 1);
+  }
+  if (!shard.isWhole())
+    selected = vguard<size_t> (selected.begin() + shard.begin (selected.size()), selected.begin() + shard.end (selected.size()));
+  return selected;
+}
+
+void RecordSelection::parseNames (const string& spec) {
+  if (spec.size() && spec[0] == '@') {
+    const string filename = spec.substr (1);
+    ifstream in (filename);
+    if (!in)
+      Fail ("File not found: %s", filename.c_str());
+    string line;
+    while (getline (in, line))
+      for (const auto& name: split (line))
+	names.push_back (name);
+  } else
+    for (const auto& name: split (spec, ","))
+      names.push_back (name);
+}
+
+void RecordSelection::parseRange (const string& spec) {
+  const size_t dash = spec.find ('-');
+  try {
+    if (dash == string::npos)
+      first = last = stoul (spec);
+    else {
+      if (dash > 0)
+	first = stoul (spec.substr (0, dash));
+      if (dash + 1 < spec.size())
+	last = stoul (spec.substr (dash + 1));
+    }
+  } catch (const logic_error&) {
+    Fail ("Record range must be specified as A-B, A- or -B");
+  }
+  Require ((first > 0 || dash == 0) && (last > 0 || dash == string::npos || dash + 1 == spec.size()), "Records are numbered from 1");
+  Require ((first || last) && (!first || !last || first <= last), "Bad record range %s", spec.c_str());
+}
+
+void NamedSeqSource::setFile (const string& filename, bool rewindable, const Shard& shard) {
+  reader.reset (new FastSeqReader (filename));
+  struct stat st;
+  const bool regular = stat (filename.c_str(), &st) == 0 && S_ISREG (st.st_mode);
+  fileRecord = recordBegin = 0;
+  recordEnd = numeric_limits<size_t>::max();
+  if (!shard.isWhole()) {
+    Require (regular, "Can't find shard %lu/%lu of %s, as it is not a regular file", shard.index, shard.count, filename.c_str());
+    FastSeq fs;
+    size_t nRecords = 0;
+    while (reader->next (fs))
+      ++nRecords;
+    reader->rewind();
+    recordBegin = shard.begin (nRecords);
+    recordEnd = shard.end (nRecords);
+    LogThisAt(3, "Shard " << shard.index << "/" << shard.count << " of " << filename << " is records " << recordBegin + 1 << " to " << recordEnd << " of " << nRecords << endl);
+  }
+  readerPending = readRecord (pending);
+  fileEmpty = !readerPending;
+  if (fileEmpty)
+    Warn (shard.isWhole() ? "Couldn't read any sequences from %s" : "No sequences selected from %s", filename.c_str());
+  keepRecords = rewindable && !regular;
+  readerDone = false;
+  kept.clear();
+  nextKept = nextSeq = 0;
+}
+
+void NamedSeqSource::setIndexedFile (const string& filename, const RecordSelection& selection) {
+  reader.reset();
+  index.reset (new FastaIndex (filename));
+  records = selection.records (*index);
+  indexedFile.open (filename, ios::binary);
+  if (!indexedFile)
+    Fail ("File not found: %s", filename.c_str());
+  fileEmpty = records.empty();
+  if (fileEmpty)
+    Warn ("No sequences selected from %s", filename.c_str());
+  LogThisAt(3, "Selected " << plural(records.size(),"sequence") << " from " << filename << endl);
+  nextRecord = nextSeq = 0;
+}
+
+bool NamedSeqSource::readRecord (FastSeq& fs) {
+  for (; fileRecord < recordBegin; ++fileRecord)
+    if (!reader->next (fs))
+      return false;
+  if (fileRecord >= recordEnd || !reader->next (fs))
+    return false;
+  ++fileRecord;
+  return true;
+}
+
+bool NamedSeqSource::empty() const {
+  return fileEmpty && seqs.empty();
+}
+
+NamedInputSeq NamedSeqSource::fromFastSeq (const FastSeq& fs) {
+  return NamedInputSeq ({ fs.name, splitToChars (fs.seq) });
+}
+
+bool NamedSeqSource::next (NamedInputSeq& seq) {
+  if (index && nextRecord < records.size()) {
+    seq = fromFastSeq (index->read (indexedFile, records[nextRecord++]));
+    return true;
+  }
+  if (reader) {
+    if (readerDone && keepRecords) {
+      if (nextKept < kept.size()) {
+	seq = kept[nextKept++];
+	return true;
+      }
+    } else if (!readerDone) {
+      if (readerPending) {
+	readerPending = false;
+	seq = fromFastSeq (pending);
+      } else {
+	FastSeq fs;
+	if (readRecord (fs))
+	  seq = fromFastSeq (fs);
+	else
+	  readerDone = true;
+      }
+      if (!readerDone) {
+	if (keepRecords) {
+	  kept.push_back (seq);
+	  nextKept = kept.size();
+	}
+	return true;
+      }
+      LogThisAt(6,"Finished reading " << reader->filename << endl);
+    }
+  }
+  if (nextSeq < seqs.size()) {
+    seq = seqs[nextSeq++];
+    return true;
+  }
+  return false;
+}
+
+void NamedSeqSource::rewind() {
+  nextSeq = nextRecord = 0;
+  if (reader) {
+    if (keepRecords) {
+      NamedInputSeq seq;
+      while (!readerDone && next (seq))
+	;  // finish the first pass, so that all records are kept
+      nextSeq = nextKept = 0;
+    } else {
+      reader->rewind();
+      fileRecord = 0;
+      readerPending = readerDone = false;
+    }
+  }
+}
+
+SeqPairProduct::SeqPairProduct (NamedSeqSource& inputs, NamedSeqSource& outputs) :
+  inputs (inputs),
+  outputs (outputs),
+  haveInput (false)
+{ }
+
+bool SeqPairProduct::empty() const {
+  return inputs.empty() || outputs.empty();
+}
+
+bool SeqPairProduct::next (SeqPair& seqPair) {
+  if (empty())
+    return false;
+  NamedOutputSeq output;
+  if (haveInput && outputs.next (output)) {
+    seqPair = SeqPair();
+    seqPair.input = input;
+    seqPair.output = move (output);
+    return true;
+  }
+  while (inputs.next (input)) {
+    if (haveInput)
+      outputs.rewind();
+    haveInput = true;
+    if (outputs.next (output)) {
+      seqPair = SeqPair();
+      seqPair.input = input;
+      seqPair.output = move (output);
+      return true;
+    }
+  }
+  return false;
+}
+
+void SeqPairProduct::readAll (list<SeqPair>& seqPairs) {
+  if (empty())
+    return;
+  Assert (!haveInput, "SeqPairProduct::readAll called after next");
+  vguard<NamedOutputSeq> outputSeqs;
+  NamedOutputSeq output;
+  while (outputs.next (output))
+    outputSeqs.push_back (move (output));
+  while (inputs.next (input))
+    for (const auto& outputSeq: outputSeqs) {
+      seqPairs.push_back (SeqPair());
+      seqPairs.back().input = input;
+      seqPairs.back().output = outputSeq;
+    }
+}
+
+void SeqPairProduct::stream (function<void(const SeqPair&)> callback, size_t capacity) {
+  BoundedQueue<SeqPair> queue (capacity);
+  exception_ptr producerError;
+  list<thread> producer;
+  producer.push_back (thread ([&] () {
+	try {
+	  SeqPair seqPair;
+	  while (next (seqPair) && queue.push (move (seqPair)))
+	    ;
+	} catch (...) {
+	  producerError = current_exception();
+	}
+	queue.close();
+      }));
+  logger.nameLastThread (producer, "Reader");
+  auto join = [&] () {
+    logger.eraseThreadName (producer.back());
+    producer.back().join();
+  };
+  try {
+    SeqPair seqPair;
+    while (queue.pop (seqPair))
+      callback (seqPair);
+  } catch (...) {
+    queue.close();  // unblocks the producer
+    join();
+    throw;
+  }
+  join();
+  if (producerError)
+    rethrow_exception (producerError);
+}
@@ -0,0 +1,141 @@
+#ifndef SEQSTREAM_INCLUDED
+#define SEQSTREAM_INCLUDED
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <fstream>
+#include "seqpair.h"
+#include "fastseq.h"
+
+#define DefaultSeqPairQueueCapacity 64
+
+namespace MachineBoss {
+
+using namespace std;
+
+// BoundedQueue is a blocking FIFO of fixed capacity, for handing work from a producer thread to a consumer.
+// Either side may close the queue: the producer when it has finished, the consumer if it gives up early.
+template<typename T>
+class BoundedQueue {
+public:
+  BoundedQueue (size_t capacity) : capacity (capacity), closed (false) { }
+
+  // blocks while the queue is full; returns false if the queue was closed
+  bool push (T&& item) {
+    unique_lock<mutex> lock (mx);
+    notFull.wait (lock, [&] { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+    items.push_back (move (item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // blocks while the queue is empty; returns false once the queue is closed and drained
+  bool pop (T& item) {
+    unique_lock<mutex> lock (mx);
+    notEmpty.wait (lock, [&] { return closed || !items.empty(); });
+    if (items.empty())
+      return false;
+    item = move (items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> lock (mx);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  bool closed;
+  deque<T> items;
+  mutex mx;
+  condition_variable notFull, notEmpty;
+};
+
+// Shard i/N is the i'th of N contiguous, roughly equal blocks of a list (1 <= i <= N)
+struct Shard {
+  size_t index, count;
+  Shard() : index(1), count(1) { }
+  static Shard parse (const string& spec);  // "i/N"
+  bool isWhole() const { return count == 1; }
+  size_t begin (size_t n) const { return (index - 1) * n / count; }
+  size_t end (size_t n) const { return index * n / count; }
+};
+
+// RecordSelection picks records from an indexed FASTA file: by name or by range, and then by shard
+struct RecordSelection {
+  vguard<string> names;  // if nonempty, only these records, in this order
+  size_t first, last;  // 1-based, inclusive range; zero means unbounded
+  Shard shard;
+  RecordSelection() : first(0), last(0) { }
+  bool selectsAll() const { return names.empty() && !first && !last && shard.isWhole(); }
+  bool needsIndex() const { return names.size() || first || last; }  // a shard alone can be found by scanning the file
+  vguard<size_t> records (const FastaIndex& index) const;
+  void parseNames (const string& spec);  // comma-separated names, or @FILE with one name per line
+  void parseRange (const string& spec);  // "A-B", "A-" or "-B"
+};
+
+// NamedSeqSource is a rewindable list of named sequences: the records of a FASTA/FASTQ file, streamed one at a time,
+// followed by any sequences held in memory.
+// A source that must be rewound, but whose file is not seekable (e.g. a pipe), keeps the records from its first pass in memory.
+class NamedSeqSource {
+public:
+  vguard<NamedInputSeq> seqs;  // held in memory, after the file's records
+
+  NamedSeqSource();
+  // reads the first record, so that empty() is known; with a shard, first counts the records, to find the shard's block
+  void setFile (const string& filename, bool rewindable = false, const Shard& shard = Shard());
+  void setIndexedFile (const string& filename, const RecordSelection& selection);  // reads only the selected records, seeking via the .fai index
+
+  bool empty() const;
+  bool next (NamedInputSeq&);
+  void rewind();
+
+  static NamedInputSeq fromFastSeq (const FastSeq&);
+
+private:
+  unique_ptr<FastSeqReader> reader;
+  bool fileEmpty, readerPending, keepRecords, readerDone;
+  size_t fileRecord, recordBegin, recordEnd;  // records of the file outside [recordBegin,recordEnd) are skipped
+  FastSeq pending;  // first record, read ahead by setFile
+  vguard<NamedInputSeq> kept;
+  size_t nextKept, nextSeq;
+  unique_ptr<FastaIndex> index;
+  ifstream indexedFile;
+  vguard<size_t> records;
+  size_t nextRecord;
+
+  bool readRecord (FastSeq&);
+};
+
+// SeqPairProduct generates every combination of an input & an output sequence, in input-major order.
+// When generated lazily (by next or stream), the outputs are rewound for each input, so they should be set up as rewindable.
+class SeqPairProduct {
+public:
+  SeqPairProduct (NamedSeqSource& inputs, NamedSeqSource& outputs);
+  bool empty() const;
+  bool next (SeqPair&);
+
+  // appends all the pairs, reading each source only once (the outputs are held in memory, rather than rewound)
+  void readAll (list<SeqPair>& seqPairs);
+
+  // streams the pairs to a callback on the calling thread, while they are read & prepared on a separate producer thread
+  void stream (function<void(const SeqPair&)> callback, size_t capacity = DefaultSeqPairQueueCapacity);
+
+private:
+  NamedSeqSource &inputs, &outputs;
+  NamedInputSeq input;
+  bool haveInput;
+};
+
+}  // end namespace
+
+#endif /* SEQSTREAM_INCLUDED */
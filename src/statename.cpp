@@ -0,0 +1,37 @@
+#include "statename.h"
+
+using namespace MachineBoss;
+
+json StateName::toJson() const {
+  return arena ? arena->render (i, j) : value;
+}
+
+json StateNameArena::render (size_t i, size_t j) const {
+  switch (kind) {
+  case Product:
+    // use the type-deducing initializer-list constructor, as composition always has
+    return json ({ first[i].toJson(), second[j].toJson() });
+  case Tagged:
+    return json::array ({ tag, first[i].toJson() });
+  case Cell:
+    {
+      json cell = json::object();
+      cell[rowKey] = i;
+      cell[colKey] = j;
+      return cell;
+    }
+  case Text:
+    return json::parse (text[i]);
+  default:
+    break;
+  }
+  return json();
+}
+
+void MachineBoss::to_json (json& j, const StateName& name) {
+  j = name.toJson();
+}
+
+ostream& MachineBoss::operator<< (ostream& out, const StateName& name) {
+  return out << name.toJson();
+}
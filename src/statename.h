@@ -0,0 +1,64 @@
+#ifndef STATENAME_INCLUDED
+#define STATENAME_INCLUDED
+
+#include <memory>
+#include <string>
+#include <iostream>
+#include "json.hpp"
+#include "vguard.h"
+
+namespace MachineBoss {
+
+using namespace std;
+using json = nlohmann::json;
+
+struct StateNameArena;
+
+// StateName is a JSON state identifier.
+// Names of composite states (e.g. the product states built by composition & intersection)
+// can instead be stored lazily, as an index into a StateNameArena that is shared by all the states of a machine.
+// The JSON is only rendered when it is needed (e.g. by writeJson, writeDot or traceback output).
+class StateName {
+public:
+  StateName() : i(0), j(0) { }
+  StateName (const json& value) : value(value), i(0), j(0) { }
+  StateName (json&& value) : value(std::move(value)), i(0), j(0) { }
+  StateName (const char* value) : value(value), i(0), j(0) { }
+  StateName (const string& value) : value(value), i(0), j(0) { }
+  StateName (const shared_ptr<const StateNameArena>& arena, size_t i, size_t j = 0) : arena(arena), i(i), j(j) { }
+
+  bool is_null() const { return !arena && value.is_null(); }  // lazy names are never null
+  bool isLazy() const { return (bool) arena; }
+
+  json toJson() const;  // renders lazy names
+  string dump() const { return toJson().dump(); }
+
+private:
+  json value;
+  shared_ptr<const StateNameArena> arena;
+  size_t i, j;
+};
+
+// StateNameArena holds the names that lazy StateNames are rendered from
+struct StateNameArena {
+  typedef enum Kind {
+    Product = 0,  // name(i,j) = {first[i], second[j]}, as built by composition & intersection
+    Tagged = 1,   // name(i) = [tag, first[i]], as built by concatenation, union, etc.
+    Cell = 2,     // name(i,j) = {rowKey: i, colKey: j}, as built for jpHMM states
+    Text = 3      // name(i) = parse(text[i]), as read from a binary machine file
+  } Kind;
+  const Kind kind;
+  json tag;
+  string rowKey, colKey;
+  vguard<StateName> first, second;
+  vguard<string> text;
+  StateNameArena (Kind kind) : kind(kind) { }
+  json render (size_t i, size_t j) const;
+};
+
+void to_json (json&, const StateName&);
+ostream& operator<< (ostream&, const StateName&);
+
+}  // end namespace
+
+#endif /* STATENAME_INCLUDED */
@@ -49,3 +49,43 @@ double ViterbiMatrix::logLike() const {
 MachinePath ViterbiMatrix::path (const Machine& m) const {
   return traceBack (m);
 }
+
+void ViterbiMatrix::getCounts (MachineCounts& counts) const {
+  Assert (logLike() > -numeric_limits<double>::infinity(), "Can't do traceback: no finite-weight paths");
+  InputIndex inPos = inLen;
+  OutputIndex outPos = outLen;
+  StateIndex s = machine.endState();
+  while (inPos > 0 || outPos > 0 || s != machine.startState()) {
+    const EvaluatedMachineState& state = machine.state[s];
+    double bestLogLike = -numeric_limits<double>::infinity();
+    StateIndex bestSource = 0;
+    EvaluatedMachineState::TransIndex bestTransIndex = 0;
+    InputIndex bestInPos = inPos;
+    OutputIndex bestOutPos = outPos;
+    auto visitFrom = [&] (InputIndex srcInPos, OutputIndex srcOutPos) -> TransVisitor {
+      return [&,srcInPos,srcOutPos] (StateIndex src, EvaluatedMachineState::TransIndex ti, double ll) {
+	if (ll > bestLogLike) {
+	  bestLogLike = ll;
+	  bestSource = src;
+	  bestTransIndex = ti;
+	  bestInPos = srcInPos;
+	  bestOutPos = srcOutPos;
+	}
+      };
+    };
+    const InputToken inTok = inPos ? input[inPos-1] : InputTokenizer::emptyToken();
+    const OutputToken outTok = outPos ? output[outPos-1] : OutputTokenizer::emptyToken();
+    if (inPos && outPos)
+      iterate (state.incoming, inTok, outTok, inPos - 1, outPos - 1, visitFrom (inPos - 1, outPos - 1));
+    if (inPos)
+      iterate (state.incoming, inTok, OutputTokenizer::emptyToken(), inPos - 1, outPos, visitFrom (inPos - 1, outPos));
+    if (outPos)
+      iterate (state.incoming, InputTokenizer::emptyToken(), outTok, inPos, outPos - 1, visitFrom (inPos, outPos - 1));
+    iterate (state.incoming, InputTokenizer::emptyToken(), OutputTokenizer::emptyToken(), inPos, outPos, visitFrom (inPos, outPos));
+    Assert (bestLogLike > -numeric_limits<double>::infinity(), "Traceback failed");
+    counts.count[bestSource][bestTransIndex] += 1;
+    inPos = bestInPos;
+    outPos = bestOutPos;
+    s = bestSource;
+  }
+}
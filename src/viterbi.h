@@ -2,6 +2,7 @@
 #define VITERBI_INCLUDED
 
 #include "dpmatrix.h"
+#include "counts.h"
 
 namespace MachineBoss {
 
@@ -14,6 +15,7 @@ public:
   ViterbiMatrix (const EvaluatedMachine&, const SeqPair&, const Envelope&);
   double logLike() const;
   MachinePath path (const Machine&) const;
+  void getCounts (MachineCounts&) const;  // adds one count for each transition on the Viterbi path
 };
 
 }  // end namespace
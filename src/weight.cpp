@@ -1,6 +1,8 @@
 #include <math.h>
-#include <list>
 #include <iomanip>
+#include <mutex>
+#include <unordered_set>
+#include <cstring>
 #include "weight.h"
 #include "parsers.h"
 #include "logsumexp.h"
@@ -9,79 +11,241 @@
 
 using namespace MachineBoss;
 
-// singleton for storing ExprStruct's
+namespace MachineBoss {
+
+// singleton for storing ExprStruct's.
+// Nodes are hash-consed on (type,args), and owned by the WeightExprScope that was open when they were created.
+// All access to the node table is serialized by a mutex, so expressions can be built from several threads.
+// Allocating & freeing nodes happens outside the lock, which then only covers a single hash lookup.
+// The table is deliberately global rather than per-thread: WeightExpr's are compared by pointer,
+// which needs every thread to find the same node for the same expression.
 class ExprStructFactory {
 private:
-  list<ExprStruct> exprStructStorage;
-  list<string> paramStorage;
+  struct ExprHash {
+    size_t operator() (ExprPtr e) const {
+      size_t h = hash<int>() ((int) e->type);
+      auto mix = [&] (size_t x) { h ^= x + 0x9e3779b9 + (h << 6) + (h >> 2); };
+      switch (e->type) {
+      case Int: mix (hash<int>() (e->args.intValue)); break;
+      case Dbl: mix (hash<unsigned long long>() (doubleBits (e->args.doubleValue))); break;
+      case Param: mix (hash<string>() (*e->args.param)); break;
+      case Log:
+      case Exp: mix (hash<ExprPtr>() (e->args.arg)); break;
+      case Null: break;
+      default: mix (hash<ExprPtr>() (e->args.binary.l)); mix (hash<ExprPtr>() (e->args.binary.r)); break;
+      }
+      return h;
+    }
+  };
+  struct ExprEqual {
+    bool operator() (ExprPtr a, ExprPtr b) const {
+      if (a->type != b->type)
+	return false;
+      switch (a->type) {
+      case Int: return a->args.intValue == b->args.intValue;
+      case Dbl: return doubleBits (a->args.doubleValue) == doubleBits (b->args.doubleValue);  // bitwise, so NaN's can be found again
+      case Param: return *a->args.param == *b->args.param;
+      case Log:
+      case Exp: return a->args.arg == b->args.arg;
+      case Null: return true;
+      default: return a->args.binary.l == b->args.binary.l && a->args.binary.r == b->args.binary.r;
+      }
+    }
+  };
+  static unsigned long long doubleBits (double x) {
+    unsigned long long bits;
+    memcpy (&bits, &x, sizeof(double));
+    return bits;
+  }
+  unordered_set<ExprPtr,ExprHash,ExprEqual> exprStructs;
   ExprIndex nExprStructs;
+  ExprScopeId nScopes;
+  mutex factoryMutex;
+
+  static void deleteExpr (ExprPtr e) {
+    if (e->type == Param)
+      delete e->args.param;
+    delete e;
+  }
+
+  // hash-cons a newly allocated node, returning the existing copy if there is one. Caller must hold the lock
+  ExprPtr intern (ExprStruct* e) {
+    const auto iter = exprStructs.find (e);
+    if (iter != exprStructs.end()) {
+      if ((*iter)->scope && !WeightExprScope::isOpen ((*iter)->scope))
+	makePermanent (*iter);
+      return *iter;
+    }
+    WeightExprScope* scope = WeightExprScope::current();
+    e->index = nExprStructs++;
+    e->scope = scope ? scope->id : 0;
+    if (scope)
+      scope->created.push_back (e);
+    exprStructs.insert (e);
+    return e;
+  }
+
+  ExprPtr intern (ExprType type, const ExprArgs& args) {
+    ExprStruct* e = new ExprStruct();
+    e->type = type;
+    e->args = args;
+    ExprPtr interned;
+    {
+      lock_guard<mutex> lock (factoryMutex);
+      interned = intern (e);
+    }
+    if (interned != e)
+      deleteExpr (e);  // freed outside the lock, like the allocation
+    return interned;
+  }
+
+  void makePermanent (ExprPtr e) {
+    if (e->scope) {
+      e->scope = 0;
+      visitChildren (e, [&] (ExprPtr c) { makePermanent (c); });
+    }
+  }
+
+  void moveToScope (ExprPtr e, ExprScopeId from, WeightExprScope* to) {
+    if (e->scope == from) {
+      e->scope = to ? to->id : 0;
+      if (to)
+	to->created.push_back (e);
+      visitChildren (e, [&] (ExprPtr c) { moveToScope (c, from, to); });
+    }
+  }
+
+  template<class Visitor>
+  static void visitChildren (ExprPtr e, Visitor visit) {
+    switch (e->type) {
+    case Log:
+    case Exp:
+      visit (e->args.arg);
+      break;
+    case Mul:
+    case Add:
+    case Sub:
+    case Div:
+    case Pow:
+      visit (e->args.binary.l);
+      visit (e->args.binary.r);
+      break;
+    default:
+      break;
+    }
+  }
+
 public:
   ExprPtr zero, one;
-  ExprStructFactory() {
-    nExprStructs = 0;
-    zero = newExpr();
-    one = newExpr();
-    ((ExprStruct*)zero)->type = ((ExprStruct*)one)->type = Int;
-    ((ExprStruct*)zero)->args.intValue = 0;
-    ((ExprStruct*)one)->args.intValue = 1;
+  ExprStructFactory() : nExprStructs(0), nScopes(0), zero(NULL), one(NULL) {
+    zero = newInt (0);
+    one = newInt (1);
   }
-  ExprPtr newExpr() {
-    exprStructStorage.push_front (ExprStruct());
-    ExprPtr result = &exprStructStorage.front();
-    ((ExprStruct*)result)->index = nExprStructs++;
-    return result;
+  ~ExprStructFactory() {
+    for (auto e: exprStructs)
+      deleteExpr (e);
   }
   ExprPtr newParam (const string& param) {
-    paramStorage.push_front (param);
-    ExprPtr e = newExpr();
-    ((ExprStruct*)e)->type = Param;
-    ((ExprStruct*)e)->args.param = &paramStorage.front();
-    return e;
+    ExprArgs args;
+    args.param = new string (param);
+    return intern (Param, args);
   }
   ExprPtr newInt (int val) {
-    if (val == 0)
+    if (val == 0 && zero)
       return zero;
-    if (val == 1)
+    if (val == 1 && one)
       return one;
-    ExprPtr e = newExpr();
-    ((ExprStruct*)e)->type = Int;
-    ((ExprStruct*)e)->args.intValue = val;
-    return e;
+    ExprArgs args;
+    args.intValue = val;
+    return intern (Int, args);
   }
   ExprPtr newDouble (double val) {
     if (val == 0.)
       return zero;
     if (val == 1.)
       return one;
-    ExprPtr e = newExpr();
-    ((ExprStruct*)e)->type = Dbl;
-    ((ExprStruct*)e)->args.doubleValue = val;
-    return e;
+    ExprArgs args;
+    args.doubleValue = val;
+    return intern (Dbl, args);
   }
   ExprPtr newUnary (ExprType type, ExprPtr arg) {
     Assert (arg, "Null argument to unary function");
-    ExprPtr e = newExpr();
-    ((ExprStruct*)e)->type = type;
-    ((ExprStruct*)e)->args.arg = arg;
-    return e;
+    ExprArgs args;
+    args.arg = arg;
+    return intern (type, args);
   }
   ExprPtr newBinary (ExprType type, ExprPtr l, ExprPtr r) {
     Assert (l && r, "Null argument to binary function");
-    ExprPtr e = newExpr();
-    ((ExprStruct*)e)->type = type;
-    ((ExprStruct*)e)->args.binary.l = l;
-    ((ExprStruct*)e)->args.binary.r = r;
-    return e;
+    ExprArgs args;
+    args.binary.l = l;
+    args.binary.r = r;
+    return intern (type, args);
+  }
+  size_t nExprs() {
+    lock_guard<mutex> lock (factoryMutex);
+    return exprStructs.size();
   }
-  ExprRefCounts zeroRefCounts() const {
-    return ExprRefCounts (nExprStructs, 0);
+  ExprScopeId newScopeId() {
+    lock_guard<mutex> lock (factoryMutex);
+    return ++nScopes;
   }
-  ExprIter exprBegin() const {
-    return exprStructStorage.begin();
+  void keep (WeightExprScope& scope, ExprPtr e) {
+    lock_guard<mutex> lock (factoryMutex);
+    moveToScope (e, scope.id, scope.parent);
+  }
+  // free the nodes still owned by a closing scope
+  void release (WeightExprScope& scope) {
+    lock_guard<mutex> lock (factoryMutex);
+    for (auto e: scope.created)
+      if (e->scope == scope.id)
+	exprStructs.erase (e);
+    for (auto e: scope.created)
+      if (e->scope == scope.id)
+	deleteExpr (e);
   }
 };
+
+}  // end namespace
+
 ExprStructFactory factory;
 
+thread_local WeightExprScope* currentWeightExprScope = NULL;
+
+WeightExprScope::WeightExprScope() :
+  id (factory.newScopeId()),
+  parent (currentWeightExprScope)
+{
+  currentWeightExprScope = this;
+}
+
+WeightExprScope::~WeightExprScope() {
+  Assert (currentWeightExprScope == this, "WeightExprScope's must be closed in reverse order of opening");
+  factory.release (*this);
+  currentWeightExprScope = parent;
+}
+
+WeightExpr WeightExprScope::keep (const WeightExpr& w) {
+  if (w)
+    factory.keep (*this, w);
+  return w;
+}
+
+void WeightExprScope::keep (const ParamDefs& defs) {
+  for (const auto& def: defs)
+    keep (def.second);
+}
+
+WeightExprScope* WeightExprScope::current() {
+  return currentWeightExprScope;
+}
+
+bool WeightExprScope::isOpen (ExprScopeId id) {
+  for (const WeightExprScope* scope = currentWeightExprScope; scope; scope = scope->parent)
+    if (scope->id == id)
+      return true;
+  return false;
+}
+
 WeightExpr WeightAlgebra::zero() {
   return factory.zero;
 }
@@ -102,6 +266,16 @@ WeightExpr WeightAlgebra::param (const string& name) {
   return factory.newParam (name);
 }
 
+WeightExpr WeightAlgebra::unaryNode (ExprType op, const WeightExpr& arg) {
+  Assert (op == Log || op == Exp, "Not a unary operator");
+  return factory.newUnary (op, arg);
+}
+
+WeightExpr WeightAlgebra::binaryNode (ExprType op, const WeightExpr& l, const WeightExpr& r) {
+  Assert (op == Mul || op == Add || op == Sub || op == Div || op == Pow, "Not a binary operator");
+  return factory.newBinary (op, l, r);
+}
+
 WeightExpr WeightAlgebra::minus (const WeightExpr& x) {
   return factory.newBinary (Sub, factory.zero, x);
 }
@@ -590,15 +764,15 @@ WeightExpr WeightAlgebra::fromJson (const json& w, const ParamDefs* defs) {
 }
 
 ExprRefCounts WeightAlgebra::zeroRefCounts() {
-  return factory.zeroRefCounts();
+  return ExprRefCounts();
 }
 
-ExprIter WeightAlgebra::exprBegin() {
-  return factory.exprBegin();
+size_t WeightAlgebra::nExprs() {
+  return factory.nExprs();
 }
 
 void WeightAlgebra::countRefs (const WeightExpr w, ExprRefCounts& counts, set<string>& params, const ParamDefs& defs, const WeightExpr parent) {
-  if (!(counts[w->index]++)) {
+  if (!(counts[w]++)) {
     switch (w->type) {
     case Null:
     case Int:
@@ -625,6 +799,205 @@ void WeightAlgebra::countRefs (const WeightExpr w, ExprRefCounts& counts, set<st
   }
 }
 
+WeightProgram::WeightProgram (const vector<WeightExpr>& exprs, const ParamDefs& defs, const vector<string>& inputs) {
+  for (const auto& name: inputs)
+    inputRegister (name);
+  result.reserve (exprs.size());
+  for (const auto& w: exprs)
+    result.push_back (compile (w, defs));
+  exprRegister.clear();
+  defRegister.clear();
+  active.clear();
+}
+
+size_t WeightProgram::newRegister (double init, bool isActive) {
+  initRegister.push_back (init);
+  active.push_back (isActive);
+  return initRegister.size() - 1;
+}
+
+size_t WeightProgram::inputRegister (const string& name) {
+  const auto iter = paramIndex.find (name);
+  if (iter != paramIndex.end())
+    return paramRegister[iter->second];
+  paramIndex[name] = param.size();
+  param.push_back (name);
+  paramRegister.push_back (newRegister (0, true));
+  return paramRegister.back();
+}
+
+size_t WeightProgram::instruction (ExprType op, size_t l, size_t r) {
+  const bool lActive = active[l], rActive = active[r];
+  if (!lActive && !rActive)
+    return newRegister (apply (op, initRegister[l], initRegister[r]));
+  const size_t reg = newRegister (0, true);
+  code.push_back (Instruction ({ op, reg, l, r, lActive, rActive }));
+  return reg;
+}
+
+size_t WeightProgram::compile (const WeightExpr& w, const ParamDefs& defs) {
+  if (!w)
+    return newRegister (0);
+  const ExprType op = w->type;
+  if (op == Param) {
+    // parameters are resolved by name, not by node, so that cyclic definitions are caught as they are by WeightAlgebra::eval
+    const string& n (*w->args.param);
+    if (defsInProgress.count(n))
+      throw runtime_error(string("Parameter ") + n + (" not defined"));
+    if (!defs.count(n))
+      return inputRegister (n);
+    const auto iter = defRegister.find (n);
+    if (iter != defRegister.end())
+      return iter->second;
+    const WeightExpr& def = defs.at(n);
+    size_t reg;
+    if (WeightAlgebra::isNumber (def))
+      reg = newRegister (WeightAlgebra::asDouble (def));
+    else {
+      defsInProgress.insert (n);
+      reg = compile (def, defs);
+      defsInProgress.erase (n);
+    }
+    return defRegister[n] = reg;
+  }
+  const auto iter = exprRegister.find (w);
+  if (iter != exprRegister.end())
+    return iter->second;
+  size_t reg;
+  switch (op) {
+  case Null:
+    reg = newRegister (0);
+    break;
+  case Int:
+  case Dbl:
+    reg = newRegister (WeightAlgebra::asDouble (w));
+    break;
+  case Log:
+  case Exp:
+    {
+      const size_t arg = compile (w->args.arg, defs);
+      reg = instruction (op, arg, arg);
+    }
+    break;
+  default:
+    {
+      const size_t l = compile (w->args.binary.l, defs);
+      const size_t r = compile (w->args.binary.r, defs);
+      reg = instruction (op, l, r);
+    }
+    break;
+  }
+  return exprRegister[w] = reg;
+}
+
+double WeightProgram::apply (ExprType op, double l, double r) {
+  switch (op) {
+  case Mul: return l * r;
+  case Div: return l / r;
+  case Add: return l + r;
+  case Sub: return l - r;
+  case Pow: return pow (l, r);
+  case Log: return log (l);
+  case Exp: return exp (l);
+  default: Abort("Unknown opcode"); break;
+  }
+  return 0;
+}
+
+void WeightProgram::run (const double* paramValues, vector<double>& reg) const {
+  reg = initRegister;
+  for (size_t k = 0; k < paramRegister.size(); ++k)
+    reg[paramRegister[k]] = paramValues[k];
+  for (const auto& instr: code)
+    reg[instr.dest] = apply (instr.op, reg[instr.l], reg[instr.r]);
+}
+
+vector<double> WeightProgram::eval() const {
+  if (nParams())
+    throw runtime_error(string("Parameter ") + param.front() + (" not defined"));
+  vector<double> results (nResults());
+  eval (NULL, results.data());
+  return results;
+}
+
+vector<double> WeightProgram::eval (const vector<double>& paramValues) const {
+  Assert (paramValues.size() == nParams(), "Expected %lu parameters, got %lu", nParams(), paramValues.size());
+  vector<double> results (nResults());
+  eval (paramValues.data(), results.data());
+  return results;
+}
+
+void WeightProgram::eval (const double* paramValues, double* results) const {
+  vector<double> reg;
+  run (paramValues, reg);
+  for (size_t n = 0; n < result.size(); ++n)
+    results[n] = reg[result[n]];
+}
+
+vector<double> WeightProgram::gradient (const vector<double>& paramValues, size_t resultIndex) const {
+  Assert (paramValues.size() == nParams(), "Expected %lu parameters, got %lu", nParams(), paramValues.size());
+  Assert (resultIndex < nResults(), "Result index out of range");
+  vector<double> resultWeights (nResults(), 0.), grad (nParams());
+  resultWeights[resultIndex] = 1;
+  gradient (paramValues.data(), resultWeights.data(), grad.data());
+  return grad;
+}
+
+void WeightProgram::gradient (const double* paramValues, const double* resultWeights, double* grad, double* results) const {
+  vector<double> reg;
+  run (paramValues, reg);
+  if (results)
+    for (size_t n = 0; n < result.size(); ++n)
+      results[n] = reg[result[n]];
+
+  vector<double> adj (reg.size(), 0.);
+  for (size_t n = 0; n < result.size(); ++n)
+    adj[result[n]] += resultWeights[n];
+
+  // backward sweep. Derivatives take the same form as in WeightAlgebra::deriv
+  for (auto iter = code.rbegin(); iter != code.rend(); ++iter) {
+    const auto& instr = *iter;
+    const double a = adj[instr.dest];
+    if (a == 0)
+      continue;
+    const double d = reg[instr.dest], l = reg[instr.l], r = reg[instr.r];
+    switch (instr.op) {
+    case Mul:
+      if (instr.lActive) adj[instr.l] += a * r;
+      if (instr.rActive) adj[instr.r] += a * l;
+      break;
+    case Div:
+      if (instr.lActive) adj[instr.l] += a / r;
+      if (instr.rActive) adj[instr.r] -= a * d / r;
+      break;
+    case Add:
+      if (instr.lActive) adj[instr.l] += a;
+      if (instr.rActive) adj[instr.r] += a;
+      break;
+    case Sub:
+      if (instr.lActive) adj[instr.l] += a;
+      if (instr.rActive) adj[instr.r] -= a;
+      break;
+    case Pow:
+      if (instr.lActive) adj[instr.l] += a * d * r / l;
+      if (instr.rActive) adj[instr.r] += a * d * log (l);
+      break;
+    case Log:
+      adj[instr.l] += a / l;
+      break;
+    case Exp:
+      adj[instr.l] += a * d;
+      break;
+    default:
+      Abort("Unknown opcode");
+      break;
+    }
+  }
+
+  for (size_t k = 0; k < paramRegister.size(); ++k)
+    grad[k] = adj[paramRegister[k]];
+}
+
 void sortDeps (const ParamDefs& defs, vector<string>& deps, const string& name, set<string>& visited, vector<string>& refs) {
   if (!visited.count (name)) {
     visited.insert (name);
@@ -1,8 +1,9 @@
 #ifndef WEIGHT_INCLUDED
 #define WEIGHT_INCLUDED
 
-#include <list>
 #include <set>
+#include <vector>
+#include <unordered_map>
 #include "json.hpp"
 
 #define WeightMacroSymbolPlaceholder       "%"
@@ -17,7 +18,7 @@ using json = nlohmann::json;
 
 typedef struct ExprStruct const* ExprPtr;
 typedef size_t ExprIndex;
-typedef list<ExprStruct>::const_iterator ExprIter;
+typedef size_t ExprScopeId;
 
 struct BinaryExprArgs {
   ExprPtr l, r;
@@ -38,17 +39,20 @@ enum ExprType {
   Param,  // parameter
   Null
 };
+// ExprStruct's are hash-consed: structurally identical expressions share a node,
+// so WeightExpr's can be compared by pointer
 struct ExprStruct {
   ExprType type;
   ExprArgs args;
-  ExprIndex index;
-  ExprStruct() : type(Null) { }
+  ExprIndex index;  // order of creation
+  mutable ExprScopeId scope;  // owning WeightExprScope, or 0 if the node is permanent
+  ExprStruct() : type(Null), index(0), scope(0) { }
 };
 
 typedef ExprPtr WeightExpr;
 typedef map<string,WeightExpr> ParamDefs;
 
-typedef vector<size_t> ExprRefCounts;
+typedef unordered_map<WeightExpr,size_t> ExprRefCounts;
 typedef map<WeightExpr,string> ExprMemos;
 
 struct WeightAlgebra {
@@ -68,6 +72,10 @@ struct WeightAlgebra {
   static WeightExpr logOf (const WeightExpr& p);  // log(p)
   static WeightExpr expOf (const WeightExpr& p);  // exp(p)
 
+  // exact node constructors, bypassing the simplifications above (e.g. for deserializing an expression DAG node by node)
+  static WeightExpr unaryNode (ExprType op, const WeightExpr& arg);  // op = Log or Exp
+  static WeightExpr binaryNode (ExprType op, const WeightExpr& l, const WeightExpr& r);  // op = Mul, Add, Sub, Div or Pow
+
   static WeightExpr minus (const WeightExpr& x);  // 0 - x
   static WeightExpr negate (const WeightExpr& p);  // 1 - p
   static WeightExpr reciprocal (const WeightExpr& p);  // 1 / p
@@ -110,7 +118,86 @@ struct WeightAlgebra {
   // trace refcount of functions. also used by params()
   static ExprRefCounts zeroRefCounts();
   static void countRefs (const WeightExpr w, ExprRefCounts& counts, set<string>& params, const ParamDefs& defs, const WeightExpr parent = NULL);
-  static ExprIter exprBegin();
+
+  // number of expression nodes currently allocated
+  static size_t nExprs();
+};
+
+// WeightProgram compiles a list of WeightExpr's, and the ParamDefs they refer to, into a flat register program.
+// Parameter names are resolved once, at compile time: defined parameters are inlined, and the remaining (free) parameters become inputs.
+// Shared subexpressions (including function definitions) are evaluated once per run, in a single linear pass.
+// Results are identical to calling WeightAlgebra::eval on each expression.
+// Gradients are computed by reverse-mode automatic differentiation: one forward and one backward sweep,
+// without building any derivative expressions.
+class WeightProgram {
+public:
+  vector<string> param;  // free parameters, in order of their input slots
+  map<string,size_t> paramIndex;
+
+  WeightProgram() { }
+  WeightProgram (const vector<WeightExpr>& exprs, const ParamDefs& defs, const vector<string>& inputs = vector<string>());  // inputs get the first slots, even if unused
+
+  size_t nParams() const { return param.size(); }
+  size_t nResults() const { return result.size(); }
+  size_t nInstructions() const { return code.size(); }
+
+  vector<double> eval (const vector<double>& paramValues) const;  // paramValues indexed as param
+  void eval (const double* paramValues, double* results) const;
+  vector<double> eval() const;  // throws if there are any free parameters
+
+  // gradient of sum_n resultWeights[n] * result[n] with respect to each parameter.
+  // results (if non-null) receives the result values
+  void gradient (const double* paramValues, const double* resultWeights, double* grad, double* results = NULL) const;
+  vector<double> gradient (const vector<double>& paramValues, size_t resultIndex = 0) const;  // gradient of a single result
+
+private:
+  struct Instruction {
+    ExprType op;
+    size_t dest, l, r;
+    bool lActive, rActive;  // true if the operand depends on a parameter
+  };
+  vector<double> initRegister;  // constants; parameter registers are overwritten at each run
+  vector<size_t> paramRegister;  // register holding each parameter
+  vector<Instruction> code;
+  vector<size_t> result;  // register holding each result
+
+  static double apply (ExprType op, double l, double r);
+  void run (const double* paramValues, vector<double>& reg) const;
+
+  // compile-time state
+  unordered_map<WeightExpr,size_t> exprRegister;
+  map<string,size_t> defRegister;
+  set<string> defsInProgress;
+  vector<bool> active;
+  size_t compile (const WeightExpr& w, const ParamDefs& defs);
+  size_t newRegister (double init = 0, bool isActive = false);
+  size_t inputRegister (const string& name);
+  size_t instruction (ExprType op, size_t l, size_t r);  // folds constant operands at compile time
+};
+
+// WeightExprScope is an RAII arena for expression nodes.
+// Nodes first created (on this thread) while a scope is open belong to the innermost open scope,
+// and are freed when that scope closes, unless they have been passed to keep(),
+// which hands them (and their subexpressions) on to the enclosing scope.
+// Nodes that are reused from another thread, or from outside the scope, become permanent.
+// Nodes created outside any scope are permanent.
+class WeightExprScope {
+public:
+  WeightExprScope();
+  ~WeightExprScope();
+  WeightExprScope (const WeightExprScope&) = delete;
+  WeightExprScope& operator= (const WeightExprScope&) = delete;
+
+  WeightExpr keep (const WeightExpr& w);
+  void keep (const ParamDefs& defs);
+
+private:
+  friend class ExprStructFactory;
+  const ExprScopeId id;
+  WeightExprScope* const parent;
+  vector<ExprPtr> created;
+  static WeightExprScope* current();
+  static bool isOpen (ExprScopeId id);  // true if id is open on this thread
 };
 
 }  // end namespace
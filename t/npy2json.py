@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+
+# Prints the arrays in a .npy file (one after another, as written by boss --posteriors) as a JSON list of nested lists,
+# with floats rounded to the given number of decimal places. Does not need NumPy.
+
+import sys
+import ast
+import json
+import struct
+
+if len(sys.argv) != 3:
+    print(f"Usage: {sys.argv[0]} <decimalPlaces> <file.npy>", file=sys.stderr)
+    sys.exit(1)
+
+places = int(sys.argv[1])
+data = open(sys.argv[2], 'rb').read()
+
+def nest(flat, shape):
+    if len(shape) <= 1:
+        return flat
+    step = len(flat) // shape[0] if shape[0] else 0
+    return [nest(flat[k*step:(k+1)*step], shape[1:]) for k in range(shape[0])]
+
+arrays = []
+pos = 0
+while pos < len(data):
+    assert data[pos:pos+6] == b'\x93NUMPY', "bad magic"
+    major = data[pos+6]
+    assert major == 1, "unsupported version"
+    hlen = struct.unpack('<H', data[pos+8:pos+10])[0]
+    header = ast.literal_eval(data[pos+10:pos+10+hlen].decode('latin1'))
+    pos += 10 + hlen
+    descr, shape = header['descr'], header['shape']
+    assert not header['fortran_order']
+    order, kind, size = descr[0], descr[1], int(descr[2:])
+    n = 1
+    for d in shape:
+        n *= d
+    fmt = ('<' if order == '<' else '>') + str(n) + {'f8': 'd', 'i8': 'q'}[kind + str(size)]
+    flat = list(struct.unpack(fmt, data[pos:pos+n*size]))
+    pos += n * size
+    if kind == 'f':
+        flat = [round(x, places) + 0.0 for x in flat]
+    arrays.append(nest(flat, shape))
+
+print(json.dumps(arrays))
@@ -0,0 +1,27 @@
+#include <fstream>
+#include "../../src/counts.h"
+
+using namespace MachineBoss;
+
+// prints the closed-form M-step solution, and the constraints left over for numerical optimization
+int main (int argc, char** argv) {
+  if (argc != 5) {
+    cerr << "Usage: " << argv[0] << " machine.json params.json seqs.json constraints.json" << endl;
+    exit(1);
+  }
+  Machine machine = MachineLoader::fromFile (argv[1]);
+  Params params = JsonLoader<ParamAssign>::fromFile (argv[2]);
+  SeqPair seqPair = JsonLoader<SeqPair>::fromFile (argv[3]);
+  Constraints constraints = JsonLoader<Constraints>::fromFile (argv[4]);
+  EvaluatedMachine evalMachine (machine, params);
+  MachineCounts counts (evalMachine, seqPair);
+  MachineObjective objective (machine, counts, constraints, Params());
+  cout << "{\"closedForm\":";
+  objective.closedFormParams.writeJson (cout);
+  cout << ",\"numeric\":";
+  objective.numericConstraints.writeJson (cout);
+  cout << ",\"optimized\":";
+  objective.optimize (params).writeJson (cout);
+  cout << "}" << endl;
+  exit(0);
+}
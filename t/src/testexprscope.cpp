@@ -0,0 +1,38 @@
+#include <fstream>
+#include <iostream>
+#include "../../src/weight.h"
+#include "../../src/schema.h"
+
+using namespace std;
+using namespace MachineBoss;
+
+int main (int argc, char** argv) {
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " expr.json param" << endl;
+    exit(1);
+  }
+  json w;
+  ifstream in (argv[1]);
+  in >> w;
+  MachineSchema::validateOrDie ("expr", w);
+  const WeightExpr e = WeightAlgebra::fromJson(w);
+  const string param (argv[2]);
+
+  WeightExpr d;
+  {
+    WeightExprScope scope;
+    d = scope.keep (WeightAlgebra::deriv (e, ParamDefs(), param));
+    const WeightExpr d2 = WeightAlgebra::deriv (WeightAlgebra::fromJson(w), ParamDefs(), param);
+    cout << "shared: " << (d == d2 ? "true" : "false") << endl;
+    WeightAlgebra::multiply (d, WeightAlgebra::param ("scratch"));
+  }
+  const size_t nExprs = WeightAlgebra::nExprs();
+  {
+    WeightExprScope scope;
+    WeightAlgebra::deriv (e, ParamDefs(), param);
+    WeightAlgebra::multiply (d, WeightAlgebra::param ("scratch"));
+  }
+  cout << "released: " << (WeightAlgebra::nExprs() == nExprs ? "true" : "false") << endl;
+  cout << "kept: " << WeightAlgebra::toJsonString(d) << endl;
+  exit(0);
+}
@@ -4,15 +4,16 @@
 using namespace MachineBoss;
 
 int main (int argc, char** argv) {
-  if (argc != 4) {
-    cerr << "Usage: " << argv[0] << " machine.json params.json seqs.json" << endl;
+  if (argc != 4 && argc != 5) {
+    cerr << "Usage: " << argv[0] << " machine.json params.json seqs.json [envelopeWidth]" << endl;
     exit(1);
   }
   Machine machine = MachineLoader::fromFile (argv[1]);
   Params params = JsonLoader<ParamAssign>::fromFile (argv[2]);
   SeqPair seqpair = JsonLoader<SeqPair>::fromFile (argv[3]);
   EvaluatedMachine evalMachine (machine, params);
-  ForwardMatrix forward (evalMachine, seqpair);
+  const Envelope env = argc == 5 ? Envelope (seqpair, atoi (argv[4])) : Envelope (seqpair);
+  ForwardMatrix forward (evalMachine, seqpair, env);
   forward.writeJson (cout);
   exit(0);
 }
@@ -0,0 +1,27 @@
+#include <fstream>
+#include "../../src/params.h"
+#include "../../src/schema.h"
+
+using namespace MachineBoss;
+
+int main (int argc, char** argv) {
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " expr.json params.json" << endl;
+    exit(1);
+  }
+  json w;
+  ifstream in (argv[1]);
+  in >> w;
+  MachineSchema::validateOrDie ("expr", w);
+  Params p = JsonLoader<ParamAssign>::fromFile (argv[2]);
+  const WeightProgram program (vector<WeightExpr> (1, WeightAlgebra::fromJson(w)), ParamDefs());
+  vector<double> paramValues;
+  for (const auto& param: program.param)
+    paramValues.push_back (WeightAlgebra::eval (p.defs.at(param), p.defs));
+  const vector<double> grad = program.gradient (paramValues);
+  json result = json::object();
+  for (size_t k = 0; k < program.nParams(); ++k)
+    result[program.param[k]] = grad[k];
+  cout << result << endl;
+  exit(0);
+}
@@ -0,0 +1,27 @@
+#include "../../src/jsonstream.h"
+
+using namespace MachineBoss;
+
+int main (int argc, char** argv) {
+  if (argc != 3 || (string(argv[1]) != "machine" && string(argv[1]) != "seqpairlist")) {
+    cerr << "Usage: " << argv[0] << " (machine|seqpairlist) file.json" << endl;
+    exit(1);
+  }
+  const string type (argv[1]), filename (argv[2]);
+  string streamed, loaded;
+  if (type == "machine") {
+    streamed = MachineLoader::toJsonString (MachineStreamLoader::fromFile (filename));
+    loaded = MachineLoader::toJsonString (MachineLoader::fromFile (filename));
+  } else {
+    SeqPairList seqPairList;
+    SeqPairStreamLoader::readFiles (seqPairList, vector<string> (1, filename));
+    streamed = JsonWriter<SeqPairList>::toJsonString (seqPairList);
+    loaded = JsonWriter<SeqPairList>::toJsonString (JsonLoader<SeqPairList>::fromFile (filename));
+  }
+  if (streamed != loaded) {
+    cerr << "Streamed and loaded " << type << " differ" << endl;
+    exit(1);
+  }
+  cout << streamed << endl;
+  exit(0);
+}
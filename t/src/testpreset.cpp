@@ -0,0 +1,16 @@
+#include "../../src/preset.h"
+#include "../../src/schema.h"
+
+using namespace MachineBoss;
+
+// validates the compiled-in JSON text of a preset against the machine schema, then prints it verbatim
+int main (int argc, char** argv) {
+  if (argc != 2) {
+    cerr << "Usage: " << argv[0] << " presetName" << endl;
+    exit(1);
+  }
+  const string text = MachinePresets::presetJson (argv[1]);
+  MachineSchema::validateOrDie ("machine", json::parse (text));
+  cout << text;
+  exit(0);
+}
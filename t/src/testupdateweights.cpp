@@ -0,0 +1,22 @@
+#include <fstream>
+#include "../../src/api.h"
+
+using namespace MachineBoss;
+
+// checks that updating an EvaluatedMachine's weights gives the same result as evaluating it from scratch
+int main (int argc, char** argv) {
+  if (argc != 5) {
+    cerr << "Usage: " << argv[0] << " machine.json params1.json params2.json seqs.json" << endl;
+    exit(1);
+  }
+  Machine machine = MachineLoader::fromFile (argv[1]);
+  Params params1 = JsonLoader<ParamAssign>::fromFile (argv[2]);
+  Params params2 = JsonLoader<ParamAssign>::fromFile (argv[3]);
+  SeqPair seqpair = JsonLoader<SeqPair>::fromFile (argv[4]);
+  EvaluatedMachine eval = evaluateMachine (machine, params1);
+  updateWeights (eval, params2);
+  const EvaluatedMachine fresh = evaluateMachine (machine, params2);
+  cout << (eval.toJsonString() == fresh.toJsonString() ? "same" : "different") << endl;
+  cout << forwardLogLike (eval, seqpair) << endl;
+  exit(0);
+}
@@ -15,11 +15,18 @@
 #include "../src/machine.h"
 #include "../src/preset.h"
 #include "../src/seqpair.h"
+#include "../src/jsonstream.h"
+#include "../src/binary.h"
+#include "../src/cache.h"
+#include "../src/api.h"
+#include "../src/seqstream.h"
 #include "../src/constraints.h"
+#include "../src/posterior.h"
 #include "../src/params.h"
 #include "../src/fitter.h"
 #include "../src/viterbi.h"
 #include "../src/forward.h"
+#include "../src/batchforward.h"
 #include "../src/counts.h"
 #include "../src/util.h"
 #include "../src/schema.h"
@@ -47,11 +54,14 @@ int main (int argc, char** argv) {
       ("verbose,v", po::value<int>()->default_value(2), "verbosity level")
       ("debug,d", po::value<vector<string> >(), "log specified function")
       ("monochrome,b", "log in black & white")
+      ("trust-input", "skip JSON schema validation of input files (for trusted, e.g. machine-generated, files)")
+      ("cache-dir", po::value<string>(), "cache constructed machines in directory, keyed by the machine expression & input file contents")
+      ("cache-size", po::value<double>(), "maximum size of machine cache in megabytes (least recently used machines are evicted)")
       ;
 
     po::options_description createOpts("Transducer construction");
     createOpts.add_options()
-      ("load,l", po::value<string>(), "load machine from file")
+      ("load,l", po::value<string>(), "load machine from file (JSON, or binary as written by --save-binary)")
       ("preset,p", po::value<string>(), (string ("select preset (") + join (MachinePresets::presetNames(), ", ") + ")").c_str())
       ("generate-chars,g", po::value<string>(), "generator for explicit character sequence '<<'")
       ("generate-one", po::value<string>(), "generator for any one of specified characters")
@@ -116,6 +126,8 @@ int main (int argc, char** argv) {
       ("eliminate,n", "eliminate all silent transitions")
       ("eliminate-states", "eliminate all states whose only outgoing (or incoming) transition is silent")
       ("merge-states", "merge states with equivalent outgoing transitions (collapse bubbles)")
+      ("determinize", "weighted determinization, treating input/output label pairs as symbols (requires numeric weights)")
+      ("minimize", "weighted determinization, weight pushing & minimization (requires numeric weights)")
       ("strip-names", "remove all state names. Some algorithms (e.g. composition of large transducers) are faster if states are unnamed")
       ("pad", "pad with \"dummy\" start & end states")
       ("reciprocal", "element-wise reciprocal: invert all weight expressions")
@@ -152,6 +164,10 @@ int main (int argc, char** argv) {
     po::options_description appOpts("Transducer application");
     appOpts.add_options()
       ("save,S", po::value<string>(), "save machine to file")
+      ("save-binary", po::value<string>(), "save machine to file in memory-mappable binary format")
+      ("binary-no-names", "omit state names when saving in binary format")
+      ("save-eval", po::value<string>(), "save machine in binary format with transition weights evaluated using the final parameters, for use with --from-eval")
+      ("from-eval", po::value<string>(), "load machine saved by --save-eval in place of a machine expression; supports --loglike and --viterbi")
       ("graphviz,G", "write machine in Graphviz DOT format")
       ("dot-no-merge", "show each transition as a separate edge in DOT output")
       ("dot-show-io", "always show in/out labels (disable abbreviating a/a to a) in DOT output")
@@ -172,13 +188,36 @@ int main (int argc, char** argv) {
       ("output-fasta,O", po::value<string>(), "load output sequence(s) from FASTA file")
       ("output-json", po::value<string>(), "load output sequence from JSON file")
       ("output-chars", po::value<string>(), "specify output character sequence explicitly")
+      ("index-fasta", po::value<vector<string> >(), "build samtools-style .fai index for FASTA file")
+      ("input-names", po::value<string>(), "read only the named --input-fasta records (comma-separated, or @FILE with one name per line), using the .fai index")
+      ("input-range", po::value<string>(), "read only --input-fasta records A-B (numbered from 1), using the .fai index")
+      ("output-names", po::value<string>(), "read only the named --output-fasta records, using the .fai index")
+      ("output-range", po::value<string>(), "read only --output-fasta records A-B, using the .fai index")
+      ("shard", po::value<string>(), "process only the i'th of N shards (i/N) of the sequence pairs: a contiguous block of --input-fasta records (or --output-fasta, if there is no input FASTA) if that file is the only source of pairs, otherwise a contiguous block of pairs")
 
       ("train,T", "Baum-Welch parameter fit")
       ("wiggle-room,R", po::value<int>(), "wiggle room (allowed departure from training alignment)")
+      ("threads", po::value<size_t>()->default_value(1), "number of threads for training, counts and beam search")
+      ("train-accel", "Baum-Welch parameter fit, accelerated by SQUAREM extrapolation")
+      ("train-viterbi", "Viterbi (hard-EM) parameter fit, counting transitions on the best path only")
+      ("train-lbfgs", "parameter fit by direct L-BFGS maximization of the log-likelihood, using Forward-Backward gradients")
+      ("train-online", po::value<string>(), "online (stepwise) EM, streaming training pairs from a file with one JSON sequence pair per line")
+      ("batch-size", po::value<size_t>(), "sequence pairs per mini-batch for online EM (default 100)")
+      ("epochs", po::value<size_t>(), "passes through the training file for online EM (default 1)")
+      ("step-decay", po::value<double>(), "online EM step size: 1 for the first update, then (t+2)^(-step-decay) for update t (default 0.7)")
+      ("checkpoint", po::value<string>(), "save parameters to file periodically during online EM")
+      ("checkpoint-every", po::value<size_t>(), "mini-batches between online EM checkpoints (default 100)")
       ("align,A", "Viterbi sequence alignment")
       ("viterbi,V", "Viterbi log-likelihood calculation")
       ("loglike,L", "Forward log-likelihood calculation")
+      ("params-grid", po::value<string>(), "with --loglike, score every parameterization in a file holding a JSON array of parameter objects, in one Forward sweep")
       ("counts,C", "Forward-Backward counts (derivatives of log-likelihood with respect to logs of parameters)")
+      ("save-counts", po::value<string>(), "save raw per-transition Forward-Backward counts & log-likelihood (JSON), for use with --merge-counts")
+      ("save-counts-binary", po::value<string>(), "save raw per-transition counts & log-likelihood in binary format")
+      ("merge-counts", po::value<vector<string> >(), "sum counts saved by --save-counts or --save-counts-binary, then fit parameters (M-step) if there are constraints, or else show parameter counts")
+      ("posteriors", po::value<string>(), "save posterior probabilities of states at each Forward-Backward DP cell, as NumPy .npy arrays (one per sequence pair)")
+      ("posteriors-sparse", "with --posteriors, save only the cells inside the DP envelope, preceded by an array of envelope bounds")
+      ("posterior-groups", po::value<string>(), "with --posteriors, sum posterior probabilities over groups of states (JSON array of arrays of state ids)")
       ("beam-decode,Z", "find most likely input by beam search")
       ("beam-width", po::value<size_t>(), (string("number of sequences to track during beam search (default ") + to_string((size_t)DefaultBeamWidth) + ")").c_str())
       ("prefix-decode", "find most likely input by CTC prefix search")
@@ -253,6 +292,36 @@ int main (int argc, char** argv) {
       return EXIT_SUCCESS;
     }
     logger.parseLogArgs (vm);
+    if (vm.count("trust-input"))
+      MachineSchema::trustInput();
+
+    // build FASTA indices
+    if (vm.count("index-fasta")) {
+      for (const auto& filename: vm.at("index-fasta").as<vector<string> >())
+	FastaIndex::build (filename);
+      if (po::collect_unrecognized (parsed.options, po::include_positional).empty() && !vm.count("from-eval"))
+	return EXIT_SUCCESS;
+    }
+
+    // machine cache
+    unique_ptr<MachineCache> cache;
+    if (vm.count("cache-dir"))
+      cache.reset (new MachineCache (vm.at("cache-dir").as<string>(),
+				     vm.count("cache-size") ? (size_t) (vm.at("cache-size").as<double>() * 1e6) : 0));
+    // cache key for a list of machine-expression tokens, or the empty string if the machine can't be cached
+    auto cacheKey = [&] (const char* tag, const vector<string>& tokens) -> string {
+      if (!cache)
+	return string();
+      string key = string(tag) + "\n" + MachineCache::describeTokens (tokens);
+      for (const auto& token: tokens)
+	if (token == "--downsample-path" || token == "--downsample-frac") {  // these use the random number generator
+	  if (!vm.count("seed"))
+	    return string();
+	  key += "seed=" + to_string (vm.at("seed").as<int>()) + "\n";
+	  break;
+	}
+      return key;
+    };
 
     // random seed
     auto makeRnd = [&] () -> mt19937 {
@@ -267,7 +336,7 @@ int main (int argc, char** argv) {
     // create transducer
     list<Machine> machines;
     auto reduceMachines = [&]() -> Machine {
-      Machine machine = machines.back();
+      Machine machine = move (machines.back());
       do {
 	machines.pop_back();
 	if (machines.size())
@@ -278,6 +347,15 @@ int main (int argc, char** argv) {
 
     const vector<string> argVec = po::collect_unrecognized (parsed.options, po::include_positional);
     deque<string> args (argVec.begin(), argVec.end());
+    const string machineKey = cacheKey ("machine", argVec);
+    bool machineCached = false;
+    if (!machineKey.empty()) {
+      Machine cached;
+      if ((machineCached = cache->get (machineKey, cached))) {
+	machines.push_back (move (cached));
+	args.clear();
+      }
+    }
     while (!args.empty()) {
       function<Machine(const string&)> nextMachineForCommand;
       auto pushNextMachine = [&]() {
@@ -307,7 +385,7 @@ int main (int argc, char** argv) {
 	    cout << helpOpts << endl;
 	    throw runtime_error (string("Missing machine for ") + arg);
 	  }
-	  const Machine m = machines.back();
+	  Machine m = move (machines.back());
 	  machines.pop_back();
 	  return m;
 	};
@@ -347,9 +425,9 @@ int main (int argc, char** argv) {
 
 	Machine m;
 	if (command[0] != '-')
-	  m = MachineLoader::fromFile (command);
+	  m = loadMachine (command);
 	else if (command == "--load")
-	  m = MachineLoader::fromFile (getArg());
+	  m = loadMachine (getArg());
 	else if (command == "--preset")
 	  m = MachinePresets::makePreset (getArg().c_str());
 	else if (command == "--generate-json") {
@@ -438,8 +516,8 @@ int main (int argc, char** argv) {
 	else if (command == "--compose-cyclic")
 	  m = Machine::compose (popMachine(), nextMachine(), true, true, Machine::LeaveSilentCycles);
 	else if (command == "--flank") {
-	  const auto central = popMachine(), flanking = nextMachine();
-	  m = Machine::concatenate (Machine::concatenate (flanking, central), flanking);
+	  Machine central = popMachine(), flanking = nextMachine();
+	  m = Machine::concatenate (Machine::concatenate (Machine (flanking), move (central)), move (flanking));
 	} else if (command == "--concatenate")
 	  m = Machine::concatenate (popMachine(), nextMachine());
 	else if (command == "--intersect")
@@ -470,6 +548,10 @@ int main (int argc, char** argv) {
 	  m = popMachine().eliminateRedundantStates();
 	else if (command == "--merge-states")
 	  m = popMachine().mergeEquivalentStates();
+	else if (command == "--determinize")
+	  m = popMachine().determinize();
+	else if (command == "--minimize")
+	  m = popMachine().minimize();
 	else if (command == "--strip-names")
 	  m = popMachine().stripNames();
 	else if (command == "--pad")
@@ -497,7 +579,7 @@ int main (int argc, char** argv) {
 	  m = dm.toposort().stochasticDownsample (rng, stod (getArg()), dm.nStates());
 	} else if (command == "--flank-input-wild" || command == "--flank-output-wild" || command == "--flank-either-wild" || command == "--flank-both-wild"
 		 || command == "--flank-input-geom" || command == "--flank-output-geom") {
-	  const Machine core = popMachine();
+	  Machine core = popMachine();
 	  Machine flank;
 	  if (command == "--flank-input-wild")
 	    flank = Machine::wildRecognizer (core.inputAlphabet());
@@ -511,7 +593,7 @@ int main (int argc, char** argv) {
 	    flank = Machine::wildRecognizer (core.inputAlphabet()).weightInputs (WeightMacroUniformPriorMacro).weightInputsGeometrically (getArg());
 	  else if (command == "--flank-output-geom")
 	    flank = Machine::wildGenerator (core.outputAlphabet()).weightOutputs (WeightMacroUniformPriorMacro).weightOutputsGeometrically (getArg());
-	  return Machine::concatenate (flank, Machine::concatenate (core, flank));
+	  return Machine::concatenate (move (flank), Machine::concatenate (move (core), Machine (flank)));
 	} else if (command == "--weight") {
 	  const string wArg = getArg();
 	  m = Machine::singleTransition (parseWeightExpr (wArg));
@@ -528,6 +610,26 @@ int main (int argc, char** argv) {
 	} else if (command == "--reciprocal") {
 	  m = popMachine().pointwiseReciprocal();
 	} else if (command == "--begin") {
+	  // a bracketed group does not depend on the machines outside it, so it can be cached by itself
+	  const vector<string> pending (args.begin(), args.end());
+	  if (cache) {
+	    vector<string> group;
+	    int depth = 0;
+	    for (const auto& token: pending) {
+	      const string t = alias.count(token) ? alias.at(token) : token;
+	      if (t == "--end" || t == "-E") {
+		if (depth-- == 0)
+		  break;
+	      } else if (t == "--begin" || t == "-B")
+		++depth;
+	      group.push_back (token);
+	    }
+	    const string groupKey = cacheKey ("group", group);
+	    if (!groupKey.empty() && group.size() < pending.size() && cache->get (groupKey, m)) {
+	      args.erase (args.begin(), args.begin() + group.size() + 1);
+	      return m;
+	    }
+	  }
 	  list<Machine> pushedMachines;
 	  swap (pushedMachines, machines);
 	  while (true) {
@@ -543,6 +645,13 @@ int main (int argc, char** argv) {
 	    throw runtime_error (string("Empty '") + arg + "' ... '" + endArg + "'");
 	  m = reduceMachines();
 	  swap (pushedMachines, machines);
+	  if (cache) {
+	    // key on the tokens that were actually consumed, excluding the closing bracket
+	    const vector<string> group (pending.begin(), pending.end() - args.size() - 1);
+	    const string groupKey = cacheKey ("group", group);
+	    if (!groupKey.empty())
+	      cache->put (groupKey, m);
+	  }
 	} else if (command == "--end")
 	  throw runtime_error (string("Unmatched '") + arg + "'");
 	else if (command == "--regex") {
@@ -625,13 +734,31 @@ int main (int argc, char** argv) {
       pushNextMachine();
     }
 
-    // compose remaining transducers
-    if (machines.empty()) {
+    // machine with transition weights bound to the final parameters: loaded with --from-eval, or else built on demand
+    unique_ptr<EvaluatedMachine> boundEval;
+    if (vm.count("from-eval")) {
+      Require (machines.empty(), "Option --from-eval replaces the machine expression");
+      for (const char* opt: { "params", "functions", "constraints", "params-grid", "use-defaults", "evaluate", "save", "save-binary", "graphviz", "stats", "codegen",
+	    "train", "train-accel", "train-viterbi", "train-lbfgs", "train-online", "counts", "align",
+	    "beam-decode", "prefix-decode", "viterbi-decode", "cool-decode", "mcmc-decode", "beam-encode", "prefix-encode", "viterbi-encode", "random-encode" })
+	Require (!vm.count(opt), "Option --%s can't be used with --from-eval", opt);
+      Require (!vm.count("merge-counts"), "Option --merge-counts can't be used with --from-eval");
+      Require (vm.count("loglike") || vm.count("viterbi") || vm.count("save-eval") || vm.count("save-counts") || vm.count("save-counts-binary") || vm.count("posteriors"),
+	       "Option --from-eval needs --loglike, --viterbi, --save-counts or --posteriors");
+      boundEval.reset (new EvaluatedMachine (EvaluatedMachineBinary::fromFile (vm.at("from-eval").as<string>())));
+    } else if (machines.empty()) {
       cout << helpOpts << endl;
       cout << "Please specify a transducer" << endl;
       return 1;
     }
-    Machine machine = reduceMachines();
+
+    // compose remaining transducers
+    Machine machine;
+    if (!boundEval) {
+      machine = reduceMachines();
+      if (!machineKey.empty() && !machineCached)
+	cache->put (machineKey, machine);
+    }
 
     // load parameters and constraints
     ParamAssign seed;
@@ -646,14 +773,25 @@ int main (int argc, char** argv) {
     if (vm.count("constraints"))
       JsonLoader<Constraints>::readFiles (constraints, vm.at("constraints").as<vector<string> >());
 
+    // merging counts replaces the E-step, so there must be no data or other inference
+    if (vm.count("merge-counts")) {
+      for (const char* opt: { "data", "input-fasta", "input-json", "input-chars", "output-fasta", "output-json", "output-chars", "shard",
+	    "train", "train-accel", "train-viterbi", "train-lbfgs", "train-online", "loglike", "viterbi", "align", "counts", "params-grid" })
+	Require (!vm.count(opt), "Option --%s can't be used with --merge-counts", opt);
+    }
+    Require (!vm.count("params-grid") || vm.count("loglike"), "Option --params-grid requires --loglike");
+
     // if constraints or parameters were specified without a training or alignment step,
     // then add them to the model now; otherwise, save them for later
     const bool paramsSpecified = vm.count("params") || vm.count("functions") || vm.count("norms");
     const bool encodingRequested = vm.count("prefix-encode") || vm.count("beam-encode") || vm.count("viterbi-encode") || vm.count("random-encode");
     const bool decodingRequested = vm.count("prefix-decode") || vm.count("cool-decode") || vm.count("viterbi-decode") || vm.count("mcmc-decode") || vm.count("beam-decode");
-    const bool dpRequested = vm.count("train") || vm.count("loglike") || vm.count("viterbi") || vm.count("align") || vm.count("counts");
+    const bool dpRequested = vm.count("train") || vm.count("train-accel") || vm.count("train-viterbi") || vm.count("train-lbfgs") || vm.count("train-online") || vm.count("loglike") || vm.count("viterbi") || vm.count("align") || vm.count("counts")
+      || vm.count("save-counts") || vm.count("save-counts-binary") || vm.count("merge-counts") || vm.count("posteriors");
     const bool inferenceRequested = dpRequested || encodingRequested || decodingRequested;
     const bool evalRequested = vm.count("evaluate");
+    // cache key for machines derived from the final machine, or the empty string if the final machine was modified after construction
+    const string finalKey = (paramsSpecified && (evalRequested || !inferenceRequested)) || evalRequested ? string() : machineKey;
     if (paramsSpecified	&& (evalRequested || !inferenceRequested)) {
       machine.funcs = machine.funcs.combine(funcs,true).combine(seed,true);
       machine.cons = machine.cons.combine (constraints);
@@ -684,11 +822,13 @@ int main (int argc, char** argv) {
       else
 	machine.writeJson (out, vm.count("define-exprs"), vm.count("show-params"), vm.count("name-states"));
     };
+    if (vm.count("save-binary"))
+      MachineBinary::toFile (machine, vm.at("save-binary").as<string>(), !vm.count("binary-no-names"));
     if (vm.count("save")) {
       const string savefile = vm.at("save").as<string>();
       ofstream out (savefile);
       showMachine (out);
-    } else if (!inferenceRequested && !statsRequested && !vm.count("codegen"))
+    } else if (!vm.count("save-binary") && !vm.count("save-eval") && !inferenceRequested && !statsRequested && !vm.count("codegen"))
       showMachine (cout);
 
     // code generation
@@ -726,54 +866,110 @@ int main (int argc, char** argv) {
     SeqPairList data;
     // list of I/O pairs specified?
     if (vm.count("data"))
-      JsonLoader<SeqPairList>::readFiles (data, vm.at("data").as<vector<string> >());
+      SeqPairStreamLoader::readFiles (data, vm.at("data").as<vector<string> >());
 
     // individual inputs or outputs specified?
-    vguard<FastSeq> inFastSeqs, outFastSeqs;
+    // when streaming, FASTA records are read one at a time, and the outputs are re-read for each input
+    // with a selection, only the selected records are read, by seeking via the .fai index
+    NamedSeqSource inSeqs, outSeqs;
+    RecordSelection inSelect, outSelect;
+    if (vm.count("input-names"))
+      inSelect.parseNames (vm.at("input-names").as<string>());
+    if (vm.count("input-range"))
+      inSelect.parseRange (vm.at("input-range").as<string>());
+    if (vm.count("output-names"))
+      outSelect.parseNames (vm.at("output-names").as<string>());
+    if (vm.count("output-range"))
+      outSelect.parseRange (vm.at("output-range").as<string>());
+    // a shard is a contiguous block of FASTA records if the FASTA file is the only source of pairs, or else a contiguous block of sequence pairs.
+    // The block does not depend on whether the file is indexed: the index just lets only the shard's records be read
+    Shard shard;
+    bool shardPairs = false;
+    if (vm.count("shard")) {
+      shard = Shard::parse (vm.at("shard").as<string>());
+      Require (!vm.count("train-online"), "Option --shard can't be used with --train-online");
+      const bool shardInputs = vm.count("input-fasta");
+      const char* tag = shardInputs ? "input" : "output";
+      const string fastaOpt = string(tag) + "-fasta";
+      if (!vm.count("data") && vm.count(fastaOpt) && !vm.count(string(tag) + "-chars") && !vm.count(string(tag) + "-json"))
+	(shardInputs ? inSelect : outSelect).shard = shard;
+      else
+	shardPairs = true;
+    }
+    Require (!(vm.count("input-names") && vm.count("input-range")) && !(vm.count("output-names") && vm.count("output-range")),
+	     "Please select FASTA records by name or by range, not both");
+    Require ((vm.count("input-fasta") || inSelect.selectsAll()) && (vm.count("output-fasta") || outSelect.selectsAll()),
+	     "Options --input-names, --input-range, --output-names and --output-range need the corresponding --input-fasta or --output-fasta");
+    // when only scoring (or only exporting posteriors), the pairs are generated lazily & streamed through the scoring loop, so memory use does not grow with the input;
+    // otherwise, they are all generated up front, reading each FASTA file once
+    const bool scoringOnly = vm.count("loglike") + vm.count("viterbi") + vm.count("posteriors") == 1
+      && !vm.count("align") && !vm.count("counts") && !vm.count("save-counts") && !vm.count("save-counts-binary") && !vm.count("train") && !vm.count("train-accel") && !vm.count("train-viterbi") && !vm.count("train-lbfgs") && !vm.count("train-online")
+      && !encodingRequested && !decodingRequested;
+    const bool streamPairs = scoringOnly && (vm.count("input-fasta") || vm.count("output-fasta")) && !shardPairs;  // a block of pairs needs the pair count
+    auto openFasta = [&] (NamedSeqSource& seqs, const string& filename, const RecordSelection& select, bool rewindable) {
+      if (select.needsIndex() || (!select.shard.isWhole() && ifstream (FastaIndex::indexFilename (filename))))
+	seqs.setIndexedFile (filename, select);
+      else
+	seqs.setFile (filename, rewindable, select.shard);
+    };
     if (vm.count("input-fasta"))
-      readFastSeqs (vm.at("input-fasta").as<string>().c_str(), inFastSeqs);
+      openFasta (inSeqs, vm.at("input-fasta").as<string>(), inSelect, false);
     if (vm.count("output-fasta"))
-      readFastSeqs (vm.at("output-fasta").as<string>().c_str(), outFastSeqs);
+      openFasta (outSeqs, vm.at("output-fasta").as<string>(), outSelect, streamPairs);
     if (vm.count("input-chars")) {
       const string seq = vm.at("input-chars").as<string>();
-      inFastSeqs.push_back (FastSeq::fromSeq (seq, seq));
+      inSeqs.seqs.push_back (NamedSeqSource::fromFastSeq (FastSeq::fromSeq (seq, seq)));
     }
     if (vm.count("output-chars")) {
       const string seq = vm.at("output-chars").as<string>();
-      outFastSeqs.push_back (FastSeq::fromSeq (seq, seq));
+      outSeqs.seqs.push_back (NamedSeqSource::fromFastSeq (FastSeq::fromSeq (seq, seq)));
     }
-
-    vguard<NamedInputSeq> inSeqs;
-    vguard<NamedOutputSeq> outSeqs;
-    for (const auto& fs: inFastSeqs)
-      inSeqs.push_back (NamedInputSeq ({ fs.name, splitToChars (fs.seq) }));
-    for (const auto& fs: outFastSeqs)
-      outSeqs.push_back (NamedOutputSeq ({ fs.name, splitToChars (fs.seq) }));
     if (vm.count("input-json"))
-      inSeqs.push_back (JsonReader<NamedInputSeq>::fromFile (vm.at("input-json").as<string>()));
+      inSeqs.seqs.push_back (JsonReader<NamedInputSeq>::fromFile (vm.at("input-json").as<string>()));
     if (vm.count("output-json"))
-      outSeqs.push_back (JsonReader<NamedOutputSeq>::fromFile (vm.at("output-json").as<string>()));
+      outSeqs.seqs.push_back (JsonReader<NamedOutputSeq>::fromFile (vm.at("output-json").as<string>()));
     
     // if inputs/outputs specified individually, create all input-output pairs
-    const bool inputEmpty = machine.inputAlphabet().empty(), outputEmpty = machine.outputAlphabet().empty();
+    const bool inputEmpty = boundEval ? boundEval->inputTokenizer.tok2sym.size() == 1 : machine.inputAlphabet().empty();
+    const bool outputEmpty = boundEval ? boundEval->outputTokenizer.tok2sym.size() == 1 : machine.outputAlphabet().empty();
     if (inSeqs.empty() && ((inputEmpty && ((outputEmpty && inferenceRequested) || !outSeqs.empty())) || encodingRequested || decodingRequested))
-      inSeqs.push_back (NamedInputSeq());  // create a dummy input if we have outputs & either the input alphabet is empty, or we're encoding/decoding
+      inSeqs.seqs.push_back (NamedInputSeq());  // create a dummy input if we have outputs & either the input alphabet is empty, or we're encoding/decoding
     if (outSeqs.empty() && ((!inSeqs.empty() && outputEmpty) || encodingRequested))
-      outSeqs.push_back (NamedOutputSeq());  // create a dummy output if the output alphabet is empty, or we're encoding
-    for (const auto& inSeq: inSeqs)
-      for (const auto& outSeq: outSeqs)
-	data.seqPairs.push_back (SeqPair ({ inSeq, outSeq }));
+      outSeqs.seqs.push_back (NamedOutputSeq());  // create a dummy output if the output alphabet is empty, or we're encoding
+    SeqPairProduct product (inSeqs, outSeqs);
+
+    if (!streamPairs)
+      product.readAll (data.seqPairs);
+    auto forEachSeqPair = [&] (function<void(const SeqPair&)> callback) {
+      for (const auto& seqPair: data.seqPairs)
+	callback (seqPair);
+      if (streamPairs)
+	product.stream (callback);
+    };
 
     // after all that, do we have data? did we need data?
-    const bool noIO = machine.inputAlphabet().empty() && machine.outputAlphabet().empty();
-    if (inferenceRequested && data.seqPairs.empty() && noIO)
+    const bool noIO = inputEmpty && outputEmpty;
+    if (inferenceRequested && data.seqPairs.empty() && (!streamPairs || product.empty()) && noIO)
       data.seqPairs.push_back (SeqPair());  // if the model has no I/O, then add an automatic pair of empty, nameless sequences (the only possible evidence)
-    const bool gotData = !data.seqPairs.empty();
+    const bool gotData = !data.seqPairs.empty() || (streamPairs && !product.empty());
     Require (!gotData || inferenceRequested, "No point in specifying input/output data without --train, --loglike, --counts, --align, --*-encode, or --*-decode");
+    if (shardPairs) {
+      const size_t nPairs = data.seqPairs.size();
+      auto shardEnd = data.seqPairs.begin();
+      advance (shardEnd, shard.end (nPairs));
+      data.seqPairs.erase (shardEnd, data.seqPairs.end());
+      auto shardBegin = data.seqPairs.begin();
+      advance (shardBegin, shard.begin (nPairs));
+      data.seqPairs.erase (data.seqPairs.begin(), shardBegin);
+      LogThisAt(3,"Shard " << shard.index << "/" << shard.count << " has " << plural(data.seqPairs.size(),"sequence pair") << endl);
+    }
 
     // fit parameters
     Params params;
-    if (vm.count("train")) {
+    if (vm.count("train") || vm.count("train-accel") || vm.count("train-viterbi") || vm.count("train-lbfgs")) {
+      Require (!vm.count("train-lbfgs") || !(vm.count("train-accel") || vm.count("train-viterbi")),
+	       "Option --train-lbfgs can't be combined with --train-accel or --train-viterbi");
+      Require (!vm.count("train-online"), "Option --train-online can't be combined with the other training modes");
       Require ((vm.count("constraints") || !machine.cons.empty())
 	       && (gotData || noIO),
 	       "To fit parameters, please specify a constraints file and (for machines with input/output) a data file");
@@ -782,18 +978,114 @@ int main (int argc, char** argv) {
       if (vm.count("constraints"))
 	fitter.constraints = constraints;
       fitter.constants = funcs;
+      fitter.threads = vm.at("threads").as<size_t>();
+      fitter.accelerate = vm.count("train-accel");
+      fitter.viterbi = vm.count("train-viterbi");
+      fitter.direct = vm.count("train-lbfgs");
       fitter.seed = fitter.allConstraints().defaultParams().combine (seed, true);
       params = vm.count("wiggle-room") ? fitter.fit(data,vm.at("wiggle-room").as<int>()) : fitter.fit(data);
       cout << JsonLoader<Params>::toJsonString(params) << endl;
+    } else if (vm.count("train-online")) {
+      Require (vm.count("constraints") || !machine.cons.empty(),
+	       "To fit parameters, please specify a constraints file");
+      MachineFitter fitter;
+      fitter.machine = machine;
+      if (vm.count("constraints"))
+	fitter.constraints = constraints;
+      fitter.constants = funcs;
+      fitter.threads = vm.at("threads").as<size_t>();
+      if (vm.count("batch-size"))
+	fitter.batchSize = vm.at("batch-size").as<size_t>();
+      if (vm.count("epochs")) {
+	fitter.epochs = vm.at("epochs").as<size_t>();
+	Require (fitter.epochs >= 1, "--epochs must be at least 1");
+      }
+      if (vm.count("step-decay"))
+	fitter.stepDecay = vm.at("step-decay").as<double>();
+      if (vm.count("checkpoint"))
+	fitter.checkpointFilename = vm.at("checkpoint").as<string>();
+      if (vm.count("checkpoint-every"))
+	fitter.checkpointInterval = vm.at("checkpoint-every").as<size_t>();
+      fitter.seed = fitter.allConstraints().defaultParams().combine (seed, true);
+      SeqPairReader reader (vm.at("train-online").as<string>());
+      params = vm.count("wiggle-room") ? fitter.fitOnline(reader,vm.at("wiggle-room").as<int>()) : fitter.fitOnline(reader);
+      cout << JsonLoader<Params>::toJsonString(params) << endl;
+    } else if (vm.count("merge-counts")) {
+      // sum the partial counts, e.g. from the shards of a sharded E-step
+      MachineCounts merged;
+      size_t nFiles = 0;
+      for (const auto& filename: vm.at("merge-counts").as<vector<string> >()) {
+	const MachineCounts counts = MachineCountsBinary::fromPartialFile (filename);
+	Require (counts.fits (machine), "Counts in %s don't match the machine's transitions", filename.c_str());
+	if (nFiles++)
+	  merged += counts;
+	else
+	  merged = counts;
+      }
+      LogThisAt(2,"Merged counts from " << plural(nFiles,"file") << ": log-likelihood " << merged.loglike << endl);
+      if (vm.count("save-counts")) {
+	ofstream out (vm.at("save-counts").as<string>());
+	merged.writePartialJson (out);
+      }
+      if (vm.count("save-counts-binary"))
+	MachineCountsBinary::toFile (merged, vm.at("save-counts-binary").as<string>());
+      if (vm.count("constraints") || !machine.cons.empty()) {
+	const MachineObjective objective (machine, merged, constraints, funcs);
+	params = objective.optimize (machine.cons.combine(constraints).defaultParams().combine (seed, true));
+	cout << JsonLoader<Params>::toJsonString(params) << endl;
+      } else {
+	params = funcs.combine (seed).combine (machine.getParamDefs (vm.count("use-defaults")));
+	merged.writeParamCountsJson (cout, machine, params);
+	cout << endl;
+      }
     } else
       params = funcs.combine (seed).combine (machine.getParamDefs (vm.count("use-defaults")));
 
-    // compute sequence log-likelihoods
-    if (vm.count("loglike")) {
-      const EvaluatedMachine eval (machine, params);
+    auto getBoundEval = [&]() -> const EvaluatedMachine& {
+      if (!boundEval)
+	boundEval.reset (new EvaluatedMachine (machine, params));
+      return *boundEval;
+    };
+    if (vm.count("save-eval"))
+      EvaluatedMachineBinary::toFile (getBoundEval(), vm.at("save-eval").as<string>(), !vm.count("binary-no-names"));
+
+    // compute sequence log-likelihoods for a grid of parameterizations
+    if (vm.count("loglike") && vm.count("params-grid")) {
+      const string gridFilename = vm.at("params-grid").as<string>();
+      ifstream gridFile (gridFilename);
+      if (!gridFile)
+	Fail ("File not found: %s", gridFilename.c_str());
+      json gridJson;
+      gridFile >> gridJson;
+      Require (gridJson.is_array(), "Parameter grid must be a JSON array of parameter objects");
+      vector<Params> grid;
+      for (const auto& pj: gridJson)
+	grid.push_back (funcs.combine (seed.combine (JsonLoader<ParamAssign>::fromJson (pj), true)).combine (machine.getParamDefs (vm.count("use-defaults"))));
+      const EvaluatedMachine eval (machine);
+      const vguard<LogWeight> logTransWeight = BatchForwardMatrix::logTransWeights (eval, grid);
       cout << "[";
       size_t n = 0;
-      for (const auto& seqPair: data.seqPairs) {
+      forEachSeqPair ([&] (const SeqPair& seqPair) {
+	vguard<double> fwdLogLike (grid.size(), -numeric_limits<double>::infinity());
+	if (eval.canTokenize (seqPair)) {
+	  const BatchForwardMatrix forward (eval, logTransWeight, grid.size(), seqPair);
+	  fwdLogLike = forward.logLike();
+	}
+	cout << (n++ ? ",\n " : "")
+	     << "[\"" << escaped_str(seqPair.input.name)
+	     << "\",\"" << escaped_str(seqPair.output.name)
+	     << "\",[";
+	for (size_t k = 0; k < fwdLogLike.size(); ++k)
+	  cout << (k ? "," : "") << toInfinitySafeString (fwdLogLike[k]);
+	cout << "]]";
+      });
+      cout << "]\n";
+    } else if (vm.count("loglike")) {
+      // compute sequence log-likelihoods
+      const EvaluatedMachine& eval = getBoundEval();
+      cout << "[";
+      size_t n = 0;
+      forEachSeqPair ([&] (const SeqPair& seqPair) {
 	double fwdLogLike = -numeric_limits<double>::infinity();
 	if (eval.canTokenize (seqPair)) {
 	  const RollingOutputForwardMatrix forward (eval, seqPair);
@@ -803,32 +1095,64 @@ int main (int argc, char** argv) {
 	     << "[\"" << escaped_str(seqPair.input.name)
 	     << "\",\"" << escaped_str(seqPair.output.name)
 	     << "\"," << toInfinitySafeString (fwdLogLike) << "]";
-      }
+      });
       cout << "]\n";
     }
 
     // compute counts
-    if (vm.count("counts")) {
-      const EvaluatedMachine eval (machine, params);
-      const MachineCounts counts (eval, data);
-      counts.writeParamCountsJson (cout, machine, params);
-      cout << endl;
+    if ((vm.count("counts") || vm.count("save-counts") || vm.count("save-counts-binary")) && !vm.count("merge-counts")) {
+      const EvaluatedMachine& eval = getBoundEval();
+      const MachineCounts counts (eval, data, list<Envelope>(), vm.at("threads").as<size_t>());
+      if (vm.count("counts")) {
+	counts.writeParamCountsJson (cout, machine, params);
+	cout << endl;
+      }
+      if (vm.count("save-counts")) {
+	ofstream out (vm.at("save-counts").as<string>());
+	counts.writePartialJson (out);
+      }
+      if (vm.count("save-counts-binary"))
+	MachineCountsBinary::toFile (counts, vm.at("save-counts-binary").as<string>());
+    }
+
+    // save posterior state probabilities
+    if (vm.count("posteriors")) {
+      PosteriorWriter writer (getBoundEval(), vm.count("posteriors-sparse"));
+      if (vm.count("posterior-groups")) {
+	const string groupsFilename = vm.at("posterior-groups").as<string>();
+	ifstream groupsFile (groupsFilename);
+	if (!groupsFile)
+	  Fail ("File not found: %s", groupsFilename.c_str());
+	json groupsJson;
+	groupsFile >> groupsJson;
+	writer.setGroups (groupsJson);
+      }
+      const string filename = vm.at("posteriors").as<string>();
+      ofstream out (filename, ios::binary);
+      if (!out)
+	Fail ("Couldn't open file: %s", filename.c_str());
+      forEachSeqPair ([&] (const SeqPair& seqPair) {
+	if (vm.count("wiggle-room"))
+	  writer.write (out, seqPair, Envelope (seqPair, vm.at("wiggle-room").as<int>()));
+	else
+	  writer.write (out, seqPair);
+      });
     }
 
     // align sequences
     if (vm.count("align") || vm.count("viterbi")) {
       Require (gotData, "To align sequences, please specify a data file");
-      const EvaluatedMachine eval (machine, params);
+      const EvaluatedMachine& eval = getBoundEval();
       if (vm.count("viterbi"))
 	cout << "[";
       size_t n = 0;
       SeqPairList alignResults;
-      for (const auto& seqPair: data.seqPairs) {
+      forEachSeqPair ([&] (const SeqPair& seqPair) {
 	double vitLogLike = -numeric_limits<double>::infinity();
 	if (eval.canTokenize (seqPair)) {
 	  const ViterbiMatrix viterbi (eval, seqPair);
 	  vitLogLike = viterbi.logLike();
-	  if (vitLogLike > -numeric_limits<double>::infinity()) {
+	  if (vm.count("align") && vitLogLike > -numeric_limits<double>::infinity()) {
 	    const MachineBoundPath path (viterbi.path (machine), machine);
 	    alignResults.seqPairs.push_back (SeqPair::seqPairFromPath (path, seqPair.input.name.c_str(), seqPair.output.name.c_str()));
 	  }
@@ -838,7 +1162,7 @@ int main (int argc, char** argv) {
 	       << "[\"" << escaped_str(seqPair.input.name)
 	       << "\",\"" << escaped_str(seqPair.output.name)
 	       << "\"," << toInfinitySafeString (vitLogLike) << "]";
-      }
+      });
       if (vm.count("viterbi"))
 	cout << "]\n";
       if (vm.count("align")) {
@@ -851,8 +1175,15 @@ int main (int argc, char** argv) {
     const long maxBacktrack = vm.count("prefix-backtrack") ? vm.at("prefix-backtrack").as<long>() : numeric_limits<long>::max();
     if (encodingRequested) {
       Require (gotData, "To encode an output sequence, please specify an input sequence file");
-      const Machine trans = machine.transpose().advanceSort().advancingMachine();   // transposing makes the encoding problem into a decoding problem
-      const Machine decodeTrans = (vm.count("beam-encode") || vm.count("viterbi-encode")) ? trans.decodeSort() : trans;
+      const bool sortForEncoding = vm.count("beam-encode") || vm.count("viterbi-encode");
+      const string encodeKey = finalKey.empty() ? string() : finalKey + (sortForEncoding ? "encode-sorted\n" : "encode\n");
+      Machine decodeTrans;
+      if (encodeKey.empty() || !cache->get (encodeKey, decodeTrans)) {
+	const Machine trans = machine.transpose().advanceSort().advancingMachine();   // transposing makes the encoding problem into a decoding problem
+	decodeTrans = sortForEncoding ? trans.decodeSort() : trans;
+	if (!encodeKey.empty())
+	  cache->put (encodeKey, decodeTrans);
+      }
       const Machine silentTrans = vm.count("viterbi-encode") ? decodeTrans.silenceInput() : decodeTrans;  // silentTrans must have same state ordering as decodeTrans for Viterbi coding to work
       LogThisAt(7,"Encoding machine:" << endl << MachineLoader::toJsonString(decodeTrans) << endl);
       const EvaluatedMachine eval (silentTrans, params);
@@ -864,7 +1195,7 @@ int main (int argc, char** argv) {
 	  if (!decodeTrans.isDecodingMachine())
 	    Warn ("Machine is not topologically sorted for encoding; some valid outputs may be missed");
 	  const size_t beamWidth = vm.count("beam-width") ? vm.at("beam-width").as<size_t>() : DefaultBeamWidth;
-	  BeamSearchMatrix beam (eval, seqPair.input.seq, beamWidth);
+	  BeamSearchMatrix beam (eval, seqPair.input.seq, beamWidth, vm.at("threads").as<size_t>());
 	  encoded = beam.bestSeq();
 	} else if (vm.count("viterbi-encode")) {
 	  const auto tsp = seqPair.transpose();
@@ -888,7 +1219,13 @@ int main (int argc, char** argv) {
     // decode
     if (decodingRequested) {
       Require (gotData, "To decode an input sequence, please specify an output sequence file");
-      const Machine decodeTrans = vm.count("beam-decode") ? machine.decodeSort() : machine;
+      const string decodeKey = finalKey.empty() || !vm.count("beam-decode") ? string() : finalKey + "decode-sorted\n";
+      Machine decodeTrans;
+      if (decodeKey.empty() || !cache->get (decodeKey, decodeTrans)) {
+	decodeTrans = vm.count("beam-decode") ? machine.decodeSort() : machine;
+	if (!decodeKey.empty())
+	  cache->put (decodeKey, decodeTrans);
+      }
       const Machine silentTrans = vm.count("viterbi-decode") ? decodeTrans.silenceInput() : decodeTrans;  // silentTrans must have same state ordering as decodeTrans for Viterbi coding to work
       const EvaluatedMachine eval (silentTrans, params);
       SeqPairList decodeResults;
@@ -899,7 +1236,7 @@ int main (int argc, char** argv) {
 	  if (!decodeTrans.isDecodingMachine())
 	    Warn ("Machine is not topologically sorted for decoding; some valid inputs may be missed");
 	  const size_t beamWidth = vm.count("beam-width") ? vm.at("beam-width").as<size_t>() : DefaultBeamWidth;
-	  BeamSearchMatrix beam (eval, seqPair.output.seq, beamWidth);
+	  BeamSearchMatrix beam (eval, seqPair.output.seq, beamWidth, vm.at("threads").as<size_t>());
 	  decoded = beam.bestSeq();
 	} else if (vm.count("viterbi-decode")) {
 	  const ViterbiMatrix viterbi (eval, seqPair);